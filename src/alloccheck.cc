@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "alloccheck.hh"
+
+#ifdef ALLOC_CHECK
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "logger.hh"
+
+thread_local unsigned long AllocCheck::allocations = 0;
+thread_local int AllocCheck::paused = 0;
+static std::atomic<unsigned long> total_violations{0};
+
+void
+AllocCheck::check(const char* stage, unsigned long seq, unsigned long since) {
+	if (seq < ALLOC_CHECK_WARMUP_FRAMES || allocations == since)
+		return;
+	unsigned long n = allocations - since;
+	unsigned long before = total_violations.fetch_add(n);
+	if (before < ALLOC_CHECK_LOG_LIMIT)
+		log_error << std::to_string(n) + " allocations in the "
+			+ stage + " stage on frame " + std::to_string(seq);
+}
+
+unsigned long
+AllocCheck::violations(void) {
+	return total_violations.load();
+}
+
+#ifdef __GLIBC__
+#include <cerrno>
+#include <malloc.h>
+
+/*
+ * The C allocation functions, so every allocation in the process is seen:
+ * `operator new` of the standard library, and the `cv::Mat` buffers and
+ * scratch OpenCV takes with `cv::fastMalloc`, which uses `posix_memalign`.
+ * glibc's own entry points do the work.
+ */
+
+extern "C" {
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t n, std::size_t size);
+void* __libc_realloc(void* p, std::size_t size);
+void* __libc_memalign(std::size_t align, std::size_t size);
+}
+
+static inline void
+counted(void) {
+	if (!AllocCheck::paused)
+		AllocCheck::allocations++;
+}
+
+extern "C" void*
+malloc(std::size_t size) noexcept {
+	counted();
+	return __libc_malloc(size);
+}
+
+extern "C" void*
+calloc(std::size_t n, std::size_t size) noexcept {
+	counted();
+	return __libc_calloc(n, size);
+}
+
+extern "C" void*
+realloc(void* p, std::size_t size) noexcept {
+	if (size)
+		counted();
+	return __libc_realloc(p, size);
+}
+
+extern "C" void*
+memalign(std::size_t align, std::size_t size) noexcept {
+	counted();
+	return __libc_memalign(align, size);
+}
+
+extern "C" void*
+aligned_alloc(std::size_t align, std::size_t size) noexcept {
+	counted();
+	return __libc_memalign(align, size);
+}
+
+extern "C" int
+posix_memalign(void** out, std::size_t align, std::size_t size) noexcept {
+	if (!align || align % sizeof(void*) || (align & (align - 1)))
+		return EINVAL;
+	counted();
+	void* p = __libc_memalign(align, size);
+	if (!p)
+		return ENOMEM;
+	*out = p;
+	return 0;
+}
+#else
+/*
+ * Without glibc, only the replaceable allocation functions are counted: the
+ * C++ allocations, and not the buffers OpenCV takes with `cv::fastMalloc`.
+ * The array and nothrow forms of the standard library call these, so they
+ * need no replacement of their own.
+ */
+static void*
+counted_alloc(std::size_t size) {
+	if (!AllocCheck::paused)
+		AllocCheck::allocations++;
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+static void*
+counted_alloc(std::size_t size, std::align_val_t align) {
+	if (!AllocCheck::paused)
+		AllocCheck::allocations++;
+	std::size_t a = static_cast<std::size_t>(align);
+	if (void* p = std::aligned_alloc(a, (size + a - 1) / a * a))
+		return p;
+	throw std::bad_alloc();
+}
+
+void*
+operator new(std::size_t size) {
+	return counted_alloc(size);
+}
+
+void*
+operator new[](std::size_t size) {
+	return counted_alloc(size);
+}
+
+void*
+operator new(std::size_t size, std::align_val_t align) {
+	return counted_alloc(size, align);
+}
+
+void*
+operator new[](std::size_t size, std::align_val_t align) {
+	return counted_alloc(size, align);
+}
+
+void
+operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void
+operator delete[](void* p) noexcept {
+	std::free(p);
+}
+
+void
+operator delete(void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+void
+operator delete[](void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+void
+operator delete(void* p, std::align_val_t) noexcept {
+	std::free(p);
+}
+
+void
+operator delete[](void* p, std::align_val_t) noexcept {
+	std::free(p);
+}
+
+void
+operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+	std::free(p);
+}
+
+void
+operator delete[](void* p, std::size_t, std::align_val_t) noexcept {
+	std::free(p);
+}
+#endif // __GLIBC__
+#endif
@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ALLOCCHECK_HH
+#define ALLOCCHECK_HH
+
+// frames each pipeline stage may allocate in before it must stop
+#ifndef ALLOC_CHECK_WARMUP_FRAMES
+# define ALLOC_CHECK_WARMUP_FRAMES 100
+#endif
+// allocations after the warm-up that are logged one by one
+#ifndef ALLOC_CHECK_LOG_LIMIT
+# define ALLOC_CHECK_LOG_LIMIT 10
+#endif
+
+/**
+ * @brief Count the heap allocations made by the pipeline after its warm-up
+ *
+ * With `ALLOC_CHECK` defined (`./configure --enable-alloc-check`), the C
+ * allocation functions count the allocations of each thread, so C++ objects,
+ * `cv::Mat` buffers and OpenCV's own scratch are all seen; without glibc only
+ * the global `operator new` is replaced. The pipeline stages compare the
+ * count before and after every frame, and once a stage is past
+ * `ALLOC_CHECK_WARMUP_FRAMES`, any allocation is a violation: logged, and
+ * turned into a failing exit status by a replay.
+ *
+ * Code the pipeline does not own runs inside a `Pause` and is not counted:
+ * the frame source, OpenCV's ArUco detector, the scratch OpenCV takes inside
+ * the image functions we call, and logging. The buffers those calls fill are
+ * ours, sized outside the `Pause`, and counted. Without `ALLOC_CHECK`
+ * everything here compiles to nothing.
+ */
+class AllocCheck {
+public:
+#ifdef ALLOC_CHECK
+	static constexpr bool enabled = true;
+	static thread_local unsigned long allocations;
+	static thread_local int paused;
+
+	/**
+	 * Stop counting on this thread while in scope.
+	 */
+	struct Pause {
+		Pause() { paused++; }
+		~Pause() { paused--; }
+	};
+
+	/**
+	 * The allocations counted on this thread so far.
+	 */
+	static unsigned long count(void) { return allocations; }
+
+	/**
+	 * Check a stage made no allocation for a frame.
+	 *
+	 * @param stage  the stage name, for the log
+	 * @param seq    the frame number, nothing is checked while it is
+	 *               within the warm-up
+	 * @param since  `count()` before the stage started the frame
+	 */
+	static void check(const char* stage, unsigned long seq,
+			  unsigned long since);
+
+	/**
+	 * Allocations after the warm-up, on all threads.
+	 */
+	static unsigned long violations(void);
+#else
+	static constexpr bool enabled = false;
+	struct Pause {
+		Pause() {}
+	};
+	static unsigned long count(void) { return 0; }
+	static void check(const char*, unsigned long, unsigned long) {}
+	static unsigned long violations(void) { return 0; }
+#endif
+};
+
+#endif // ALLOCCHECK_HH
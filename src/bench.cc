@@ -0,0 +1,361 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * marvision-bench -- microbenchmarks of the marvision hot kernels
+ *
+ * Frames are synthesised by rendering markers of the marvision dictionary and
+ * warping them into a noisy background, so every run measures the same
+ * scenes. One CSV line is printed per kernel and parameter set:
+ *
+ *   kernel,markers,marker_px,perspective,blur,noise,iterations,
+ *   mean_us,p50_us,p99_us,recall
+ *
+ * `recall` is the fraction of rendered markers found by the detectors, and is
+ * empty for the other kernels.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <getopt.h>
+#include <iostream>
+#include <opencv2/aruco.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <string>
+#include <vector>
+
+#include "fastdecode.hh"
+#include "logger.hh"
+#include "vision.hh"
+
+#define BENCH_FRAME_HEIGHT 480
+
+struct SceneParams {
+	int markers; ///< number of markers in the frame
+	int marker_px; ///< side of a marker in pixels
+	double perspective; ///< corner jitter as a fraction of the side
+	double blur; ///< Gaussian blur sigma, 0 for none
+	double noise; ///< Gaussian noise sigma in grey levels
+};
+
+struct Timing {
+	double mean_us, p50_us, p99_us;
+};
+
+/**
+ * Render a frame with markers of ids 0, 1, 2... (cycling through the
+ * dictionary) laid out on a grid.
+ *
+ * @returns the number of markers rendered, fewer than asked if they do not
+ *          fit
+ */
+static int
+render_scene(const SceneParams& params, cv::RNG& rng, cv::Mat& frame) {
+	frame.create(BENCH_FRAME_HEIGHT, FRAME_WIDTH, CV_8UC3);
+	cv::randu(frame, cv::Scalar::all(60), cv::Scalar::all(200));
+	cv::GaussianBlur(frame, frame, cv::Size(0, 0), 3);
+
+	// a marker with its white quiet zone of one cell
+	int cell = params.marker_px / 6;
+	int quiet_px = params.marker_px + 2 * cell;
+	int cols = FRAME_WIDTH / (quiet_px * 3 / 2);
+	int rows = BENCH_FRAME_HEIGHT / (quiet_px * 3 / 2);
+	int n = std::min(params.markers, cols * rows);
+	int n_ids = Vision::dictionary->bytesList.rows;
+	cv::Mat marker, quiet;
+	for (int i = 0; i < n; i++) {
+		cv::aruco::generateImageMarker(*Vision::dictionary, i % n_ids,
+					       params.marker_px, marker, 1);
+		quiet.create(quiet_px, quiet_px, CV_8UC1);
+		quiet = cv::Scalar::all(255);
+		marker.copyTo(quiet(cv::Rect(cell, cell, params.marker_px,
+					     params.marker_px)));
+		cv::cvtColor(quiet, quiet, cv::COLOR_GRAY2BGR);
+
+		float cx = (i % cols + 0.5f) * FRAME_WIDTH / cols;
+		float cy = (i / cols + 0.5f) * BENCH_FRAME_HEIGHT / rows;
+		float half = quiet_px / 2.0f;
+		float jitter = params.perspective * quiet_px;
+		cv::Point2f src[4] = {
+			cv::Point2f(0, 0), cv::Point2f(quiet_px, 0),
+			cv::Point2f(quiet_px, quiet_px),
+			cv::Point2f(0, quiet_px)
+		};
+		cv::Point2f dst[4] = {
+			cv::Point2f(cx - half, cy - half),
+			cv::Point2f(cx + half, cy - half),
+			cv::Point2f(cx + half, cy + half),
+			cv::Point2f(cx - half, cy + half)
+		};
+		for (auto& p : dst)
+			p += cv::Point2f(rng.uniform(-jitter, jitter),
+					 rng.uniform(-jitter, jitter));
+		cv::warpPerspective(quiet, frame,
+				    cv::getPerspectiveTransform(src, dst),
+				    frame.size(), cv::INTER_LINEAR,
+				    cv::BORDER_TRANSPARENT);
+	}
+	if (params.blur > 0)
+		cv::GaussianBlur(frame, frame, cv::Size(0, 0), params.blur);
+	if (params.noise > 0) {
+		cv::Mat noise(frame.size(), CV_16SC3);
+		cv::randn(noise, cv::Scalar::all(0),
+			  cv::Scalar::all(params.noise));
+		cv::add(frame, noise, frame, cv::noArray(), CV_8UC3);
+	}
+	return n;
+}
+
+/**
+ * Time `iterations` calls of `kernel`.
+ */
+template <typename Kernel>
+static Timing
+time_kernel(int iterations, Kernel kernel) {
+	std::vector<double> us(iterations);
+	for (int i = 0; i < iterations; i++) {
+		auto start = std::chrono::steady_clock::now();
+		kernel(i);
+		auto end = std::chrono::steady_clock::now();
+		us[i] = std::chrono::duration<double, std::micro>(
+			end - start).count();
+	}
+	Timing timing;
+	double sum = 0;
+	for (double u : us)
+		sum += u;
+	timing.mean_us = sum / iterations;
+	std::sort(us.begin(), us.end());
+	timing.p50_us = us[iterations / 2];
+	timing.p99_us = us[std::min(iterations - 1, iterations * 99 / 100)];
+	return timing;
+}
+
+static void
+print_row(const std::string& kernel, const SceneParams& params,
+	  int iterations, const Timing& timing, double recall) {
+	std::cout << kernel << ',' << params.markers << ','
+		  << params.marker_px << ',' << params.perspective << ','
+		  << params.blur << ',' << params.noise << ',' << iterations
+		  << ',' << timing.mean_us << ',' << timing.p50_us << ','
+		  << timing.p99_us << ',';
+	if (recall >= 0)
+		std::cout << recall;
+	std::cout << std::endl;
+}
+
+static void
+bench_detectors(int iterations, cv::RNG& rng) {
+	std::vector<std::vector<cv::Point2f> > corners;
+	std::vector<int> ids;
+	cv::Mat frame;
+	for (int markers : {1, 2, 4, 8})
+	for (int marker_px : {40, 80, 160})
+	for (double perspective : {0.0, 0.1})
+	for (double blur : {0.0, 1.5})
+	for (double noise : {0.0, 8.0}) {
+		SceneParams params = {markers, marker_px, perspective, blur,
+				      noise};
+		int rendered = render_scene(params, rng, frame);
+		if (rendered < markers)
+			continue;
+		unsigned long found = 0;
+		Timing timing = time_kernel(iterations, [&](int) {
+			Vision::aruco_detector().detectMarkers(frame, corners,
+							       ids);
+			found += ids.size();
+		});
+		print_row("detect_opencv", params, iterations, timing,
+			  (double)found / iterations / rendered);
+		// what adaptive resolution does for large markers
+		for (int level = 1; level <= 2; level++) {
+			cv::Mat scaled;
+			cv::Size size(frame.cols >> level, frame.rows >> level);
+			found = 0;
+			timing = time_kernel(iterations, [&](int) {
+				cv::resize(frame, scaled, size, 0, 0,
+					   cv::INTER_AREA);
+				Vision::aruco_detector().detectMarkers(
+					scaled, corners, ids);
+				found += ids.size();
+			});
+			print_row("detect_opencv_level" + std::to_string(level),
+				  params, iterations, timing,
+				  (double)found / iterations / rendered);
+		}
+		if (!FastDecoder::ready())
+			continue;
+		found = 0;
+		timing = time_kernel(iterations, [&](int) {
+			FastDecoder::detect_markers(frame, corners, ids);
+			found += ids.size();
+		});
+		print_row("detect_fast", params, iterations, timing,
+			  (double)found / iterations / rendered);
+	}
+}
+
+/**
+ * Make `n` random markers of one side, spread over the frame.
+ */
+static void
+random_markers(int n, int id, cv::RNG& rng, std::vector<Vision::Marker>& out) {
+	out.clear();
+	for (int i = 0; i < n; i++) {
+		Vision::Marker m;
+		m.id = id;
+		float x = rng.uniform(0.0f, (float)FRAME_WIDTH);
+		float y = rng.uniform(0.0f, (float)BENCH_FRAME_HEIGHT);
+		float side = rng.uniform(10.0f, 150.0f);
+		m.corner0 = cv::Point2f(x, y);
+		m.corner1 = cv::Point2f(x + side, y);
+		m.corner2 = cv::Point2f(x + side, y + side);
+		m.corner3 = cv::Point2f(x, y + side);
+		m.set_marker();
+		out.push_back(m);
+	}
+	std::sort(out.begin(), out.end(),
+		  [](const Vision::Marker &a, const Vision::Marker &b) {
+			  return a.area > b.area;
+		  });
+}
+
+template <typename Pairing>
+static void
+bench_pairing(const std::vector<Vision::Marker>& left,
+	      const std::vector<Vision::Marker>& right,
+	      const SceneParams& params, int iterations, int batch) {
+	std::vector<Vision::Gate> gates;
+	gates.reserve(PIPELINE_MAX_MARKERS / 2);
+	Timing timing = time_kernel(iterations, [&](int) {
+		for (int i = 0; i < batch; i++) {
+			gates.clear();
+			Pairing::pair(left, right, gates);
+		}
+	});
+	timing.mean_us /= batch;
+	timing.p50_us /= batch;
+	timing.p99_us /= batch;
+	print_row(std::string("pair_") + Pairing::name, params, iterations,
+		  timing, -1);
+}
+
+static void
+bench_markers(int iterations, cv::RNG& rng) {
+	// the kernels are too fast to time one call at a time
+	const int batch = 1000;
+	SceneParams params = {1, 0, 0, 0, 0};
+	std::vector<Vision::Marker> left, right;
+	random_markers(batch, GATE_MARKER_LEFT, rng, left);
+	Timing timing = time_kernel(iterations, [&](int) {
+		for (auto& m : left)
+			m.set_marker();
+	});
+	timing.mean_us /= batch;
+	timing.p50_us /= batch;
+	timing.p99_us /= batch;
+	print_row("set_marker", params, iterations, timing, -1);
+
+	std::vector<Vision::Quad> corners;
+	std::vector<int> ids;
+	for (const auto& m : left) {
+		corners.push_back({m.corner0, m.corner1, m.corner2, m.corner3});
+		ids.push_back(m.id);
+	}
+	MarkerBatch markers;
+	markers.reserve(batch);
+	timing = time_kernel(iterations, [&](int) {
+		markers.assign(&corners[0][0].x, ids.data(), corners.size());
+	});
+	timing.mean_us /= batch;
+	timing.p50_us /= batch;
+	timing.p99_us /= batch;
+	print_row(std::string("marker_batch_") + MarkerBatch::isa(), params,
+		  iterations, timing, -1);
+	std::vector<int> indices;
+	indices.reserve(batch);
+	timing = time_kernel(iterations, [&](int) {
+		markers.select(GATE_MARKER_LEFT, indices);
+	});
+	timing.mean_us /= batch;
+	timing.p50_us /= batch;
+	timing.p99_us /= batch;
+	print_row("marker_batch_select", params, iterations, timing, -1);
+
+	// a typical calibration of the 640x480 camera
+	Pose::calibrate({600, 600, FRAME_WIDTH / 2.0, BENCH_FRAME_HEIGHT / 2.0},
+			{-0.3, 0.1, 0, 0, 0}, MARKER_SIZE_M);
+	std::vector<cv::Point3f> positions(corners.size());
+	timing = time_kernel(iterations, [&](int) {
+		Pose::locate(&corners[0][0].x, corners.size(), &positions[0].x);
+	});
+	timing.mean_us /= batch;
+	timing.p50_us /= batch;
+	timing.p99_us /= batch;
+	print_row("pose", params, iterations, timing, -1);
+
+	for (int markers : {1, 2, 4, 8}) {
+		params.markers = 2 * markers;
+		random_markers(markers, GATE_MARKER_LEFT, rng, left);
+		random_markers(markers, GATE_MARKER_RIGHT, rng, right);
+		bench_pairing<Vision::LargestMixAndMatch>(
+			left, right, params, iterations, batch);
+		bench_pairing<Vision::ForallLeftTryRight>(
+			left, right, params, iterations, batch);
+		bench_pairing<Vision::NonCrossingGates>(
+			left, right, params, iterations, batch);
+	}
+}
+
+int
+main(int argc, char* argv[]) {
+	int iterations = 50;
+	unsigned long seed = 24;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = std::max(1, std::atoi(optarg));
+			break;
+		case 's':
+			seed = std::strtoul(optarg, nullptr, 10);
+			break;
+		default:
+			std::cerr << "Usage: " << argv[0]
+				  << " [-n ITERATIONS] [-s SEED]" << std::endl;
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	Logger::get_instance("/dev/null", Logger::LogLevel::WARN);
+	Vision::init_dictionary();
+	if (!FastDecoder::ready())
+		FastDecoder::init(*Vision::dictionary);
+	cv::RNG rng(seed);
+
+	std::cout << "kernel,markers,marker_px,perspective,blur,noise,"
+		"iterations,mean_us,p50_us,p99_us,recall" << std::endl;
+	bench_detectors(iterations, rng);
+	bench_markers(iterations, rng);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "alloccheck.hh"
+#include "blackbox.hh"
+#include "config.hh"
+#include "logger.hh"
+
+std::unique_ptr<BlackBox::Slot[]> BlackBox::slots;
+int BlackBox::n_slots = 0;
+int BlackBox::level = 0;
+std::mutex BlackBox::allocating;
+std::atomic<bool> BlackBox::allocated(false);
+std::thread BlackBox::dumper;
+std::atomic<bool> BlackBox::frozen(false);
+std::atomic<bool> BlackBox::pending(false);
+std::atomic<bool> BlackBox::stopping(false);
+std::atomic<bool> BlackBox::signalled(false);
+std::atomic<unsigned long> BlackBox::decided_seq(0);
+unsigned long BlackBox::dump_after = 0;
+unsigned long BlackBox::trigger_seq = 0;
+BlackBox::Trigger BlackBox::trigger_reason = TRIGGER_SIGNAL;
+long BlackBox::last_gate_passed = -1;
+int BlackBox::unknown_streak = 0;
+std::chrono::steady_clock::time_point BlackBox::last_dump;
+
+const char*
+BlackBox::trigger_name(Trigger trigger) {
+	static const char* names[N_TRIGGERS] = {
+		"gate_passed", "pair_fallback", "unknown_streak", "signal"
+	};
+	return names[trigger];
+}
+
+void
+BlackBox::open(void) {
+	const Config& config = Config::get_instance();
+	if (config.blackbox_dir.empty() || slots)
+		return;
+	n_slots = std::max(config.blackbox_frames, BLACKBOX_MIN_FRAMES);
+	level = std::max(0, std::min(config.blackbox_level, 3));
+	slots.reset(new Slot[n_slots]);
+	last_dump = std::chrono::steady_clock::now()
+		- std::chrono::hours(1);
+	last_gate_passed = -1;
+	unknown_streak = 0;
+	struct sigaction action;
+	memset(&action, 0, sizeof action);
+	action.sa_handler = [](int) {
+		signalled.store(true, std::memory_order_relaxed);
+	};
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, nullptr);
+	stopping = false;
+	dumper = std::thread(dump_loop);
+	log_info << "Black box of " + std::to_string(n_slots)
+		+ " frames, dumped to " + config.blackbox_dir;
+}
+
+void
+BlackBox::close(void) {
+	if (!slots)
+		return;
+	stopping = true;
+	dumper.join();
+	slots.reset();
+	allocated = false;
+}
+
+void
+BlackBox::allocate(int rows, int cols) {
+	std::lock_guard<std::mutex> hold(allocating);
+	if (allocated.load())
+		return;
+	// all at once, so the memory is there before the run is under way
+	AllocCheck::Pause pause;
+	for (int i = 0; i < n_slots; i++)
+		slots[i].image.create(rows, cols, CV_8UC1);
+	allocated.store(true, std::memory_order_release);
+}
+
+void
+BlackBox::record(unsigned long seq,
+		 std::chrono::steady_clock::time_point captured,
+		 const cv::Mat& image,
+		 const std::vector<Quad>& corners,
+		 const std::vector<int>& ids) {
+	if (!slots || frozen.load(std::memory_order_relaxed) || image.empty())
+		return;
+	int rows = image.rows >> level, cols = image.cols >> level;
+	if (!allocated.load(std::memory_order_acquire))
+		allocate(rows, cols);
+	Slot& slot = slots[seq % n_slots];
+	std::unique_lock<std::mutex> hold(slot.lock, std::try_to_lock);
+	if (!hold.owns_lock() || slot.image.rows != rows
+	    || slot.image.cols != cols)
+		return;
+	const cv::Mat* grey = &image;
+	thread_local cv::Mat converted;
+	if (image.channels() != 1) {
+		AllocCheck::Pause pause; // once, on the first colour frame
+		cv::cvtColor(image, converted, cv::COLOR_BGR2GRAY);
+		grey = &converted;
+	}
+	if (level) {
+		// the scratch of the resize, not its output
+		AllocCheck::Pause pause;
+		cv::resize(*grey, slot.image, slot.image.size(), 0, 0,
+			   cv::INTER_AREA);
+	} else {
+		grey->copyTo(slot.image);
+	}
+	slot.used = true;
+	slot.seq = seq;
+	slot.captured_ns = std::chrono::duration_cast<
+		std::chrono::nanoseconds>(captured.time_since_epoch()).count();
+	slot.n_markers = std::min(ids.size(), (size_t)BLACKBOX_MAX_MARKERS);
+	for (int i = 0; i < slot.n_markers; i++) {
+		slot.ids[i] = ids[i];
+		for (int k = 0; k < 4; k++) {
+			slot.corners[i][2 * k] = corners[i][k].x;
+			slot.corners[i][2 * k + 1] = corners[i][k].y;
+		}
+	}
+	slot.output = 0;
+	slot.gate_passed = 0;
+}
+
+void
+BlackBox::trigger(Trigger reason, unsigned long seq) {
+	const Config& config = Config::get_instance();
+	auto now = std::chrono::steady_clock::now();
+	if (pending.load(std::memory_order_relaxed)
+	    || (reason != TRIGGER_SIGNAL && now - last_dump
+		< std::chrono::duration<double>(config.blackbox_cooldown_s)))
+		return;
+	last_dump = now;
+	trigger_seq = seq;
+	trigger_reason = reason;
+	dump_after = seq + std::max(0, config.blackbox_post_frames);
+	pending.store(true, std::memory_order_release);
+	AllocCheck::Pause pause;
+	log_info << std::string("Black box triggered by ")
+		+ trigger_name(reason) + " at frame " + std::to_string(seq);
+}
+
+void
+BlackBox::decided(unsigned long seq, char output, unsigned long gate_passed,
+		  bool pair_fallback) {
+	if (!slots)
+		return;
+	const Config& config = Config::get_instance();
+	{
+		Slot& slot = slots[seq % n_slots];
+		std::unique_lock<std::mutex> hold(slot.lock,
+						  std::try_to_lock);
+		if (hold.owns_lock() && slot.used && slot.seq == seq) {
+			slot.output = output;
+			slot.gate_passed = gate_passed;
+		}
+	}
+	decided_seq.store(seq, std::memory_order_release);
+
+	if (signalled.exchange(false, std::memory_order_relaxed))
+		trigger(TRIGGER_SIGNAL, seq);
+	if (last_gate_passed >= 0 && (long)gate_passed != last_gate_passed)
+		trigger(TRIGGER_GATE_PASSED, seq);
+	last_gate_passed = gate_passed;
+	if (pair_fallback)
+		trigger(TRIGGER_PAIR_FALLBACK, seq);
+	unknown_streak = output == '?' ? unknown_streak + 1 : 0;
+	if (config.blackbox_unknown_streak > 0
+	    && unknown_streak == config.blackbox_unknown_streak)
+		trigger(TRIGGER_UNKNOWN_STREAK, seq);
+}
+
+void
+BlackBox::dump_loop(void) {
+	// only ever run on a core nothing else wants
+	struct sched_param param;
+	memset(&param, 0, sizeof param);
+	if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param))
+		setpriority(PRIO_PROCESS, 0, 19);
+	for (;;) {
+		bool stop = stopping.load();
+		if (pending.load(std::memory_order_acquire)
+		    && (stop || decided_seq.load(std::memory_order_acquire)
+			>= dump_after)) {
+			dump();
+			pending.store(false, std::memory_order_release);
+		}
+		if (stop)
+			return;
+		std::this_thread::sleep_for(
+			std::chrono::milliseconds(BLACKBOX_POLL_MS));
+	}
+}
+
+void
+BlackBox::dump(void) {
+	const Config& config = Config::get_instance();
+	frozen.store(true);
+	char stamp[32];
+	time_t now = time(nullptr);
+	struct tm local;
+	strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S",
+		 localtime_r(&now, &local));
+	std::string dir = config.blackbox_dir + "/" + stamp + "-"
+		+ trigger_name(trigger_reason) + "-"
+		+ std::to_string(trigger_seq);
+	mkdir(config.blackbox_dir.c_str(), 0755);
+	if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+		log_error << "Could not create black box dump " + dir + ": "
+			+ strerror(errno);
+		frozen.store(false);
+		return;
+	}
+
+	// the slots in frame order; a worker that was mid-copy when the
+	// ring froze holds its slot's lock until it is done
+	std::vector<std::pair<unsigned long, int> > order;
+	for (int i = 0; i < n_slots; i++) {
+		std::lock_guard<std::mutex> hold(slots[i].lock);
+		if (slots[i].used)
+			order.emplace_back(slots[i].seq, i);
+	}
+	std::sort(order.begin(), order.end());
+
+	FILE* csv = fopen((dir + "/detections.csv").c_str(), "w");
+	if (csv)
+		fprintf(csv, "seq,captured_ns,output,gate_passed,id,"
+			"x0,y0,x1,y1,x2,y2,x3,y3\n");
+	char name[32];
+	for (const auto& entry : order) {
+		Slot& slot = slots[entry.second];
+		// a frame recorded over it just as the ring froze is left out
+		std::lock_guard<std::mutex> hold(slot.lock);
+		if (slot.seq != entry.first)
+			continue;
+		snprintf(name, sizeof name, "/%010lu.png", slot.seq);
+		if (!cv::imwrite(dir + name, slot.image))
+			log_warn << "Could not write " + dir + name;
+		if (!csv)
+			continue;
+		char output = slot.output ? slot.output : '-';
+		if (!slot.n_markers)
+			fprintf(csv, "%lu,%lld,%c,%lu,-1,,,,,,,,\n", slot.seq,
+				(long long)slot.captured_ns, output,
+				slot.gate_passed);
+		for (int m = 0; m < slot.n_markers; m++) {
+			fprintf(csv, "%lu,%lld,%c,%lu,%d", slot.seq,
+				(long long)slot.captured_ns, output,
+				slot.gate_passed, slot.ids[m]);
+			for (float c : slot.corners[m])
+				fprintf(csv, ",%.2f", c);
+			fprintf(csv, "\n");
+		}
+	}
+	if (csv)
+		fclose(csv);
+	log_info << "Black box dumped " + std::to_string(order.size())
+		+ " frames to " + dir + ", corners at full resolution, frames "
+		+ "scaled down by " + std::to_string(1 << level);
+	// start over, so the next dump has no frames from before this one
+	for (int i = 0; i < n_slots; i++) {
+		std::lock_guard<std::mutex> hold(slots[i].lock);
+		slots[i].used = false;
+	}
+	frozen.store(false);
+}
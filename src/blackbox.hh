@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLACKBOX_HH
+#define BLACKBOX_HH
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+
+// markers kept with each frame, the largest detections are rarely more
+#ifndef BLACKBOX_MAX_MARKERS
+# define BLACKBOX_MAX_MARKERS 16
+#endif
+// fewest slots, well over the frames in flight in the pipeline, so no two
+// workers ever record into the same slot
+#ifndef BLACKBOX_MIN_FRAMES
+# define BLACKBOX_MIN_FRAMES 32
+#endif
+// how often the dump thread looks for a pending dump
+#ifndef BLACKBOX_POLL_MS
+# define BLACKBOX_POLL_MS 50
+#endif
+
+/**
+ * @brief The last few seconds of frames, kept in memory and written to disk
+ * when something goes wrong
+ *
+ * Every frame a detection worker takes is copied, grey and scaled down by
+ * `blackbox_level` pyramid levels, into a ring of `blackbox_frames` slots
+ * allocated up front, with the markers found in it; the decision stage adds
+ * its output. Writing to the SD card on every frame would stall the
+ * pipeline, so nothing leaves memory until a trigger: a change of
+ * `gate_passed`, a pairing fallback, `blackbox_unknown_streak` '?' outputs
+ * in a row, or `SIGUSR1`.
+ *
+ * A trigger lets `blackbox_post_frames` more frames in, then a background
+ * thread at `SCHED_IDLE` freezes the ring and writes it to a directory of
+ * `blackbox_dir`: one PNG per frame, named by frame number so the directory
+ * can be replayed with `marvision -r`, and `detections.csv`. While frozen
+ * or being written, frames are not recorded; triggers within
+ * `blackbox_cooldown_s` of the last one taken are ignored.
+ *
+ * A worker records with a try-lock on its slot and never waits.
+ */
+class BlackBox {
+public:
+	typedef std::array<cv::Point2f, 4> Quad; ///< as `Vision::Quad`
+
+	enum Trigger {
+		TRIGGER_GATE_PASSED,
+		TRIGGER_PAIR_FALLBACK,
+		TRIGGER_UNKNOWN_STREAK,
+		TRIGGER_SIGNAL,
+		N_TRIGGERS
+	};
+
+	/**
+	 * Allocate the ring, install the `SIGUSR1` handler and start the
+	 * dump thread, if `blackbox_dir` is set. Call before the pipeline
+	 * threads start.
+	 */
+	static void open(void);
+
+	/**
+	 * Write a pending dump now, and stop the dump thread.
+	 */
+	static void close(void);
+
+	/**
+	 * Copy a frame and its markers into the ring. Called by the
+	 * detection workers, which record distinct frames.
+	 */
+	static void record(unsigned long seq,
+			   std::chrono::steady_clock::time_point captured,
+			   const cv::Mat& image,
+			   const std::vector<Quad>& corners,
+			   const std::vector<int>& ids);
+
+	/**
+	 * Add the decision to a recorded frame and check the triggers.
+	 * Called by the decision stage, in frame order.
+	 */
+	static void decided(unsigned long seq, char output,
+			    unsigned long gate_passed, bool pair_fallback);
+private:
+	struct Slot {
+		std::mutex lock;
+		bool used = false;
+		unsigned long seq;
+		int64_t captured_ns;
+		cv::Mat image;
+		int n_markers;
+		int ids[BLACKBOX_MAX_MARKERS];
+		float corners[BLACKBOX_MAX_MARKERS][8];
+		char output; ///< 0 until decided
+		unsigned long gate_passed;
+	};
+
+	static std::unique_ptr<Slot[]> slots;
+	static int n_slots;
+	static int level;
+	static std::mutex allocating;
+	static std::atomic<bool> allocated; ///< the slot images, on first use
+	static std::thread dumper;
+
+	static std::atomic<bool> frozen; ///< being dumped, do not record
+	static std::atomic<bool> pending; ///< a trigger waits for its dump
+	static std::atomic<bool> stopping;
+	static std::atomic<bool> signalled; ///< `SIGUSR1` arrived
+	static std::atomic<unsigned long> decided_seq; ///< the newest
+	static unsigned long dump_after; ///< dump once this is decided
+	static unsigned long trigger_seq;
+	static Trigger trigger_reason;
+
+	/* the decision stage's trigger state */
+	static long last_gate_passed; ///< -1 before the first decision
+	static int unknown_streak;
+	static std::chrono::steady_clock::time_point last_dump;
+
+	static const char* trigger_name(Trigger trigger);
+	static void trigger(Trigger reason, unsigned long seq);
+	static void allocate(int rows, int cols);
+	static void dump_loop(void);
+	static void dump(void);
+};
+
+#endif // BLACKBOX_HH
@@ -0,0 +1,169 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <opencv2/core.hpp>
+#include <string>
+
+#include "config.hh"
+#include "logger.hh"
+#include "metrics.hh"
+#include "pose.hh"
+#include "shm.hh"
+#include "uart.hh"
+#include "vision.hh"
+
+Config* Config::instance = nullptr;
+
+/**
+ * Read `key` into `value` if the key exists, else leave the default.
+ */
+template <typename T>
+static void
+read_key(const cv::FileNode& root, const char* key, T& value) {
+	cv::FileNode node = root[key];
+	if (!node.empty())
+		node >> value;
+}
+
+Config::Config(const std::string& filename)
+	: tracking(TRACKING_ENABLED),
+	  tracking_full_scan_frames(TRACKING_FULL_SCAN_FRAMES),
+	  tracking_roi_padding(TRACKING_ROI_PADDING),
+	  adaptive_resolution(ADAPTIVE_RESOLUTION),
+	  adaptive_max_level(ADAPTIVE_MAX_LEVEL),
+	  adaptive_min_marker_area(ADAPTIVE_MIN_MARKER_AREA),
+	  adaptive_full_res_frames(ADAPTIVE_FULL_RES_FRAMES),
+	  detector(DETECTOR),
+	  detector_profile(DETECTOR_PROFILE),
+	  marker_size(MARKER_SIZE),
+	  capture(CAPTURE),
+	  fresh_frames(FRESH_FRAMES),
+	  frame_deadline_ms(FRAME_DEADLINE_MS),
+	  idle_governor(IDLE_GOVERNOR),
+	  idle_after_ms(IDLE_AFTER_MS),
+	  idle_sample_ms(IDLE_SAMPLE_MS),
+	  gate_pairing(MATCH_GATE_PAIR_ALGO),
+	  gate_pass(PASS_GATE_ALGO),
+	  gate_track(GATE_TRACK),
+	  gate_track_alpha(GATE_TRACK_ALPHA),
+	  gate_track_beta(GATE_TRACK_BETA),
+	  gate_track_max_gap_ms(GATE_TRACK_MAX_GAP_MS),
+	  gate_track_lead_ms(GATE_TRACK_LEAD_MS),
+	  gate_track_reset_px(GATE_TRACK_RESET_PX),
+	  telemetry_path(TELEMETRY_PATH),
+	  telemetry_records(TELEMETRY_RECORDS),
+	  blackbox_dir(BLACKBOX_DIR),
+	  blackbox_frames(BLACKBOX_FRAMES),
+	  blackbox_post_frames(BLACKBOX_POST_FRAMES),
+	  blackbox_level(BLACKBOX_LEVEL),
+	  blackbox_unknown_streak(BLACKBOX_UNKNOWN_STREAK),
+	  blackbox_cooldown_s(BLACKBOX_COOLDOWN_S),
+	  metrics_socket(METRICS_SOCKET),
+	  shm_name(SHM_NAME),
+	  rt_mode(RT_MODE),
+	  rt_capture_cpu(RT_CAPTURE_CPU),
+	  rt_detect_cpu(RT_DETECT_CPU),
+	  rt_decide_cpu(RT_DECIDE_CPU),
+	  rt_output_cpu(RT_OUTPUT_CPU),
+	  rt_capture_priority(RT_CAPTURE_PRIORITY),
+	  rt_detect_priority(RT_DETECT_PRIORITY),
+	  rt_decide_priority(RT_DECIDE_PRIORITY),
+	  rt_output_priority(RT_OUTPUT_PRIORITY),
+	  uart_port(UART_PORT),
+	  uart_baud(UART_BAUD),
+	  uart_protocol(UART_PROTOCOL) {
+	cv::FileStorage fs;
+	try {
+		fs.open(filename, cv::FileStorage::READ);
+	} catch (const cv::Exception& e) {
+		log_error << "Could not parse config " + filename + ": "
+			+ e.what();
+	}
+	if (!fs.isOpened()) {
+		log_warn << "Config " + filename
+			+ " not loaded, using defaults";
+		return;
+	}
+	cv::FileNode root = fs.root();
+	read_key(root, "tracking", tracking);
+	read_key(root, "tracking_full_scan_frames", tracking_full_scan_frames);
+	read_key(root, "tracking_roi_padding", tracking_roi_padding);
+	read_key(root, "adaptive_resolution", adaptive_resolution);
+	read_key(root, "adaptive_max_level", adaptive_max_level);
+	read_key(root, "adaptive_min_marker_area", adaptive_min_marker_area);
+	read_key(root, "adaptive_full_res_frames", adaptive_full_res_frames);
+	read_key(root, "detector", detector);
+	read_key(root, "detector_profile", detector_profile);
+	read_key(root, "camera_intrinsics", camera_intrinsics);
+	read_key(root, "camera_distortion", camera_distortion);
+	read_key(root, "marker_size", marker_size);
+	read_key(root, "capture", capture);
+	read_key(root, "fresh_frames", fresh_frames);
+	read_key(root, "frame_deadline_ms", frame_deadline_ms);
+	read_key(root, "idle_governor", idle_governor);
+	read_key(root, "idle_after_ms", idle_after_ms);
+	read_key(root, "idle_sample_ms", idle_sample_ms);
+	read_key(root, "gate_pairing", gate_pairing);
+	read_key(root, "gate_pass", gate_pass);
+	read_key(root, "gate_track", gate_track);
+	read_key(root, "gate_track_alpha", gate_track_alpha);
+	read_key(root, "gate_track_beta", gate_track_beta);
+	read_key(root, "gate_track_max_gap_ms", gate_track_max_gap_ms);
+	read_key(root, "gate_track_lead_ms", gate_track_lead_ms);
+	read_key(root, "gate_track_reset_px", gate_track_reset_px);
+	read_key(root, "telemetry_path", telemetry_path);
+	read_key(root, "telemetry_records", telemetry_records);
+	read_key(root, "blackbox_dir", blackbox_dir);
+	read_key(root, "blackbox_frames", blackbox_frames);
+	read_key(root, "blackbox_post_frames", blackbox_post_frames);
+	read_key(root, "blackbox_level", blackbox_level);
+	read_key(root, "blackbox_unknown_streak", blackbox_unknown_streak);
+	read_key(root, "blackbox_cooldown_s", blackbox_cooldown_s);
+	read_key(root, "metrics_socket", metrics_socket);
+	read_key(root, "shm_name", shm_name);
+	read_key(root, "rt_mode", rt_mode);
+	read_key(root, "rt_capture_cpu", rt_capture_cpu);
+	read_key(root, "rt_detect_cpu", rt_detect_cpu);
+	read_key(root, "rt_decide_cpu", rt_decide_cpu);
+	read_key(root, "rt_output_cpu", rt_output_cpu);
+	read_key(root, "rt_capture_priority", rt_capture_priority);
+	read_key(root, "rt_detect_priority", rt_detect_priority);
+	read_key(root, "rt_decide_priority", rt_decide_priority);
+	read_key(root, "rt_output_priority", rt_output_priority);
+	read_key(root, "uart_port", uart_port);
+	read_key(root, "uart_baud", uart_baud);
+	read_key(root, "uart_protocol", uart_protocol);
+	if (tracking_full_scan_frames < 1)
+		tracking_full_scan_frames = 1;
+	adaptive_max_level = std::max(0, std::min(adaptive_max_level, 4));
+	if (adaptive_full_res_frames < 1)
+		adaptive_full_res_frames = 1;
+	log_info << "config loaded from " + filename;
+}
+
+Config&
+Config::get_instance(const std::string& filename) {
+	if (!instance) {
+		instance = new Config(filename);
+	}
+	return *instance;
+}
@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONFIG_HH
+#define CONFIG_HH
+
+#include <string>
+#include <vector>
+
+#ifndef CONFIG_PATH
+# define CONFIG_PATH "/etc/marvision.d/marvision.yaml"
+#endif
+
+#ifndef TRACKING_ENABLED
+# define TRACKING_ENABLED true
+#endif
+// force a full-frame scan after this many ROI-only frames
+#ifndef TRACKING_FULL_SCAN_FRAMES
+# define TRACKING_FULL_SCAN_FRAMES 10
+#endif
+// pad each ROI by this fraction of the marker size on every side
+#ifndef TRACKING_ROI_PADDING
+# define TRACKING_ROI_PADDING 0.5
+#endif
+
+// detect on a scaled-down pyramid level while the markers are large
+#ifndef ADAPTIVE_RESOLUTION
+# define ADAPTIVE_RESOLUTION true
+#endif
+// coarsest level, each level halves the width and height
+#ifndef ADAPTIVE_MAX_LEVEL
+# define ADAPTIVE_MAX_LEVEL 2
+#endif
+// smallest marker area, in pixels at the level, to detect at that level
+#ifndef ADAPTIVE_MIN_MARKER_AREA
+# define ADAPTIVE_MIN_MARKER_AREA 1024
+#endif
+// detect at full resolution after this many frames at a lower level
+#ifndef ADAPTIVE_FULL_RES_FRAMES
+# define ADAPTIVE_FULL_RES_FRAMES 10
+#endif
+
+// track the gate over frames and steer by where it will be when the output
+// is sent, see GateTracker
+#ifndef GATE_TRACK
+# define GATE_TRACK true
+#endif
+#ifndef GATE_TRACK_ALPHA
+# define GATE_TRACK_ALPHA 0.5
+#endif
+#ifndef GATE_TRACK_BETA
+# define GATE_TRACK_BETA 0.1
+#endif
+// fill frames without a gate with the prediction for this long
+#ifndef GATE_TRACK_MAX_GAP_MS
+# define GATE_TRACK_MAX_GAP_MS 200
+#endif
+// predict this much further than the decision, for the UART and controller
+#ifndef GATE_TRACK_LEAD_MS
+# define GATE_TRACK_LEAD_MS 0
+#endif
+// a gate measured this many pixels off the prediction is a new gate
+#ifndef GATE_TRACK_RESET_PX
+# define GATE_TRACK_RESET_PX 80
+#endif
+
+// marker detector: "opencv" (cv::aruco::detectMarkers), "fast" (the 4x4
+// table decoder) or "compare" (run both, report, and use OpenCV's result)
+#ifndef DETECTOR
+# define DETECTOR "opencv"
+#endif
+
+// cv::aruco::DetectorParameters profile from marvision-tune, empty for
+// OpenCV's defaults
+#ifndef DETECTOR_PROFILE
+# define DETECTOR_PROFILE DETECTOR_PROFILE_PATH
+#endif
+
+// the side of the gate markers, metres, for their distance when the camera
+// is calibrated, see Pose
+#ifndef MARKER_SIZE
+# define MARKER_SIZE MARKER_SIZE_M
+#endif
+
+// camera capture: "appsink" (greyscale frames straight from GStreamer,
+// when built with gstreamer-app) or "opencv" (cv::VideoCapture)
+#ifndef CAPTURE
+# define CAPTURE "appsink"
+#endif
+
+// hand a worker only the newest frame of the camera, when it is free
+#ifndef FRESH_FRAMES
+# define FRESH_FRAMES 1
+#endif
+// frames older than this when a worker picks them up are skipped, and
+// detected at lower cost if the usual cost would overrun it; 0 for no
+// deadline
+#ifndef FRAME_DEADLINE_MS
+# define FRAME_DEADLINE_MS 60
+#endif
+
+// with no marker seen for IDLE_AFTER_MS, read a frame from the camera only
+// every IDLE_SAMPLE_MS and scan it at half resolution, until one is seen
+#ifndef IDLE_GOVERNOR
+# define IDLE_GOVERNOR 1
+#endif
+#ifndef IDLE_AFTER_MS
+# define IDLE_AFTER_MS 2000
+#endif
+#ifndef IDLE_SAMPLE_MS
+# define IDLE_SAMPLE_MS D_SAMPLE_MS
+#endif
+
+// POSIX shared memory object the detections of every frame are published
+// in, for marvision-shm and other local readers; empty for none
+#ifndef SHM_NAME
+# define SHM_NAME SHM_PATH
+#endif
+
+// Unix socket serving the stage latencies to marvision-stat, empty for none
+#ifndef METRICS_SOCKET
+# define METRICS_SOCKET METRICS_SOCKET_PATH
+#endif
+
+// lock memory and run the pipeline threads pinned and SCHED_FIFO
+#ifndef RT_MODE
+# define RT_MODE 0
+#endif
+// the core of each thread, -1 for any; detection worker w runs on
+// RT_DETECT_CPU + w
+#ifndef RT_CAPTURE_CPU
+# define RT_CAPTURE_CPU 0
+#endif
+#ifndef RT_DETECT_CPU
+# define RT_DETECT_CPU 1
+#endif
+#ifndef RT_DECIDE_CPU
+# define RT_DECIDE_CPU 0
+#endif
+#ifndef RT_OUTPUT_CPU
+# define RT_OUTPUT_CPU 0
+#endif
+// the SCHED_FIFO priority of each thread, 0 to leave it to CFS
+#ifndef RT_CAPTURE_PRIORITY
+# define RT_CAPTURE_PRIORITY 50
+#endif
+#ifndef RT_DETECT_PRIORITY
+# define RT_DETECT_PRIORITY 40
+#endif
+#ifndef RT_DECIDE_PRIORITY
+# define RT_DECIDE_PRIORITY 55
+#endif
+#ifndef RT_OUTPUT_PRIORITY
+# define RT_OUTPUT_PRIORITY 60
+#endif
+
+// directory of the black box dumps, empty for no black box, see BlackBox
+#ifndef BLACKBOX_DIR
+# define BLACKBOX_DIR ""
+#endif
+// frames kept, and how many of them come after the trigger
+#ifndef BLACKBOX_FRAMES
+# define BLACKBOX_FRAMES 150
+#endif
+#ifndef BLACKBOX_POST_FRAMES
+# define BLACKBOX_POST_FRAMES 50
+#endif
+// frames are kept scaled down by 2^level
+#ifndef BLACKBOX_LEVEL
+# define BLACKBOX_LEVEL 1
+#endif
+// '?' outputs in a row that trigger a dump, 0 for never
+#ifndef BLACKBOX_UNKNOWN_STREAK
+# define BLACKBOX_UNKNOWN_STREAK 30
+#endif
+// triggers this soon after the last one are ignored, SIGUSR1 excepted
+#ifndef BLACKBOX_COOLDOWN_S
+# define BLACKBOX_COOLDOWN_S 30
+#endif
+
+// per-frame telemetry ring file, empty for none
+#ifndef TELEMETRY_PATH
+# define TELEMETRY_PATH ""
+#endif
+// frames kept in the telemetry ring
+#ifndef TELEMETRY_RECORDS
+# define TELEMETRY_RECORDS 32768
+#endif
+
+/**
+ * @brief The run time configuration of marvision
+ *
+ * A singleton read once from `CONFIG_PATH`, an OpenCV YAML file like the
+ * dictionary. Keys missing from the file keep their compile time defaults,
+ * so a missing file gives the same behaviour as before the file existed.
+ */
+class Config {
+private:
+	Config(const std::string& filename);
+	static Config* instance;
+public:
+	/**
+	 * Get the instance of the singleton configuration. If not exist, load
+	 * it from the file provided.
+	 */
+	static Config& get_instance(const std::string& filename = CONFIG_PATH);
+
+	bool tracking; ///< detect only around the markers seen last time
+	int tracking_full_scan_frames;
+	double tracking_roi_padding;
+	bool adaptive_resolution; ///< scale the frame down for large markers
+	int adaptive_max_level;
+	double adaptive_min_marker_area;
+	int adaptive_full_res_frames;
+	std::string detector; ///< one of "opencv", "fast" and "compare"
+	std::string detector_profile; ///< DetectorParameters file, or empty
+	std::vector<double> camera_intrinsics; ///< fx, fy, cx, cy, or empty
+	std::vector<double> camera_distortion; ///< k1, k2, p1, p2[, k3]
+	double marker_size; ///< metres
+	std::string capture; ///< "appsink" or "opencv"
+	bool fresh_frames; ///< only ever detect the newest frame
+	double frame_deadline_ms; ///< from capture to decision, 0 for none
+	bool idle_governor; ///< scan slowly while no markers are seen
+	double idle_after_ms;
+	double idle_sample_ms;
+	std::string gate_pairing; ///< see `MATCH_GATE_PAIR_ALGO`
+	std::string gate_pass; ///< see `PASS_GATE_ALGO`
+	bool gate_track; ///< steer by the tracked and predicted gate
+	double gate_track_alpha;
+	double gate_track_beta;
+	double gate_track_max_gap_ms;
+	double gate_track_lead_ms;
+	double gate_track_reset_px;
+	std::string telemetry_path; ///< empty for no telemetry
+	int telemetry_records;
+	std::string blackbox_dir; ///< empty for no black box
+	int blackbox_frames;
+	int blackbox_post_frames;
+	int blackbox_level;
+	int blackbox_unknown_streak;
+	double blackbox_cooldown_s;
+	std::string metrics_socket; ///< empty for no metrics server
+	std::string shm_name; ///< empty for no shared memory, see `Shm`
+	bool rt_mode; ///< see `Realtime`
+	int rt_capture_cpu, rt_detect_cpu, rt_decide_cpu, rt_output_cpu;
+	int rt_capture_priority, rt_detect_priority, rt_decide_priority;
+	int rt_output_priority;
+	std::string uart_port; ///< used with `ENABLE_OUTPUT`
+	int uart_baud;
+	std::string uart_protocol; ///< "char" or "frame", see uart.hh
+
+	Config (const Config&) = delete;
+	Config& operator=(const Config&) = delete;
+};
+
+typedef Config config;
+
+#endif // CONFIG_HH
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dictcache.hh"
+#include "fastdecode.hh"
+#include "logger.hh"
+
+static uint64_t
+align64(uint64_t offset) {
+	return (offset + 63) & ~(uint64_t)63;
+}
+
+/**
+ * Get the size and mtime identifying a version of the source file.
+ */
+static bool
+source_stamp(const std::string& source_path, int64_t& mtime_ns,
+	     int64_t& size) {
+	struct stat st;
+	if (stat(source_path.c_str(), &st) == -1)
+		return false;
+	mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000
+		+ st.st_mtim.tv_nsec;
+	size = st.st_size;
+	return true;
+}
+
+bool
+DictionaryCache::load(const std::string& cache_path,
+		      const std::string& source_path,
+		      cv::Ptr<cv::aruco::Dictionary>& dictionary,
+		      const uint8_t*& table) {
+	int64_t mtime_ns, size;
+	if (!source_stamp(source_path, mtime_ns, size))
+		return false;
+	int fd = open(cache_path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Header)) {
+		close(fd);
+		return false;
+	}
+	void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_warn << "Could not map dictionary cache: "
+			+ std::string(strerror(errno));
+		return false;
+	}
+	const uint8_t* base = (const uint8_t*)map;
+	const Header* header = (const Header*)map;
+	size_t bytes_size = (size_t)header->n_markers * header->bytes_cols * 4;
+	if (memcmp(header->magic, DICTIONARY_CACHE_MAGIC,
+		   sizeof header->magic)
+	    || header->version != DICTIONARY_CACHE_VERSION
+	    || header->header_size != sizeof(Header)
+	    || header->file_size != (uint64_t)st.st_size
+	    || header->source_mtime_ns != mtime_ns
+	    || header->source_size != size
+	    || header->n_markers <= 0 || header->bytes_cols <= 0
+	    || header->bytes_offset + bytes_size > header->file_size
+	    || (header->table_offset && header->table_offset
+		+ FAST_DECODE_TABLE_SIZE > header->file_size)) {
+		log_info << "Dictionary cache is stale or invalid";
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	// The mapping lives as long as the process. OpenCV only reads
+	// `bytesList`, so it can point into the read only pages.
+	cv::Mat bytes(header->n_markers, header->bytes_cols, CV_8UC4,
+		      (void*)(base + header->bytes_offset));
+	dictionary = cv::makePtr<cv::aruco::Dictionary>(
+		bytes, header->marker_size, header->max_correction_bits);
+	table = header->table_offset ? base + header->table_offset : nullptr;
+	return true;
+}
+
+bool
+DictionaryCache::store(const std::string& cache_path,
+		       const std::string& source_path,
+		       const cv::aruco::Dictionary& dictionary,
+		       const uint8_t* table) {
+	Header header;
+	memset(&header, 0, sizeof header);
+	strcpy(header.magic, DICTIONARY_CACHE_MAGIC);
+	header.version = DICTIONARY_CACHE_VERSION;
+	header.header_size = sizeof(Header);
+	if (!source_stamp(source_path, header.source_mtime_ns,
+			  header.source_size))
+		return false;
+	cv::Mat bytes = dictionary.bytesList.isContinuous()
+		? dictionary.bytesList : dictionary.bytesList.clone();
+	header.marker_size = dictionary.markerSize;
+	header.max_correction_bits = dictionary.maxCorrectionBits;
+	header.n_markers = bytes.rows;
+	header.bytes_cols = bytes.cols;
+	header.bytes_offset = align64(sizeof(Header));
+	size_t bytes_size = bytes.total() * bytes.elemSize();
+	header.table_offset = table ? align64(header.bytes_offset
+					      + bytes_size) : 0;
+	header.file_size = table ? header.table_offset
+		+ FAST_DECODE_TABLE_SIZE : header.bytes_offset + bytes_size;
+
+	size_t slash = cache_path.rfind('/');
+	if (slash != std::string::npos && slash > 0)
+		mkdir(cache_path.substr(0, slash).c_str(), 0755);
+	std::string tmp_path = cache_path + ".tmp";
+	FILE* file = fopen(tmp_path.c_str(), "wb");
+	if (!file) {
+		log_warn << "Could not write dictionary cache " + tmp_path
+			+ ": " + strerror(errno);
+		return false;
+	}
+	static const char zeros[64] = {0};
+	bool ok = fwrite(&header, sizeof header, 1, file) == 1
+		&& fwrite(zeros, header.bytes_offset - sizeof header, 1,
+			  file) == 1
+		&& fwrite(bytes.data, bytes_size, 1, file) == 1;
+	if (ok && table) {
+		size_t pad = header.table_offset - header.bytes_offset
+			- bytes_size;
+		ok = (!pad || fwrite(zeros, pad, 1, file) == 1)
+			&& fwrite(table, FAST_DECODE_TABLE_SIZE, 1, file)
+			== 1;
+	}
+	ok = fclose(file) == 0 && ok;
+	if (!ok || rename(tmp_path.c_str(), cache_path.c_str()) == -1) {
+		log_warn << "Could not write dictionary cache " + cache_path
+			+ ": " + strerror(errno);
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	log_info << "dictionary cache written to " + cache_path;
+	return true;
+}
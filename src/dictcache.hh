@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DICTCACHE_HH
+#define DICTCACHE_HH
+
+#include <cstdint>
+#include <string>
+#include <opencv2/aruco.hpp>
+
+#ifndef DICTIONARY_CACHE_PATH
+# define DICTIONARY_CACHE_PATH "/var/cache/marvision/dictionary.bin"
+#endif
+
+#define DICTIONARY_CACHE_MAGIC "MARDICT"
+#define DICTIONARY_CACHE_VERSION 1
+
+/**
+ * @brief The compiled dictionary, cached in a binary sidecar file
+ *
+ * Parsing the YAML dictionary and building the fast decoder table is done
+ * once. The result is written to `DICTIONARY_CACHE_PATH`
+ * and later boots map it read only: the dictionary's `bytesList` and the
+ * decoder table point straight into the mapping, so nothing is parsed or
+ * copied before the first frame.
+ *
+ * The cache remembers the size and mtime of the YAML it was compiled from and
+ * is ignored once the YAML changes.
+ */
+class DictionaryCache {
+public:
+	/**
+	 * The file header. The marker bytes and the table follow at the
+	 * offsets given, aligned to 64 bytes.
+	 */
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t header_size;
+		int64_t source_mtime_ns; ///< mtime of the YAML dictionary
+		int64_t source_size; ///< size of the YAML dictionary
+		int32_t marker_size;
+		int32_t max_correction_bits;
+		int32_t n_markers;
+		int32_t bytes_cols; ///< columns of the CV_8UC4 `bytesList`
+		uint64_t bytes_offset;
+		uint64_t table_offset; ///< 0 if there is no decoder table
+		uint64_t file_size;
+	};
+
+	/**
+	 * Map the cache if it is valid for the source file.
+	 *
+	 * @param cache_path   the cache file
+	 * @param source_path  the YAML dictionary the cache was built from
+	 * @param dictionary   set to a dictionary backed by the mapping
+	 * @param table        set to the decoder table in the mapping, or
+	 *                     `nullptr` if the cache has none
+	 * @returns false if there is no usable cache
+	 */
+	static bool load(const std::string& cache_path,
+			 const std::string& source_path,
+			 cv::Ptr<cv::aruco::Dictionary>& dictionary,
+			 const uint8_t*& table);
+
+	/**
+	 * Write a compiled dictionary to the cache, atomically replacing the
+	 * old one.
+	 *
+	 * @param table  the decoder table, or `nullptr`
+	 * @returns false on error, which is not fatal
+	 */
+	static bool store(const std::string& cache_path,
+			  const std::string& source_path,
+			  const cv::aruco::Dictionary& dictionary,
+			  const uint8_t* table);
+};
+
+#endif // DICTCACHE_HH
@@ -0,0 +1,413 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * marvision-dictgen -- search for a well-separated 4x4 marker dictionary and
+ * render it as a printable sheet
+ *
+ * A code is the 16 bits of a marker, row by row. The distance between two
+ * codes is the Hamming distance at the rotation that brings them closest,
+ * as the detector may see a marker any way up, and the self distance of a
+ * code is its distance to its own three rotations, so that a code that is
+ * symmetric has none. The tool looks for the codes whose smallest distance,
+ * over every pair and every self distance, is the largest, by randomised
+ * greedy passes at each target distance from the top down. Of the sets that
+ * reach it, the one with the fewest pairs at that distance is kept.
+ *
+ * The dictionary is written in the format read by `load_dictionary`, and the
+ * markers are rendered side by side on one sheet, each labelled with its id
+ * and role.
+ */
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <getopt.h>
+#include <iostream>
+#include <opencv2/aruco.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <string>
+#include <vector>
+
+#include "logger.hh"
+#include "vision.hh"
+
+// the marker side in cells, as etc/dictionary.yaml
+#define DICT_MARKER_SIZE 4
+#define DICT_BITS (DICT_MARKER_SIZE * DICT_MARKER_SIZE)
+#define DICT_CODES (1 << DICT_BITS)
+
+/// every code turned 0, 90, 180 and 270 degrees
+static std::vector<std::array<uint16_t, 4> > rotations;
+
+/**
+ * Bit `r * DICT_MARKER_SIZE + c` of a marker, counting from the first
+ * character of its string in the dictionary file, is the most significant
+ * bit of its code at that position.
+ */
+static inline int
+bit(uint16_t code, int r, int c) {
+	return code >> (DICT_BITS - 1 - r * DICT_MARKER_SIZE - c) & 1;
+}
+
+static void
+init_rotations(void) {
+	rotations.resize(DICT_CODES);
+	for (int code = 0; code < DICT_CODES; code++) {
+		uint16_t turned = code;
+		for (int k = 0; k < 4; k++) {
+			rotations[code][k] = turned;
+			// a quarter turn clockwise
+			uint16_t next = 0;
+			for (int r = 0; r < DICT_MARKER_SIZE; r++)
+				for (int c = 0; c < DICT_MARKER_SIZE; c++)
+					next = next << 1 | bit(turned,
+						DICT_MARKER_SIZE - 1 - c, r);
+			turned = next;
+		}
+	}
+}
+
+static inline int
+distance(uint16_t a, uint16_t b) {
+	int d = DICT_BITS;
+	for (int k = 0; k < 4; k++)
+		d = std::min(d, __builtin_popcount(a ^ rotations[b][k]));
+	return d;
+}
+
+static inline int
+self_distance(uint16_t code) {
+	int d = DICT_BITS;
+	for (int k = 1; k < 4; k++)
+		d = std::min(d, __builtin_popcount(code ^ rotations[code][k]));
+	return d;
+}
+
+struct Separation {
+	int min_distance; ///< over every pair and every self distance
+	int tight; ///< pairs and self distances at `min_distance`
+};
+
+static Separation
+separation(const std::vector<uint16_t>& codes) {
+	Separation s = {DICT_BITS + 1, 0};
+	auto count = [&s](int d) {
+		if (d < s.min_distance)
+			s = {d, 0};
+		if (d == s.min_distance)
+			s.tight++;
+	};
+	for (size_t i = 0; i < codes.size(); i++) {
+		count(self_distance(codes[i]));
+		for (size_t j = i + 1; j < codes.size(); j++)
+			count(distance(codes[i], codes[j]));
+	}
+	return s;
+}
+
+/**
+ * The fraction of all codes the detector would accept as some marker with
+ * up to `correction` bits corrected, i.e. how often a random candidate
+ * square passes the bit check.
+ */
+static double
+false_acceptance(const std::vector<uint16_t>& codes, int correction) {
+	int accepted = 0;
+	for (int x = 0; x < DICT_CODES; x++)
+		for (uint16_t code : codes)
+			if (distance(x, code) <= correction) {
+				accepted++;
+				break;
+			}
+	return (double)accepted / DICT_CODES;
+}
+
+/**
+ * Look for `n` codes at least `d` apart in `passes` randomised greedy
+ * passes.
+ *
+ * @param best  the set with the fewest pairs at `d`, if any pass found one
+ */
+static bool
+search(int n, int d, int passes, cv::RNG& rng, std::vector<uint16_t>& best) {
+	std::vector<uint16_t> candidates;
+	for (int code = 0; code < DICT_CODES; code++)
+		if (self_distance(code) >= d)
+			candidates.push_back(code);
+	best.clear();
+	if ((int)candidates.size() < n)
+		return false;
+	int best_tight = INT_MAX;
+	std::vector<uint16_t> chosen;
+	for (int pass = 0; pass < passes; pass++) {
+		for (size_t i = candidates.size() - 1; i > 0; i--)
+			std::swap(candidates[i],
+				  candidates[rng.uniform(0, (int)i + 1)]);
+		chosen.clear();
+		for (uint16_t code : candidates) {
+			bool apart = true;
+			for (uint16_t other : chosen)
+				if (distance(code, other) < d) {
+					apart = false;
+					break;
+				}
+			if (apart)
+				chosen.push_back(code);
+			if ((int)chosen.size() == n)
+				break;
+		}
+		if ((int)chosen.size() < n)
+			continue;
+		Separation s = separation(chosen);
+		if (s.tight < best_tight) {
+			best = chosen;
+			best_tight = s.tight;
+		}
+	}
+	return !best.empty();
+}
+
+static cv::aruco::Dictionary
+make_dictionary(const std::vector<uint16_t>& codes, int correction) {
+	cv::aruco::Dictionary dict;
+	dict.markerSize = DICT_MARKER_SIZE;
+	dict.maxCorrectionBits = correction;
+	for (uint16_t code : codes) {
+		cv::Mat bits(DICT_MARKER_SIZE, DICT_MARKER_SIZE, CV_8UC1);
+		for (int r = 0; r < DICT_MARKER_SIZE; r++)
+			for (int c = 0; c < DICT_MARKER_SIZE; c++)
+				bits.at<uchar>(r, c) = bit(code, r, c);
+		dict.bytesList.push_back(
+			cv::aruco::Dictionary::getByteListFromBits(bits));
+	}
+	return dict;
+}
+
+/**
+ * Read the codes of a dictionary file, to compare with.
+ *
+ * @returns false if it cannot be read or is not 4x4
+ */
+static bool
+read_codes(const std::string& path, std::vector<uint16_t>& codes) {
+	cv::FileStorage fs;
+	try {
+		fs.open(path, cv::FileStorage::READ);
+	} catch (const cv::Exception& e) {
+		std::cerr << "Could not parse " << path << ": " << e.what()
+			  << std::endl;
+		return false;
+	}
+	cv::aruco::Dictionary dict;
+	if (!fs.isOpened() || !dict.readDictionary(fs.root())
+	    || dict.markerSize != DICT_MARKER_SIZE) {
+		std::cerr << "Could not read a 4x4 dictionary from " << path
+			  << std::endl;
+		return false;
+	}
+	codes.clear();
+	for (int i = 0; i < dict.bytesList.rows; i++) {
+		cv::Mat bits = cv::aruco::Dictionary::getBitsFromByteList(
+			dict.bytesList.rowRange(i, i + 1), DICT_MARKER_SIZE);
+		uint16_t code = 0;
+		for (int r = 0; r < DICT_MARKER_SIZE; r++)
+			for (int c = 0; c < DICT_MARKER_SIZE; c++)
+				code = code << 1 | (bits.at<uchar>(r, c) != 0);
+		codes.push_back(code);
+	}
+	return true;
+}
+
+static std::string
+role(int id) {
+	switch (id) {
+	case GATE_MARKER_LEFT:
+		return "left gate";
+	case GATE_MARKER_RIGHT:
+		return "right gate";
+	case START_MARKER_ID:
+		return "start";
+	case GOAL_MARKER_ID:
+		return "goal";
+	default:
+		return "";
+	}
+}
+
+/**
+ * Render every marker of `dict` on one white sheet, in a grid as square as
+ * possible, with a quiet zone of a quarter marker around each and its id
+ * and role written below.
+ */
+static bool
+write_sheet(const std::string& path, const cv::aruco::Dictionary& dict,
+	    int marker_px) {
+	int n = dict.bytesList.rows;
+	int columns = std::ceil(std::sqrt((double)n));
+	int rows = (n + columns - 1) / columns;
+	int margin = marker_px / 4;
+	int label_px = marker_px / 6;
+	int cell_w = marker_px + 2 * margin;
+	int cell_h = marker_px + 2 * margin + label_px;
+	cv::Mat sheet(rows * cell_h, columns * cell_w, CV_8UC1,
+		      cv::Scalar(255));
+	double font_scale = label_px / 40.0;
+	int thickness = std::max(1, label_px / 20);
+	cv::Mat marker;
+	for (int id = 0; id < n; id++) {
+		int x = id % columns * cell_w + margin;
+		int y = id / columns * cell_h + margin;
+		cv::aruco::generateImageMarker(dict, id, marker_px, marker, 1);
+		marker.copyTo(sheet(cv::Rect(x, y, marker_px, marker_px)));
+		std::string label = std::to_string(id);
+		if (!role(id).empty())
+			label += " " + role(id);
+		cv::putText(sheet, label,
+			    cv::Point(x, y + marker_px + label_px),
+			    cv::FONT_HERSHEY_SIMPLEX, font_scale,
+			    cv::Scalar(0), thickness);
+	}
+	if (!cv::imwrite(path, sheet)) {
+		std::cerr << "Could not write " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static void
+usage(const char* argv0) {
+	std::cerr << "Usage: " << argv0
+		  << " [-n MARKERS] [-b CORRECTION_BITS] [-p PASSES] [-s SEED]"
+		     " [-x PIXELS] [-c DICTIONARY] [-o DICTIONARY] [-S SHEET]"
+		  << std::endl;
+}
+
+int
+main(int argc, char* argv[]) {
+	int n = std::max({GATE_MARKER_LEFT, GATE_MARKER_RIGHT,
+			  START_MARKER_ID, GOAL_MARKER_ID}) + 1;
+	int correction = 1;
+	int passes = 500;
+	unsigned long seed = 24;
+	int marker_px = 400;
+	std::string compare_path;
+	std::string dictionary_path = "dictionary.yaml";
+	std::string sheet_path = "markers.png";
+	int opt;
+	while ((opt = getopt(argc, argv, "n:b:p:s:x:c:o:S:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = std::max(1, std::atoi(optarg));
+			break;
+		case 'b':
+			correction = std::max(0, std::atoi(optarg));
+			break;
+		case 'p':
+			passes = std::max(1, std::atoi(optarg));
+			break;
+		case 's':
+			seed = std::strtoul(optarg, nullptr, 10);
+			break;
+		case 'x':
+			marker_px = std::max(60, std::atoi(optarg));
+			break;
+		case 'c':
+			compare_path = optarg;
+			break;
+		case 'o':
+			dictionary_path = optarg;
+			break;
+		case 'S':
+			sheet_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	Logger::get_instance("/dev/null", Logger::LogLevel::WARN);
+	init_rotations();
+	cv::RNG rng(seed);
+
+	std::vector<uint16_t> codes;
+	int d = DICT_BITS;
+	while (d > 0 && !search(n, d, passes, rng, codes))
+		d--;
+	if (!d) {
+		std::cerr << "No " << n << " distinct asymmetric codes exist"
+			  << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (2 * correction >= d)
+		std::cerr << "warning: " << correction << " correction bits "
+			"can turn one marker into another at distance " << d
+			  << std::endl;
+	Separation s = separation(codes);
+
+	cv::aruco::Dictionary dict = make_dictionary(codes, correction);
+	if (!Vision::validate_dictionary(dict)) {
+		std::cerr << "The dictionary found is not valid for marvision"
+			  << std::endl;
+		return EXIT_FAILURE;
+	}
+	cv::FileStorage fs(dictionary_path, cv::FileStorage::WRITE);
+	if (!fs.isOpened()) {
+		std::cerr << "Could not write " << dictionary_path
+			  << std::endl;
+		return EXIT_FAILURE;
+	}
+	dict.writeDictionary(fs);
+	fs.release();
+	if (!write_sheet(sheet_path, dict, marker_px))
+		return EXIT_FAILURE;
+
+	std::cerr << "dictionary written to " << dictionary_path
+		  << " and sheet to " << sheet_path << ": " << n
+		  << " markers, minimum distance " << s.min_distance << " ("
+		  << s.tight << " at it), "
+		  << false_acceptance(codes, correction) * 100
+		  << "% of random codes accepted at " << correction
+		  << " correction bits" << std::endl;
+	if (!compare_path.empty()) {
+		std::vector<uint16_t> old_codes;
+		if (!read_codes(compare_path, old_codes))
+			return EXIT_FAILURE;
+		Separation old = separation(old_codes);
+		std::cerr << compare_path << ": " << old_codes.size()
+			  << " markers, minimum distance " << old.min_distance
+			  << " (" << old.tight << " at it), "
+			  << false_acceptance(old_codes, correction) * 100
+			  << "% of random codes accepted at " << correction
+			  << " correction bits" << std::endl;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,341 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/aruco.hpp>
+#include <string>
+#include <vector>
+
+#include "alloccheck.hh"
+#include "fastdecode.hh"
+#include "logger.hh"
+
+std::vector<uint8_t> FastDecoder::table_storage;
+const uint8_t* FastDecoder::table = nullptr;
+
+/**
+ * Rotate a 4x4 code 90 degrees clockwise. Bit 15 is the top left cell and
+ * the cells are in row major order.
+ */
+static uint16_t
+rotate_code(uint16_t code) {
+	uint16_t rotated = 0;
+	for (int row = 0; row < 4; row++)
+		for (int col = 0; col < 4; col++)
+			// new (row, col) is old (3 - col, row)
+			if (code & (1 << (15 - ((3 - col) * 4 + row))))
+				rotated |= 1 << (15 - (row * 4 + col));
+	return rotated;
+}
+
+bool
+FastDecoder::build_table(const cv::aruco::Dictionary& dictionary,
+			 uint8_t* out) {
+	int n_markers = dictionary.bytesList.rows;
+	if (dictionary.markerSize != 4 || n_markers >= REJECT >> 2) {
+		log_warn << "Fast decoder supports 4x4 dictionaries of less "
+			"than 63 markers only";
+		return false;
+	}
+	// codes[id * 4 + rot] is marker id turned rot times clockwise
+	std::vector<uint16_t> codes(n_markers * 4);
+	for (int id = 0; id < n_markers; id++) {
+		cv::Mat bits = cv::aruco::Dictionary::getBitsFromByteList(
+			dictionary.bytesList.rowRange(id, id + 1), 4);
+		uint16_t code = 0;
+		for (int row = 0; row < 4; row++)
+			for (int col = 0; col < 4; col++)
+				code = code << 1 | (bits.at<uchar>(row, col)
+						    ? 1 : 0);
+		for (int rot = 0; rot < 4; rot++) {
+			codes[id * 4 + rot] = code;
+			code = rotate_code(code);
+		}
+	}
+	for (uint32_t sampled = 0; sampled < FAST_DECODE_TABLE_SIZE;
+	     sampled++) {
+		int best = -1, best_distance = 17;
+		bool tie = false;
+		for (size_t i = 0; i < codes.size(); i++) {
+			int distance = __builtin_popcount(sampled ^ codes[i]);
+			if (distance < best_distance) {
+				best = i;
+				best_distance = distance;
+				tie = false;
+			} else if (distance == best_distance
+				   && codes[i] != codes[best]) {
+				tie = true;
+			}
+		}
+		out[sampled] = (best_distance <= dictionary.maxCorrectionBits
+				&& !tie) ? best : REJECT;
+	}
+	return true;
+}
+
+bool
+FastDecoder::init(const cv::aruco::Dictionary& dictionary) {
+	table_storage.resize(FAST_DECODE_TABLE_SIZE);
+	if (!build_table(dictionary, table_storage.data()))
+		return false;
+	table = table_storage.data();
+	log_info << "fast decoder table built";
+	return true;
+}
+
+void
+FastDecoder::use_table(const uint8_t* prebuilt) {
+	table = prebuilt;
+}
+
+/**
+ * The map from the `side` pixel square of the sampled marker to a candidate
+ * quad, in closed form (Heckbert's square to quad). `warpPerspective` takes
+ * it with `WARP_INVERSE_MAP`, so nothing is solved or allocated, unlike with
+ * `cv::getPerspectiveTransform`.
+ */
+static void
+square_to_quad(const std::array<cv::Point2f, 4>& q, double side,
+	       cv::Matx33d& map) {
+	double sx = q[0].x - q[1].x + q[2].x - q[3].x;
+	double sy = q[0].y - q[1].y + q[2].y - q[3].y;
+	double g = 0, h = 0;
+	if (sx != 0 || sy != 0) {
+		double dx1 = q[1].x - q[2].x, dx2 = q[3].x - q[2].x;
+		double dy1 = q[1].y - q[2].y, dy2 = q[3].y - q[2].y;
+		double den = dx1 * dy2 - dx2 * dy1;
+		g = (sx * dy2 - dx2 * sy) / den;
+		h = (dx1 * sy - sx * dy1) / den;
+	}
+	map(0, 0) = (q[1].x - q[0].x + g * q[1].x) / side;
+	map(0, 1) = (q[3].x - q[0].x + h * q[3].x) / side;
+	map(0, 2) = q[0].x;
+	map(1, 0) = (q[1].y - q[0].y + g * q[1].y) / side;
+	map(1, 1) = (q[3].y - q[0].y + h * q[3].y) / side;
+	map(1, 2) = q[0].y;
+	map(2, 0) = g / side;
+	map(2, 1) = h / side;
+	map(2, 2) = 1;
+}
+
+/**
+ * A `rows` x `cols` view at the top left of `buffer`, which only grows, so
+ * images of varying size, e.g. ROIs or a varying number of candidates, reuse
+ * one allocation.
+ */
+static cv::Mat
+view(cv::Mat& buffer, int rows, int cols, int type) {
+	if (buffer.rows < rows || buffer.cols < cols || buffer.type() != type)
+		buffer.create(std::max(rows, buffer.rows),
+			      std::max(cols, buffer.cols), type);
+	return buffer(cv::Rect(0, 0, cols, rows));
+}
+
+/**
+ * Set the number of quads in `corners` without freeing or allocating the
+ * vector of each once warmed up: those dropped wait in `spare` for a later
+ * frame.
+ */
+static void
+resize_quads(std::vector<std::vector<cv::Point2f> >& corners, size_t n,
+	     std::vector<std::vector<cv::Point2f> >& spare) {
+	while (corners.size() > n) {
+		spare.push_back(std::move(corners.back()));
+		corners.pop_back();
+	}
+	while (corners.size() < n) {
+		if (spare.empty()) {
+			corners.emplace_back();
+		} else {
+			corners.push_back(std::move(spare.back()));
+			spare.pop_back();
+		}
+	}
+}
+
+void
+FastDecoder::detect_markers(const cv::Mat& image,
+			    std::vector<std::vector<cv::Point2f> >& corners,
+			    std::vector<int>& ids) {
+	static const int side = FAST_DECODE_CELLS * FAST_DECODE_CELL_PX;
+	thread_local cv::Mat grey_buffer, binary_buffer, warped_buffer;
+	thread_local cv::Mat cells_buffer;
+	thread_local cv::Matx33d map;
+	thread_local std::vector<std::vector<cv::Point> > contours;
+	thread_local std::vector<cv::Point> approx;
+	thread_local std::vector<std::array<cv::Point2f, 4> > candidates;
+	thread_local std::vector<float> perimeters, kept_perimeters;
+	thread_local std::vector<std::vector<cv::Point2f> > spare;
+
+	/* Every buffer here is reused from frame to frame and is sized
+	 * before the OpenCV call that fills it, so the allocation check sees
+	 * one that grows. Only the scratch OpenCV takes inside a call, which
+	 * is not ours to reuse, is paused. */
+
+	size_t found = 0;
+	ids.clear();
+	cv::Mat grey = image;
+	if (image.channels() != 1) {
+		grey = view(grey_buffer, image.rows, image.cols, CV_8UC1);
+		AllocCheck::Pause pause;
+		cv::cvtColor(image, grey, cv::COLOR_BGR2GRAY);
+	}
+
+	/* Find convex quads, as ArUco does */
+
+	cv::Mat binary = view(binary_buffer, grey.rows, grey.cols, CV_8UC1);
+	{
+		AllocCheck::Pause pause;
+		cv::adaptiveThreshold(grey, binary, 255,
+				      cv::ADAPTIVE_THRESH_MEAN_C,
+				      cv::THRESH_BINARY_INV,
+				      FAST_DECODE_THRESH_WINDOW,
+				      FAST_DECODE_THRESH_C);
+		cv::findContours(binary, contours, cv::RETR_LIST,
+				 cv::CHAIN_APPROX_NONE);
+	}
+	double max_dim = std::max(grey.cols, grey.rows);
+	size_t min_perimeter = FAST_DECODE_MIN_PERIMETER_RATE * max_dim;
+	size_t max_perimeter = FAST_DECODE_MAX_PERIMETER_RATE * max_dim;
+	candidates.clear();
+	perimeters.clear();
+	kept_perimeters.clear();
+	for (const auto& contour : contours) {
+		if (contour.size() < min_perimeter
+		    || contour.size() > max_perimeter)
+			continue;
+		{
+			AllocCheck::Pause pause;
+			cv::approxPolyDP(contour, approx,
+					 contour.size() * 0.03, true);
+		}
+		if (approx.size() != 4 || !cv::isContourConvex(approx))
+			continue;
+		std::array<cv::Point2f, 4> quad;
+		double min_side = max_dim * max_dim;
+		for (int k = 0; k < 4; k++) {
+			quad[k] = approx[k];
+			cv::Point d = approx[k] - approx[(k + 1) % 4];
+			min_side = std::min(min_side, (double)d.dot(d));
+		}
+		double min_corner_distance = contour.size() * 0.05;
+		if (min_side < min_corner_distance * min_corner_distance)
+			continue;
+		// clockwise in image coordinates, so the warp is not mirrored
+		cv::Point2f d1 = quad[1] - quad[0], d2 = quad[2] - quad[0];
+		if (d1.x * d2.y - d1.y * d2.x < 0)
+			std::swap(quad[1], quad[3]);
+		candidates.push_back(quad);
+		perimeters.push_back(contour.size());
+	}
+	if (candidates.empty()) {
+		resize_quads(corners, 0, spare);
+		return;
+	}
+
+	/* Warp every candidate into one tall image and average each cell of
+	 * all of them with a single resize */
+
+	cv::Mat warped = view(warped_buffer, candidates.size() * side, side,
+			      CV_8UC1);
+	cv::Mat cells = view(cells_buffer,
+			     candidates.size() * FAST_DECODE_CELLS,
+			     FAST_DECODE_CELLS, CV_8UC1);
+	for (size_t i = 0; i < candidates.size(); i++) {
+		square_to_quad(candidates[i], side, map);
+		cv::Mat dst = warped.rowRange(i * side, (i + 1) * side);
+		AllocCheck::Pause pause;
+		cv::warpPerspective(grey, dst, map, dst.size(),
+				    cv::INTER_NEAREST
+				    | cv::WARP_INVERSE_MAP);
+	}
+	{
+		AllocCheck::Pause pause;
+		cv::resize(warped, cells, cells.size(), 0, 0, cv::INTER_AREA);
+	}
+
+	for (size_t i = 0; i < candidates.size(); i++) {
+		const cv::Mat cell = cells.rowRange(i * FAST_DECODE_CELLS,
+						    (i + 1) * FAST_DECODE_CELLS);
+		double lo, hi;
+		cv::minMaxLoc(cell, &lo, &hi);
+		if (hi - lo < FAST_DECODE_MIN_CONTRAST)
+			continue;
+		int threshold = (lo + hi) / 2;
+		int border_errors = 0;
+		uint16_t code = 0;
+		for (int row = 0; row < FAST_DECODE_CELLS; row++) {
+			const uchar* p = cell.ptr<uchar>(row);
+			for (int col = 0; col < FAST_DECODE_CELLS; col++) {
+				bool white = p[col] > threshold;
+				if (row == 0 || col == 0
+				    || row == FAST_DECODE_CELLS - 1
+				    || col == FAST_DECODE_CELLS - 1)
+					border_errors += white;
+				else
+					code = code << 1 | white;
+			}
+		}
+		if (border_errors > FAST_DECODE_MAX_BORDER_ERRORS)
+			continue;
+		uint8_t entry = table[code];
+		if (entry == REJECT)
+			continue;
+		int id = entry >> 2, rotation = entry & 3;
+
+		// the candidate is the marker turned `rotation` times
+		// clockwise, so its first corner is the candidate's corner
+		// `rotation`
+		std::array<cv::Point2f, 4> marker;
+		for (int k = 0; k < 4; k++)
+			marker[k] = candidates[i][(k + rotation) % 4];
+
+		// the outer and the inner edge of a border may both decode,
+		// keep the larger one
+		cv::Point2f centre = (marker[0] + marker[2]) * 0.5;
+		float near = perimeters[i] / 16; // a quarter of a side
+		bool duplicate = false;
+		for (size_t j = 0; j < found; j++) {
+			cv::Point2f d = centre
+				- (corners[j][0] + corners[j][2]) * 0.5;
+			if (ids[j] != id || d.dot(d) > near * near)
+				continue;
+			duplicate = true;
+			if (kept_perimeters[j] < perimeters[i]) {
+				corners[j].assign(marker.begin(),
+						  marker.end());
+				kept_perimeters[j] = perimeters[i];
+			}
+			break;
+		}
+		if (!duplicate) {
+			if (found == corners.size())
+				resize_quads(corners, found + 1, spare);
+			corners[found++].assign(marker.begin(), marker.end());
+			ids.push_back(id);
+			kept_perimeters.push_back(perimeters[i]);
+		}
+	}
+	resize_quads(corners, found, spare);
+}
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FASTDECODE_HH
+#define FASTDECODE_HH
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/aruco.hpp>
+
+// cells per side of a marker including the one cell black border
+#define FAST_DECODE_CELLS 6
+// pixels per cell side when sampling a candidate
+#ifndef FAST_DECODE_CELL_PX
+# define FAST_DECODE_CELL_PX 4
+#endif
+#define FAST_DECODE_TABLE_SIZE 65536
+
+#ifndef FAST_DECODE_THRESH_WINDOW
+# define FAST_DECODE_THRESH_WINDOW 23
+#endif
+#ifndef FAST_DECODE_THRESH_C
+# define FAST_DECODE_THRESH_C 7
+#endif
+// candidate perimeter limits as a rate of the largest image dimension, the
+// same defaults as cv::aruco::DetectorParameters
+#ifndef FAST_DECODE_MIN_PERIMETER_RATE
+# define FAST_DECODE_MIN_PERIMETER_RATE 0.03
+#endif
+#ifndef FAST_DECODE_MAX_PERIMETER_RATE
+# define FAST_DECODE_MAX_PERIMETER_RATE 4.0
+#endif
+// cells of the border allowed to be sampled white
+#ifndef FAST_DECODE_MAX_BORDER_ERRORS
+# define FAST_DECODE_MAX_BORDER_ERRORS 3
+#endif
+// minimum difference between the darkest and brightest cell
+#ifndef FAST_DECODE_MIN_CONTRAST
+# define FAST_DECODE_MIN_CONTRAST 30
+#endif
+
+/**
+ * @brief A marker detector specialised for 4x4 dictionaries
+ *
+ * A 4x4 marker has 16 data bits, so every possible sampled code can be looked
+ * up in a table of 65536 entries, built once from the dictionary. Each entry
+ * holds `id << 2 | rotation` of the nearest marker within
+ * `maxCorrectionBits`, or `REJECT`. Identifying a candidate, correcting its
+ * bits and rejecting false candidates are then a single lookup.
+ *
+ * Candidates are found the same way as ArUco does (adaptive threshold,
+ * contours, convex quads), then all of them are warped into one image and
+ * sampled with one `cv::resize`, so the bit sampling runs in OpenCV's SIMD
+ * kernels rather than cell by cell.
+ */
+class FastDecoder {
+private:
+	static std::vector<uint8_t> table_storage;
+	static const uint8_t* table; ///< `table_storage`, or a mapped cache
+public:
+	static constexpr uint8_t REJECT = 0xff;
+
+	/**
+	 * Build the lookup table of a dictionary.
+	 *
+	 * @param dictionary  a dictionary with `markerSize` 4 and fewer than
+	 *                    63 markers
+	 * @param out         `FAST_DECODE_TABLE_SIZE` entries to fill
+	 * @returns false if the dictionary is not supported
+	 */
+	static bool build_table(const cv::aruco::Dictionary& dictionary,
+				uint8_t* out);
+
+	/**
+	 * Build the lookup table of a dictionary and use it.
+	 * @returns false if the dictionary is not supported
+	 */
+	static bool init(const cv::aruco::Dictionary& dictionary);
+
+	/**
+	 * Use a lookup table built elsewhere. It must outlive the decoder.
+	 */
+	static void use_table(const uint8_t* prebuilt);
+
+	/**
+	 * The table in use, or `nullptr`.
+	 */
+	static const uint8_t* get_table(void) { return table; }
+
+	/**
+	 * Whether a table has been built or set.
+	 */
+	static bool ready(void) { return table != nullptr; }
+
+	/**
+	 * Detect markers, with the same outputs as `cv::aruco::detectMarkers`.
+	 * Safe to call from several threads at once.
+	 */
+	static void detect_markers(
+		const cv::Mat& image,
+		std::vector<std::vector<cv::Point2f> >& corners,
+		std::vector<int>& ids);
+};
+
+#endif // FASTDECODE_HH
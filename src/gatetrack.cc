@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+
+#include "gatetrack.hh"
+
+GateTracker::GateTracker(double alpha, double beta, double reset_px)
+	: alpha(alpha), beta(beta), reset_px(reset_px), initialised(false),
+	  time(0), x(0), vx(0), w(0), vw(0) {}
+
+void
+GateTracker::update(double t, double gate_x, double gate_width) {
+	double dt = t - time;
+	if (initialised && dt > 0) {
+		double px = x + vx * dt, pw = w + vw * dt;
+		double rx = gate_x - px, rw = gate_width - pw;
+		if (std::abs(rx) <= reset_px && std::abs(rw) <= reset_px) {
+			x = px + alpha * rx;
+			vx += beta * rx / dt;
+			w = pw + alpha * rw;
+			vw += beta * rw / dt;
+			time = t;
+			return;
+		}
+	}
+	initialised = true;
+	time = t;
+	x = gate_x;
+	w = gate_width;
+	vx = vw = 0;
+}
+
+void
+GateTracker::predict(double t, double& gate_x, double& gate_width) const {
+	double dt = t - time;
+	gate_x = x + vx * dt;
+	gate_width = w + vw * dt;
+}
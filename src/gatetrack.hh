@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GATETRACK_HH
+#define GATETRACK_HH
+
+/**
+ * @brief An alpha-beta tracker of the gate centre and width
+ *
+ * Each measurement is taken at its capture time, and the state can be
+ * predicted to any later time, e.g. when the decision reaches the motor
+ * controller. The filter assumes constant velocity between measurements:
+ * `alpha` weighs the measured position against the prediction and `beta`
+ * the measured velocity.
+ */
+class GateTracker {
+private:
+	double alpha, beta;
+	double reset_px; ///< innovation that means a different gate
+	bool initialised;
+	double time; ///< seconds, of the last measurement
+	double x, vx; ///< centre, pixels and pixels per second
+	double w, vw; ///< width, likewise
+public:
+	GateTracker(double alpha, double beta, double reset_px);
+
+	/**
+	 * Forget the gate, e.g. once it is passed.
+	 */
+	void reset(void) { initialised = false; }
+
+	bool valid(void) const { return initialised; }
+
+	/**
+	 * Seconds from the last measurement to `t`.
+	 */
+	double age(double t) const { return t - time; }
+
+	/**
+	 * Correct the state with a measurement. A measurement too far from
+	 * the prediction restarts the track from it.
+	 *
+	 * @param t  capture time, seconds
+	 */
+	void update(double t, double gate_x, double gate_width);
+
+	/**
+	 * Predict the state at `t`, which must not be before the last
+	 * measurement.
+	 */
+	void predict(double t, double& gate_x, double& gate_width) const;
+};
+
+#endif // GATETRACK_HH
@@ -0,0 +1,230 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <string>
+
+#include "gstsource.hh"
+#include "logger.hh"
+
+GstSource::GstSource(const std::string& description, bool sync,
+		     bool latest, bool replay)
+	: pipeline(nullptr), sink(nullptr), caps(nullptr),
+	  timed(sync || latest),
+	  age(std::chrono::steady_clock::duration::zero()), replay(replay),
+	  recorded(std::chrono::steady_clock::duration::zero()), frames(0) {
+	gst_init(nullptr, nullptr);
+	for (auto& lease : leases) {
+		Lease* l = &lease;
+		free_leases.push([l](Lease*& slot) { slot = l; });
+	}
+
+	GError* error = nullptr;
+	pipeline = gst_parse_launch(description.c_str(), &error);
+	if (!pipeline || error) {
+		log_crit << "Could not parse GStreamer pipeline " + description
+			+ ": " + (error ? error->message : "unknown error");
+		exit(EXIT_FAILURE);
+	}
+	if (GST_IS_BIN(pipeline)) {
+		GstIterator* it = gst_bin_iterate_sinks(GST_BIN(pipeline));
+		GValue item = G_VALUE_INIT;
+		while (!sink && gst_iterator_next(it, &item)
+		       == GST_ITERATOR_OK) {
+			GstElement* element =
+				GST_ELEMENT(g_value_get_object(&item));
+			if (GST_IS_APP_SINK(element))
+				sink = GST_APP_SINK(gst_object_ref(element));
+			g_value_reset(&item);
+		}
+		g_value_unset(&item);
+		gst_iterator_free(it);
+	}
+	if (!sink) {
+		log_crit << "No appsink in GStreamer pipeline " + description;
+		exit(EXIT_FAILURE);
+	}
+
+	GstCaps* wanted = gst_caps_from_string(GST_SOURCE_CAPS);
+	gst_app_sink_set_caps(sink, wanted);
+	gst_caps_unref(wanted);
+	g_object_set(sink, "sync", (gboolean)sync,
+		     "max-buffers", latest ? 1u : (guint)GST_SOURCE_MAX_BUFFERS,
+		     "drop", (gboolean)latest, "emit-signals", FALSE, nullptr);
+
+	if (gst_element_set_state(pipeline, GST_STATE_PLAYING)
+	    == GST_STATE_CHANGE_FAILURE) {
+		log_bus_error();
+		log_crit << "Could not start GStreamer pipeline " + description;
+		exit(EXIT_FAILURE);
+	}
+	log_info << "GStreamer appsink source: " + description;
+}
+
+GstSource::~GstSource() {
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+	if (caps)
+		gst_caps_unref(caps);
+	gst_object_unref(sink);
+	gst_object_unref(pipeline);
+}
+
+void
+GstSource::log_bus_error(void) {
+	GstBus* bus = gst_element_get_bus(pipeline);
+	GstMessage* msg = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR);
+	if (msg) {
+		GError* error = nullptr;
+		gchar* debug = nullptr;
+		gst_message_parse_error(msg, &error, &debug);
+		log_error << std::string("GStreamer: ") + error->message
+			+ (debug ? std::string(" (") + debug + ")" : "");
+		g_error_free(error);
+		g_free(debug);
+		gst_message_unref(msg);
+	}
+	gst_object_unref(bus);
+}
+
+GstClockTime
+GstSource::running_time(GstSample* sample) {
+	GstBuffer* buffer = gst_sample_get_buffer(sample);
+	GstSegment* segment = gst_sample_get_segment(sample);
+	if (!buffer || !segment
+	    || !GST_CLOCK_TIME_IS_VALID(GST_BUFFER_PTS(buffer)))
+		return GST_CLOCK_TIME_NONE;
+	return gst_segment_to_running_time(segment, GST_FORMAT_TIME,
+					   GST_BUFFER_PTS(buffer));
+}
+
+std::chrono::steady_clock::duration
+GstSource::sample_age(GstSample* sample) {
+	GstClock* clock = gst_element_get_clock(pipeline);
+	std::chrono::steady_clock::duration age =
+		std::chrono::steady_clock::duration::zero();
+	if (!clock)
+		return age;
+	GstClockTime captured = running_time(sample);
+	GstClockTime now = gst_clock_get_time(clock)
+		- gst_element_get_base_time(pipeline);
+	gst_object_unref(clock);
+	if (GST_CLOCK_TIME_IS_VALID(captured) && now > captured)
+		age = std::chrono::nanoseconds(now - captured);
+	return age;
+}
+
+bool
+GstSource::acquire(cv::Mat& image, void*& lease) {
+	lease = nullptr;
+	GstSample* sample = gst_app_sink_pull_sample(sink);
+	if (!sample) {
+		// end of stream, or the pipeline stopped on an error
+		if (!gst_app_sink_is_eos(sink))
+			log_bus_error();
+		return false;
+	}
+	if (timed)
+		age = sample_age(sample);
+	if (replay) {
+		GstClockTime pts = running_time(sample);
+		auto next = std::chrono::duration_cast<
+			std::chrono::steady_clock::duration>(
+				std::chrono::nanoseconds(pts));
+		// the time never stands still or goes back
+		if (!GST_CLOCK_TIME_IS_VALID(pts)
+		    || (frames && next <= recorded))
+			next = recorded + std::chrono::duration_cast<
+				std::chrono::steady_clock::duration>(
+					std::chrono::duration<double>(
+						1.0 / REPLAY_IMAGE_FPS));
+		recorded = next;
+		frames++;
+	}
+
+	GstCaps* sample_caps = gst_sample_get_caps(sample);
+	if (sample_caps != caps) {
+		if (!sample_caps || !gst_video_info_from_caps(&info,
+							       sample_caps)) {
+			log_error << "Frame without usable video caps";
+			gst_sample_unref(sample);
+			image.release();
+			return true;
+		}
+		gst_caps_replace(&caps, sample_caps);
+		log_info << std::string("appsink negotiated ")
+			+ GST_VIDEO_INFO_NAME(&info) + " "
+			+ std::to_string(GST_VIDEO_INFO_WIDTH(&info)) + "x"
+			+ std::to_string(GST_VIDEO_INFO_HEIGHT(&info));
+	}
+
+	Lease** slot;
+	unsigned spins = 0;
+	while (!(slot = free_leases.front()))
+		ring_wait(spins);
+	Lease* l = *slot;
+	free_leases.pop();
+
+	l->sample = sample;
+	l->buffer = gst_sample_get_buffer(sample);
+	if (!l->buffer || !gst_buffer_map(l->buffer, &l->map, GST_MAP_READ)) {
+		log_error << "Could not map a frame";
+		gst_sample_unref(sample);
+		free_leases.push([l](Lease*& s) { s = l; });
+		image.release();
+		return true;
+	}
+	// the producer's own layout wins over the one implied by the caps
+	size_t offset = GST_VIDEO_INFO_PLANE_OFFSET(&info, 0);
+	size_t stride = GST_VIDEO_INFO_PLANE_STRIDE(&info, 0);
+	GstVideoMeta* meta = gst_buffer_get_video_meta(l->buffer);
+	if (meta) {
+		offset = meta->offset[0];
+		stride = meta->stride[0];
+	}
+	image = cv::Mat(GST_VIDEO_INFO_HEIGHT(&info),
+			GST_VIDEO_INFO_WIDTH(&info), CV_8UC1,
+			l->map.data + offset, stride);
+	lease = l;
+	return true;
+}
+
+void
+GstSource::release(void* lease) {
+	Lease* l = static_cast<Lease*>(lease);
+	gst_buffer_unmap(l->buffer, &l->map);
+	gst_sample_unref(l->sample);
+	free_leases.push([l](Lease*& slot) { slot = l; });
+}
+
+bool
+GstSource::read(cv::Mat& image) {
+	cv::Mat frame;
+	void* lease;
+	if (!acquire(frame, lease))
+		return false;
+	if (!lease) {
+		image.release();
+		return true;
+	}
+	frame.copyTo(image);
+	release(lease);
+	return true;
+}
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GSTSOURCE_HH
+#define GSTSOURCE_HH
+
+#include <string>
+#include <chrono>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+#include <opencv2/core.hpp>
+
+#include "ring.hh"
+#include "source.hh"
+
+// formats asked of the appsink, all with a full resolution luma plane first
+#ifndef GST_SOURCE_CAPS
+# define GST_SOURCE_CAPS "video/x-raw,format=(string){GRAY8,I420,NV12}"
+#endif
+// buffers queued in the appsink before upstream is held back
+#ifndef GST_SOURCE_MAX_BUFFERS
+# define GST_SOURCE_MAX_BUFFERS 2
+#endif
+// frames that may be out of the source at once, must be a power of two and
+// more than the pipeline can hold, DETECT_WORKERS * (PIPELINE_RING_SIZE + 1)
+#ifndef GST_SOURCE_LEASES
+# define GST_SOURCE_LEASES 32
+#endif
+
+/**
+ * @brief Greyscale frames straight from a GStreamer appsink
+ *
+ * The appsink asks upstream for GRAY8, I420 or NV12, and the image handed to
+ * the pipeline is the luma plane of the `GstBuffer` itself, so a frame is
+ * neither colour converted nor copied on its way to the detector. The buffer
+ * stays mapped until the detection worker gives it back with `release()`,
+ * which returns it to its pool.
+ */
+class GstSource : public FrameSource {
+private:
+	struct Lease {
+		GstSample* sample;
+		GstBuffer* buffer;
+		GstMapInfo map;
+	};
+	GstElement* pipeline;
+	GstAppSink* sink;
+	GstCaps* caps; ///< the caps `info` was read from
+	GstVideoInfo info;
+	/// the frames are delivered in time with the clock, so their
+	/// timestamps tell their age
+	bool timed;
+	/// the age of the last frame acquired, see `frame_age()`
+	std::chrono::steady_clock::duration age;
+	bool replay; ///< the pipeline plays a recording
+	/// the timestamp of the last frame acquired, see `recorded_time()`
+	std::chrono::steady_clock::duration recorded;
+	unsigned long frames; ///< acquired, to time frames without a PTS
+	Lease leases[GST_SOURCE_LEASES];
+	MpscRing<Lease*, GST_SOURCE_LEASES> free_leases;
+
+	/**
+	 * Log the error that stopped the pipeline, if any.
+	 */
+	void log_bus_error(void);
+
+	/**
+	 * The running time of a sample's presentation timestamp,
+	 * `GST_CLOCK_TIME_NONE` if its buffer has none.
+	 */
+	static GstClockTime running_time(GstSample* sample);
+
+	/**
+	 * How long ago the frame of a sample was captured, 0 if its buffer
+	 * has no timestamp or the pipeline no clock.
+	 */
+	std::chrono::steady_clock::duration sample_age(GstSample* sample);
+public:
+	/**
+	 * Start a pipeline, e.g. the camera or
+	 * `videotestsrc num-buffers=500 ! appsink`. Its first appsink
+	 * delivers the frames.
+	 *
+	 * @param sync    deliver the frames at their timestamps, e.g. to
+	 *                replay a file at its frame rate, rather than as fast
+	 *                as possible
+	 * @param latest  keep only the newest frame in the appsink and drop
+	 *                the older ones, for a live camera; otherwise every
+	 *                frame is delivered
+	 * @param replay  the pipeline plays a recording, whose timestamps
+	 *                time the frames, see `recorded_time()`
+	 */
+	GstSource(const std::string& description, bool sync = false,
+		  bool latest = false, bool replay = false);
+	~GstSource();
+
+	GstSource(const GstSource&) = delete;
+	GstSource& operator=(const GstSource&) = delete;
+
+	bool read(cv::Mat& image) override;
+	bool acquire(cv::Mat& image, void*& lease) override;
+	void release(void* lease) override;
+
+	/**
+	 * The running time of the pipeline now, less the running time of the
+	 * last frame's presentation timestamp. For a live camera the
+	 * timestamp is taken when the sensor exposed the frame. Always 0 for
+	 * a replay that is neither `sync` nor `latest`, as it does not keep
+	 * to the clock.
+	 */
+	std::chrono::steady_clock::duration frame_age(void) const override {
+		return age;
+	}
+
+	/**
+	 * The running time of the last frame's presentation timestamp, for a
+	 * `replay`. A frame without one is taken to follow the last at
+	 * `REPLAY_IMAGE_FPS`.
+	 */
+	bool
+	recorded_time(std::chrono::steady_clock::duration& time)
+		const override {
+		time = recorded;
+		return replay;
+	}
+};
+
+#endif // GSTSOURCE_HH
@@ -20,22 +20,35 @@
  */
 
 #include "logger.hh"
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <cstdio>
 #include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <thread>
 
 Logger* Logger::instance = nullptr;
+std::atomic<Logger::LogLevel> Logger::loglevel{LogLevel::DEBUG};
+thread_local Logger::LogLevel Logger::curr_msg_loglevel = LogLevel::INFO;
 
 Logger::Logger(const std::string& filename, LogLevel level)
-	: loglevel(level), curr_msg_loglevel(level), logfile(nullptr) {
+	: logfile(nullptr) {
+	loglevel = level;
 	logfile = fopen(filename.c_str(), "a");
 	if (!logfile) {
 		std::cerr << "Could not open log file: " << filename
 			  << " (" << errno << ": " << strerror(errno) << ")"
 			  << std::endl;
 	}
+#ifdef LOG_ASYNC
+	dropped = 0;
+	stopping = false;
+	writer = std::thread(&Logger::writer_loop, this);
+	std::atexit(stop_writer);
+#endif
 }
 
 Logger::~Logger() {
@@ -70,22 +83,133 @@ Logger::print_log_level(LogLevel loglevel) const {
 }
 
 void
-Logger::log(const std::string& message, LogLevel level) {
-	if (logfile && level >= loglevel) {
-		std::time_t now = std::time(nullptr);
-		char time_str[200];
-		std::strftime(time_str, sizeof time_str, "%Y-%m-%d %H:%M:%S",
-			      std::localtime(&now));
+Logger::write(std::chrono::system_clock::time_point time, LogLevel level,
+	      const char* message) {
+	std::time_t now = std::chrono::system_clock::to_time_t(time);
+	struct tm local;
+	char time_str[200];
+	localtime_r(&now, &local);
+	std::strftime(time_str, sizeof time_str, "%Y-%m-%d %H:%M:%S",
+		      &local);
+	if (logfile)
 		fprintf(logfile, "%s [%s] \t%s\n", time_str,
-			print_log_level(level).c_str(), message.c_str());
-		fflush(logfile);
+			print_log_level(level).c_str(), message);
 #ifdef LOG_COPY_STDERR
-		fprintf(stderr, "%s [%s] \t%s\n", time_str,
-			print_log_level(level).c_str(), message.c_str());
+	fprintf(stderr, "%s [%s] \t%s\n", time_str,
+		print_log_level(level).c_str(), message);
+#endif
+}
+
+void
+Logger::log(const std::string& message, LogLevel level) {
+	if (!enabled(level))
+		return;
+#ifdef LOG_ASYNC
+	auto now = std::chrono::system_clock::now();
+	auto fill = [&](Record& record) {
+		record.time = now;
+		record.level = level;
+		record.length = std::min(message.size(),
+					 sizeof record.text - 1);
+		memcpy(record.text, message.data(), record.length);
+		record.text[record.length] = '\0';
+	};
+	if (ring.push(fill))
+		return;
+	// errors are rare and too important to drop, wait for the writer
+	if (level >= LogLevel::ERROR) {
+		unsigned spins = 0;
+		while (!ring.push(fill))
+			ring_wait(spins);
+		return;
+	}
+	dropped.fetch_add(1, std::memory_order_relaxed);
+#else
+	write(std::chrono::system_clock::now(), level, message.c_str());
+	if (logfile)
+		fflush(logfile);
 #endif
+}
+
+#ifdef LOG_ASYNC
+void
+Logger::writer_loop(void) {
+	Record last;
+	last.length = 0;
+	last.text[0] = '\0';
+	bool have_last = false;
+	unsigned long repeats = 0;
+	unsigned long dropped_reported = 0;
+	auto flush_repeats = [&]() {
+		if (!repeats)
+			return;
+		std::string message = "last message repeated "
+			+ std::to_string(repeats) + " times";
+		write(std::chrono::system_clock::now(), last.level,
+		      message.c_str());
+		repeats = 0;
+	};
+
+	for (;;) {
+		bool stop = stopping.load(std::memory_order_acquire);
+		bool wrote = false;
+		Record* record;
+		while ((record = ring.front())) {
+			if (have_last && record->level == last.level
+			    && record->length == last.length
+			    && !memcmp(record->text, last.text, last.length)
+			    && record->time - last.time < std::chrono::
+			    milliseconds(LOG_REPEAT_WINDOW_MS)) {
+				repeats++;
+				ring.pop();
+				continue;
+			}
+			flush_repeats();
+			write(record->time, record->level, record->text);
+			last = *record;
+			have_last = true;
+			wrote = true;
+			ring.pop();
+		}
+		unsigned long n_dropped = dropped.load(
+			std::memory_order_relaxed);
+		if (n_dropped != dropped_reported) {
+			std::string message = std::to_string(
+				n_dropped - dropped_reported)
+				+ " log messages dropped, ring full";
+			write(std::chrono::system_clock::now(),
+			      LogLevel::WARN, message.c_str());
+			dropped_reported = n_dropped;
+			wrote = true;
+		}
+		// report a run of repeats once the window has passed
+		if (repeats && std::chrono::system_clock::now() - last.time
+		    >= std::chrono::milliseconds(LOG_REPEAT_WINDOW_MS)) {
+			flush_repeats();
+			have_last = false;
+			wrote = true;
+		}
+		if (stop) {
+			flush_repeats();
+			if (logfile)
+				fflush(logfile);
+			return;
+		}
+		if (wrote && logfile)
+			fflush(logfile);
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
 	}
 }
 
+void
+Logger::stop_writer(void) {
+	if (!instance || !instance->writer.joinable())
+		return;
+	instance->stopping.store(true, std::memory_order_release);
+	instance->writer.join();
+}
+#endif
+
 Logger&
 Logger::operator<<(LogLevel level) {
 	curr_msg_loglevel = level;
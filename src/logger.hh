@@ -22,24 +22,61 @@
 #ifndef LOGGER_HH
 #define LOGGER_HH
 
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <string>
+#include <thread>
+
+#include "alloccheck.hh"
+#include "ring.hh"
 
 #define DEFAULT_FILENAME "/var/log/marvision.log"
 
 #define LOG_COPY_STDERR
 
-#define log_debug (Logger::get_instance() << Logger::LogLevel::DEBUG)
-#define log_info  (Logger::get_instance() << Logger::LogLevel::INFO)
-#define log_warn  (Logger::get_instance() << Logger::LogLevel::WARN)
-#define log_error (Logger::get_instance() << Logger::LogLevel::ERROR)
-#define log_crit  (Logger::get_instance() << Logger::LogLevel::CRIT)
+// Format and write the log on a background thread. The logging thread only
+// copies the message into a ring.
+#define LOG_ASYNC
+
+// bytes per log record, including the header
+#ifndef LOG_RECORD_SIZE
+# define LOG_RECORD_SIZE 256
+#endif
+// records in the ring, must be a power of two
+#ifndef LOG_RING_SIZE
+# define LOG_RING_SIZE 1024
+#endif
+// identical messages are counted instead of written for this long
+#ifndef LOG_REPEAT_WINDOW_MS
+# define LOG_REPEAT_WINDOW_MS 1000
+#endif
+
+// The message after << is not evaluated at all if the level is filtered out.
+// An expression rather than an if statement, so it is safe in an unbraced if.
+// Building the message may allocate, which the allocation check ignores.
+#define LOG_AT(level) \
+	!Logger::enabled(level) ? (void)0 \
+	: Logger::Voidify() \
+	& (AllocCheck::Pause(), Logger::get_instance()) << level
+#define log_debug LOG_AT(Logger::LogLevel::DEBUG)
+#define log_info  LOG_AT(Logger::LogLevel::INFO)
+#define log_warn  LOG_AT(Logger::LogLevel::WARN)
+#define log_error LOG_AT(Logger::LogLevel::ERROR)
+#define log_crit  LOG_AT(Logger::LogLevel::CRIT)
 
 /**
  * @brief A singleton logger for marvision
  *
  * Use the macros to log. See documentations for `enum class LogLevel` for
  * usage.
+ *
+ * With `LOG_ASYNC`, a message is copied with its time into a fixed-size
+ * record of a lock-free ring, and a writer thread does the formatting and the
+ * file I/O. A message repeated within `LOG_REPEAT_WINDOW_MS` is counted and
+ * written once with the count. When the ring is full, messages are dropped
+ * and counted rather than blocking the caller.
  */
 class Logger {
 public:
@@ -54,13 +91,49 @@ public:
 		CRIT   ///< log using `log_crit << "message"`
 	};
 private:
-	LogLevel loglevel;
+	/**
+	 * A message waiting in the ring for the writer thread.
+	 */
+	struct Record {
+		std::chrono::system_clock::time_point time;
+		LogLevel level;
+		unsigned short length;
+		char text[LOG_RECORD_SIZE - sizeof(time) - sizeof(level)
+			  - sizeof(length)];
+	};
+
+	static std::atomic<LogLevel> loglevel;
 	FILE* logfile;
-	LogLevel curr_msg_loglevel;
+	/// per thread, so that pipeline stages can log at the same time
+	static thread_local LogLevel curr_msg_loglevel;
 	std::string print_log_level(LogLevel loglevel) const;
 	Logger(const std::string& filename, LogLevel level = LogLevel::INFO);
 	~Logger();
 	static Logger* instance;
+
+	/**
+	 * Format and write one message.
+	 */
+	void write(std::chrono::system_clock::time_point time, LogLevel level,
+		   const char* message);
+
+#ifdef LOG_ASYNC
+	MpscRing<Record, LOG_RING_SIZE> ring;
+	std::atomic<unsigned long> dropped;
+	std::atomic<bool> stopping;
+	std::thread writer;
+
+	/**
+	 * The writer thread: drain the ring, collapsing repeated messages.
+	 */
+	void writer_loop(void);
+
+	/**
+	 * Stop the writer thread once the ring is drained. Registered with
+	 * `atexit` so no message is lost when the program exits.
+	 */
+	static void stop_writer(void);
+#endif
 public:
 	/**
 	 * Get the instance of the singleton logger. If not exist, create the
@@ -76,6 +149,21 @@ public:
 	 * @param level    the log level
 	 */
 	void log(const std::string& message, LogLevel level);
+
+	/**
+	 * Turns a logging expression into void, for `LOG_AT`.
+	 */
+	struct Voidify {
+		void operator&(Logger&) {}
+	};
+
+	/**
+	 * Whether messages of a level are written. Used by the macros to skip
+	 * building filtered out messages.
+	 */
+	static bool enabled(LogLevel level) {
+		return level >= loglevel.load(std::memory_order_relaxed);
+	}
 	Logger& operator<<(LogLevel level);
 	Logger& operator<<(const std::string& message);
 	Logger (const Logger&) = delete;
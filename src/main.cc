@@ -1,11 +1,248 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
-#include <opencv2/opencv.hpp>
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <getopt.h>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+
+#include "alloccheck.hh"
+#include "config.hh"
+#ifdef HAVE_GSTAPP
+# include "gstsource.hh"
+#endif
+#include "logger.hh"
+#include "realtime.hh"
+#include "source.hh"
+#include "uart.hh"
+#include "vision.hh"
+
+static void
+usage(const char* argv0) {
+	std::cerr << "Usage: " << argv0 << " [OPTIONS]\n"
+		"\n"
+		"  -c, --config FILE     configuration file (default "
+		CONFIG_PATH ")\n"
+		"  -l, --log FILE        log file (default "
+		DEFAULT_FILENAME ")\n"
+		"  -L, --log-level LVL   lowest level logged: debug, info, "
+		"warn, error or\n"
+		"                        crit (default debug)\n"
+		"  -r, --replay PATH     replay a video file or a directory "
+		"of images\n"
+		"                        instead of the camera, then report "
+		"fps and latency\n"
+		"  -g, --gst PIPELINE    replay a GStreamer pipeline ending in "
+		"an appsink,\n"
+		"                        e.g. \"videotestsrc num-buffers=500 ! "
+		"appsink\"\n"
+		"  -R, --realtime        replay at the recorded frame rate, "
+		"not as fast as\n"
+		"                        possible\n"
+		"  -f, --fps N           frame rate a replayed image "
+		"directory was recorded\n"
+		"                        at, its replay rate with -R "
+		"(default 50)\n"
+		"  -o, --output FILE     write the output chars to FILE "
+		"instead of the UART\n"
+		"  -m, --draw-marker ID  draw marker ID to "
+		MARKER_IMG_PATH " and exit\n"
+		"  -U, --uart-loopback N post N framed messages through a "
+		"pseudo terminal\n"
+		"                        at the configured baud rate, check "
+		"what comes out\n"
+		"                        and exit\n"
+		"  -J, --jitter SECONDS  measure the wake-up jitter of a "
+		"periodic thread\n"
+		"                        for SECONDS with the real-time mode "
+		"off, then on,\n"
+		"                        under load on every core, and exit\n"
+		"  -h, --help            show this help and exit\n";
+}
+
+static bool
+parse_log_level(const std::string& name, Logger::LogLevel& level) {
+	static const struct {
+		const char* name;
+		Logger::LogLevel level;
+	} levels[] = {
+		{"debug", Logger::LogLevel::DEBUG},
+		{"info", Logger::LogLevel::INFO},
+		{"warn", Logger::LogLevel::WARN},
+		{"error", Logger::LogLevel::ERROR},
+		{"crit", Logger::LogLevel::CRIT}
+	};
+	for (const auto& l : levels) {
+		if (name == l.name) {
+			level = l.level;
+			return true;
+		}
+	}
+	return false;
+}
 
 int
-main(void) {
-	std::cout << "helloworld" << std::endl;
-	cv::VideoCapture(0);
-	return 0;
+main(int argc, char* argv[]) {
+	static const struct option long_options[] = {
+		{"config", required_argument, nullptr, 'c'},
+		{"log", required_argument, nullptr, 'l'},
+		{"log-level", required_argument, nullptr, 'L'},
+		{"replay", required_argument, nullptr, 'r'},
+		{"gst", required_argument, nullptr, 'g'},
+		{"realtime", no_argument, nullptr, 'R'},
+		{"fps", required_argument, nullptr, 'f'},
+		{"output", required_argument, nullptr, 'o'},
+		{"draw-marker", required_argument, nullptr, 'm'},
+		{"uart-loopback", required_argument, nullptr, 'U'},
+		{"jitter", required_argument, nullptr, 'J'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0}
+	};
+	std::string config_path = CONFIG_PATH;
+	std::string log_path = DEFAULT_FILENAME;
+	Logger::LogLevel log_level = Logger::LogLevel::DEBUG;
+	std::string replay_path, replay_pipeline, output_path;
+	bool realtime = false;
+	double image_fps = REPLAY_IMAGE_FPS;
+	int marker_id = -1;
+	long loopback_count = 0;
+	double jitter_seconds = 0;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "c:l:L:r:g:Rf:o:m:U:J:h",
+				  long_options, nullptr)) != -1) {
+		switch (opt) {
+		case 'c':
+			config_path = optarg;
+			break;
+		case 'l':
+			log_path = optarg;
+			break;
+		case 'L':
+			if (!parse_log_level(optarg, log_level)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			replay_path = optarg;
+			break;
+		case 'g':
+			replay_pipeline = optarg;
+			break;
+		case 'R':
+			realtime = true;
+			break;
+		case 'f':
+			image_fps = std::atof(optarg);
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case 'm':
+			marker_id = std::atoi(optarg);
+			break;
+		case 'U':
+			loopback_count = std::atol(optarg);
+			break;
+		case 'J':
+			jitter_seconds = std::atof(optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// the first calls create the singletons with these files
+	Logger::get_instance(log_path, log_level);
+	Config::get_instance(config_path);
+	if (loopback_count > 0)
+		return Uart::loopback_test(loopback_count)
+			? EXIT_SUCCESS : EXIT_FAILURE;
+	if (jitter_seconds > 0) {
+		Realtime::jitter_test(jitter_seconds, std::cout);
+		return EXIT_SUCCESS;
+	}
+	Realtime::init();
+	Vision::init_dictionary();
+
+	if (marker_id >= 0) {
+		Vision::draw_marker(marker_id);
+		return EXIT_SUCCESS;
+	}
+
+	if (output_path.empty())
+		Uart::init_uart();
+	else
+		Uart::init_file(output_path);
+
+	if (replay_path.empty() && replay_pipeline.empty()) {
+		Vision::govern_idle = Config::get_instance().idle_governor;
+		Vision::keep_deadline = true;
+		Vision::vision_main_loop();
+		return EXIT_SUCCESS;
+	}
+	// whether and when a replay goes idle, or skips and downgrades
+	// frames, would depend on how fast this machine detects, not on the
+	// recording
+	Vision::govern_idle = false;
+	if (Config::get_instance().idle_governor)
+		log_info << "idle_governor is off for replays";
+	Vision::keep_deadline = false;
+	if (Config::get_instance().frame_deadline_ms > 0)
+		log_info << "frame_deadline_ms is off for replays";
+
+	std::unique_ptr<FrameSource> source;
+	struct stat st;
+	if (!replay_pipeline.empty()) {
+#ifdef HAVE_GSTAPP
+		source.reset(new GstSource(replay_pipeline, realtime, false,
+					   true));
+#else
+		log_crit << "Built without the appsink source, cannot replay "
+			"a GStreamer pipeline";
+		return EXIT_FAILURE;
+#endif
+	} else if (stat(replay_path.c_str(), &st) == -1) {
+		log_crit << "Could not find replay " + replay_path;
+		return EXIT_FAILURE;
+	} else if (S_ISDIR(st.st_mode)) {
+		source.reset(new ImageDirSource(replay_path,
+						realtime ? image_fps : 0,
+						image_fps));
+	} else {
+		source.reset(new CaptureSource(replay_path, realtime));
+	}
+	Vision::collect_frame_age = true;
+	Vision::vision_main_loop(*source);
+	Vision::report_stats(std::cerr);
+	if (AllocCheck::violations()) {
+		log_error << "The pipeline allocated after its warm-up";
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
 }
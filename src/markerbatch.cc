@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "markerbatch.hh"
+
+#if defined(MARKER_BATCH_SCALAR)
+#elif defined(__AVX__)
+# include <immintrin.h>
+# define MARKER_BATCH_AVX
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+# define MARKER_BATCH_SSE2
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+# define MARKER_BATCH_NEON
+#endif
+
+// the batches are padded to the widest vector, AVX
+static const size_t PAD = 8;
+
+/*
+ * The few vector operations the kernels need, over the widest float vector
+ * of the target, so `compute()` is written once.
+ */
+#if defined(MARKER_BATCH_AVX)
+typedef __m256 Vec;
+static const size_t LANES = 8;
+static inline Vec load(const float* p) { return _mm256_loadu_ps(p); }
+static inline void store(float* p, Vec v) { _mm256_storeu_ps(p, v); }
+static inline Vec splat(float f) { return _mm256_set1_ps(f); }
+static inline Vec add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+static inline Vec sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+static inline Vec mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+static inline Vec
+absolute(Vec a) {
+	return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+}
+#elif defined(MARKER_BATCH_SSE2)
+typedef __m128 Vec;
+static const size_t LANES = 4;
+static inline Vec load(const float* p) { return _mm_loadu_ps(p); }
+static inline void store(float* p, Vec v) { _mm_storeu_ps(p, v); }
+static inline Vec splat(float f) { return _mm_set1_ps(f); }
+static inline Vec add(Vec a, Vec b) { return _mm_add_ps(a, b); }
+static inline Vec sub(Vec a, Vec b) { return _mm_sub_ps(a, b); }
+static inline Vec mul(Vec a, Vec b) { return _mm_mul_ps(a, b); }
+static inline Vec
+absolute(Vec a) {
+	return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+}
+#elif defined(MARKER_BATCH_NEON)
+typedef float32x4_t Vec;
+static const size_t LANES = 4;
+static inline Vec load(const float* p) { return vld1q_f32(p); }
+static inline void store(float* p, Vec v) { vst1q_f32(p, v); }
+static inline Vec splat(float f) { return vdupq_n_f32(f); }
+static inline Vec add(Vec a, Vec b) { return vaddq_f32(a, b); }
+static inline Vec sub(Vec a, Vec b) { return vsubq_f32(a, b); }
+static inline Vec mul(Vec a, Vec b) { return vmulq_f32(a, b); }
+static inline Vec absolute(Vec a) { return vabsq_f32(a); }
+#else
+typedef float Vec;
+static const size_t LANES = 1;
+static inline Vec load(const float* p) { return *p; }
+static inline void store(float* p, Vec v) { *p = v; }
+static inline Vec splat(float f) { return f; }
+static inline Vec add(Vec a, Vec b) { return a + b; }
+static inline Vec sub(Vec a, Vec b) { return a - b; }
+static inline Vec mul(Vec a, Vec b) { return a * b; }
+static inline Vec absolute(Vec a) { return std::abs(a); }
+#endif
+
+static_assert(PAD % LANES == 0, "the padding is not whole vectors");
+
+static inline size_t
+padded(size_t n) {
+	return (n + PAD - 1) / PAD * PAD;
+}
+
+const char*
+MarkerBatch::isa(void) {
+#if defined(MARKER_BATCH_AVX)
+	return "avx";
+#elif defined(MARKER_BATCH_SSE2)
+	return "sse2";
+#elif defined(MARKER_BATCH_NEON)
+	return "neon";
+#else
+	return "scalar";
+#endif
+}
+
+void
+MarkerBatch::reserve(size_t n) {
+	size_t size = padded(n);
+	for (int k = 0; k < 4; k++) {
+		x[k].reserve(size);
+		y[k].reserve(size);
+	}
+	id.reserve(size);
+	cx.reserve(size);
+	cy.reserve(size);
+	area.reserve(size);
+	order.reserve(size);
+	id_scratch.reserve(size);
+	scratch.reserve(size);
+}
+
+void
+MarkerBatch::assign(const float* corners, const int* ids, size_t n) {
+	size_t size = padded(n);
+	for (int k = 0; k < 4; k++) {
+		x[k].resize(size);
+		y[k].resize(size);
+	}
+	id.resize(size);
+	cx.resize(size);
+	cy.resize(size);
+	area.resize(size);
+	this->n = n;
+	for (size_t m = 0; m < n; m++, corners += 8) {
+		for (int k = 0; k < 4; k++) {
+			x[k][m] = corners[2 * k];
+			y[k][m] = corners[2 * k + 1];
+		}
+		id[m] = ids ? ids[m] : -1;
+	}
+	order.resize(n);
+	for (size_t m = 0; m < n; m++)
+		order[m] = m;
+	for (size_t m = n; m < size; m++) {
+		for (int k = 0; k < 4; k++)
+			x[k][m] = y[k][m] = 0;
+		id[m] = -1;
+	}
+	compute();
+}
+
+/**
+ * The centre is the mean of the corners, and the area the shoelace formula,
+ * summed in the order `set_marker()` sums them.
+ */
+void
+MarkerBatch::compute(void) {
+	const Vec quarter = splat(0.25f), half = splat(0.5f);
+	for (size_t i = 0; i < id.size(); i += LANES) {
+		Vec x0 = load(&x[0][i]), x1 = load(&x[1][i]);
+		Vec x2 = load(&x[2][i]), x3 = load(&x[3][i]);
+		Vec y0 = load(&y[0][i]), y1 = load(&y[1][i]);
+		Vec y2 = load(&y[2][i]), y3 = load(&y[3][i]);
+		store(&cx[i], mul(add(add(add(x0, x1), x2), x3), quarter));
+		store(&cy[i], mul(add(add(add(y0, y1), y2), y3), quarter));
+		Vec s = sub(mul(x0, y1), mul(x1, y0));
+		s = add(s, sub(mul(x1, y2), mul(x2, y1)));
+		s = add(s, sub(mul(x2, y3), mul(x3, y2)));
+		s = add(s, sub(mul(x3, y0), mul(x0, y3)));
+		store(&area[i], mul(absolute(s), half));
+	}
+}
+
+template <typename T>
+static void
+permute(std::vector<T>& field, const std::vector<int>& order,
+	std::vector<T>& scratch) {
+	scratch.resize(order.size());
+	for (size_t i = 0; i < order.size(); i++)
+		scratch[i] = field[order[i]];
+	std::copy(scratch.begin(), scratch.end(), field.begin());
+}
+
+void
+MarkerBatch::sort_by_area(void) {
+	std::sort(order.begin(), order.end(), [this](int a, int b) {
+		return area[a] > area[b];
+	});
+	for (int k = 0; k < 4; k++) {
+		permute(x[k], order, scratch);
+		permute(y[k], order, scratch);
+	}
+	permute(id, order, id_scratch);
+	permute(cx, order, scratch);
+	permute(cy, order, scratch);
+	permute(area, order, scratch);
+}
+
+size_t
+MarkerBatch::select(int marker_id, std::vector<int>& indices) const {
+	indices.clear();
+	size_t i = 0;
+#if defined(MARKER_BATCH_AVX) || defined(MARKER_BATCH_SSE2)
+	const __m128i key = _mm_set1_epi32(marker_id);
+	for (; i < n; i += 4) {
+		__m128i ids = _mm_loadu_si128((const __m128i*)&id[i]);
+		unsigned mask = _mm_movemask_ps(
+			_mm_castsi128_ps(_mm_cmpeq_epi32(ids, key)));
+		for (; mask; mask &= mask - 1) {
+			size_t m = i + __builtin_ctz(mask);
+			if (m < n)
+				indices.push_back(m);
+		}
+	}
+#elif defined(MARKER_BATCH_NEON)
+	static const uint32_t lane_bits[4] = {1, 2, 4, 8};
+	const int32x4_t key = vdupq_n_s32(marker_id);
+	const uint32x4_t bits = vld1q_u32(lane_bits);
+	for (; i < n; i += 4) {
+		uint32x4_t eq = vandq_u32(vceqq_s32(vld1q_s32(&id[i]), key),
+					  bits);
+		uint32x2_t sum = vpadd_u32(vget_low_u32(eq),
+					   vget_high_u32(eq));
+		unsigned mask = vget_lane_u32(vpadd_u32(sum, sum), 0);
+		for (; mask; mask &= mask - 1) {
+			size_t m = i + __builtin_ctz(mask);
+			if (m < n)
+				indices.push_back(m);
+		}
+	}
+#else
+	for (; i < n; i++)
+		if (id[i] == marker_id)
+			indices.push_back(i);
+#endif
+	return indices.size();
+}
+
+float
+MarkerBatch::min_area(void) const {
+	if (!n)
+		return 0;
+	return *std::min_element(area.begin(), area.begin() + n);
+}
@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MARKERBATCH_HH
+#define MARKERBATCH_HH
+
+#include <cstddef>
+#include <vector>
+
+// markers a batch holds without allocating
+#ifndef MARKER_BATCH_RESERVE
+# define MARKER_BATCH_RESERVE 64
+#endif
+
+/**
+ * @brief The markers of one frame, one array per field
+ *
+ * The detector hands over each marker as four corner points. Stored that
+ * way, the centre and the area of a marker are a chain of dependent scalar
+ * operations. Here the corners are transposed once into structure-of-arrays
+ * form, so the kernels below work on four or eight markers at a time with
+ * NEON, SSE2 or AVX, whichever the compiler targets, and on one at a time
+ * otherwise. The results are those of `Vision::Marker::set_marker()`, up to
+ * rounding.
+ *
+ * The arrays are padded with zero markers of id -1 to a multiple of the
+ * widest vector, so no kernel has a scalar tail. Nothing here depends on
+ * OpenCV.
+ */
+class MarkerBatch {
+public:
+	/// the corners, clockwise from the top left as the detector gives
+	std::vector<float> x[4], y[4];
+	std::vector<int> id;
+	/// computed by `assign()`
+	std::vector<float> cx, cy, area;
+
+	MarkerBatch() { reserve(MARKER_BATCH_RESERVE); }
+
+	void reserve(size_t n);
+
+	/**
+	 * Replace the batch with `n` markers and compute their centres and
+	 * areas.
+	 *
+	 * @param corners  8 floats per marker, x0, y0 ... x3, y3, in pixels
+	 * @param ids  one per marker, or nullptr to set them all to -1
+	 */
+	void assign(const float* corners, const int* ids, size_t n);
+
+	size_t size(void) const { return n; }
+
+	/// Reorder the markers by area, largest first.
+	void sort_by_area(void);
+
+	/// the index marker `i` had in `assign()`, before any sort
+	int origin(size_t i) const { return order[i]; }
+
+	/**
+	 * Find the markers of one id.
+	 *
+	 * @param indices  replaced with their indices, in batch order
+	 * @returns how many there are
+	 */
+	size_t select(int marker_id, std::vector<int>& indices) const;
+
+	/// the smallest area, 0 for an empty batch
+	float min_area(void) const;
+
+	/// the instruction set the kernels were built for
+	static const char* isa(void);
+private:
+	size_t n = 0;
+	/// `sort_by_area()` scratch
+	std::vector<int> order, id_scratch;
+	std::vector<float> scratch;
+
+	void compute(void);
+};
+
+#endif
@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "logger.hh"
+#include "metrics.hh"
+
+Metrics::Histogram Metrics::histograms[METRICS_MAX_THREADS][N_STAGES];
+std::atomic<uint64_t> Metrics::counters[N_COUNTERS];
+std::atomic<unsigned> Metrics::threads{0};
+std::chrono::steady_clock::time_point Metrics::start =
+	std::chrono::steady_clock::now();
+
+const char*
+Metrics::stage_name(Stage stage) {
+	static const char* names[N_STAGES] = {
+		"capture", "detect", "markers", "pose", "pair", "decide",
+		"uart_send", "frame_age", "reacquire"
+	};
+	return names[stage];
+}
+
+const char*
+Metrics::counter_name(Counter counter) {
+	static const char* names[N_COUNTERS] = {
+		"frames", "skipped_frames", "downgraded_frames",
+		"unknown_outputs", "pair_fallbacks", "bridged_outputs",
+		"uart_superseded", "idle_frames"
+	};
+	return names[counter];
+}
+
+Metrics::Histogram*
+Metrics::claim(void) {
+	unsigned n = threads.fetch_add(1, std::memory_order_relaxed);
+	return histograms[std::min<unsigned>(n, METRICS_MAX_THREADS - 1)];
+}
+
+/**
+ * The duration below which a fraction `q` of a histogram's counts lie, as
+ * the middle of its bucket, in microseconds.
+ */
+static double
+quantile_us(const uint64_t* buckets, uint64_t count, uint64_t max_ns,
+	    double q) {
+	uint64_t rank = q * count + 0.5;
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (unsigned b = 0; b < METRICS_BUCKETS; b++) {
+		seen += buckets[b];
+		if (seen < rank)
+			continue;
+		uint64_t lo = Metrics::bucket_floor(b);
+		uint64_t hi = b + 1 < METRICS_BUCKETS
+			? Metrics::bucket_floor(b + 1) : lo;
+		uint64_t mid = lo + (hi - lo) / 2;
+		return (mid < max_ns ? mid : max_ns) / 1e3;
+	}
+	return max_ns / 1e3;
+}
+
+double
+Metrics::cpu_seconds(void) {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == -1)
+		return 0;
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+		+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+std::string
+Metrics::snapshot(void) {
+	char line[128];
+	std::string out;
+	double uptime = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	snprintf(line, sizeof line, "uptime_s: %.3f\n", uptime);
+	out += line;
+	snprintf(line, sizeof line, "cpu_s_per_min: %.3f\n",
+		 uptime > 0 ? cpu_seconds() / uptime * 60 : 0);
+	out += line;
+	for (int c = 0; c < N_COUNTERS; c++) {
+		snprintf(line, sizeof line, "%s: %llu\n",
+			 counter_name((Counter)c), (unsigned long long)
+			 counters[c].load(std::memory_order_relaxed));
+		out += line;
+	}
+
+	unsigned n_threads = std::min<unsigned>(threads.load(),
+						 METRICS_MAX_THREADS);
+	uint64_t buckets[METRICS_BUCKETS];
+	for (int s = 0; s < N_STAGES; s++) {
+		uint64_t count = 0, sum_ns = 0, max_ns = 0;
+		memset(buckets, 0, sizeof buckets);
+		for (unsigned t = 0; t < n_threads; t++) {
+			const Histogram& h = histograms[t][s];
+			for (unsigned b = 0; b < METRICS_BUCKETS; b++)
+				buckets[b] += h.buckets[b].load(
+					std::memory_order_relaxed);
+			sum_ns += h.sum_ns.load(std::memory_order_relaxed);
+			max_ns = std::max(max_ns, h.max_ns.load(
+						  std::memory_order_relaxed));
+		}
+		// counted from the buckets, so the quantiles add up while the
+		// threads keep recording
+		for (unsigned b = 0; b < METRICS_BUCKETS; b++)
+			count += buckets[b];
+		const char* name = stage_name((Stage)s);
+		snprintf(line, sizeof line, "%s_count: %llu\n", name,
+			 (unsigned long long)count);
+		out += line;
+		if (!count)
+			continue;
+		snprintf(line, sizeof line, "%s_mean_us: %.3f\n", name,
+			 sum_ns / 1e3 / count);
+		out += line;
+		for (double q : {0.5, 0.9, 0.99}) {
+			snprintf(line, sizeof line, "%s_p%d_us: %.3f\n", name,
+				 (int)(q * 100 + 0.5),
+				 quantile_us(buckets, count, max_ns, q));
+			out += line;
+		}
+		snprintf(line, sizeof line, "%s_max_us: %.3f\n", name,
+			 max_ns / 1e3);
+		out += line;
+	}
+	return out;
+}
+
+bool
+Metrics::serve(const std::string& path) {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof addr.sun_path) {
+		log_error << "Metrics socket path too long: " + path;
+		return false;
+	}
+	strcpy(addr.sun_path, path.c_str());
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener == -1) {
+		log_error << "Could not create metrics socket: "
+			+ std::string(strerror(errno));
+		return false;
+	}
+	unlink(path.c_str());
+	if (bind(listener, (sockaddr*)&addr, sizeof addr) == -1
+	    || listen(listener, 4) == -1) {
+		log_error << "Could not listen on metrics socket " + path + ": "
+			+ strerror(errno);
+		close(listener);
+		return false;
+	}
+	std::thread(serve_loop, listener).detach();
+	log_info << "metrics served on " + path;
+	return true;
+}
+
+void
+Metrics::serve_loop(int listener) {
+	for (;;) {
+		int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			log_error << "Metrics socket closed: "
+				+ std::string(strerror(errno));
+			close(listener);
+			return;
+		}
+		std::string text = snapshot();
+		const char* p = text.data();
+		size_t left = text.size();
+		while (left) {
+			ssize_t n = send(client, p, left, MSG_NOSIGNAL);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			p += n;
+			left -= n;
+		}
+		close(client);
+	}
+}
@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_HH
+#define METRICS_HH
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "ring.hh"
+
+// where marvision-stat finds the running pipeline
+#ifndef METRICS_SOCKET_PATH
+# define METRICS_SOCKET_PATH "/run/marvision.sock"
+#endif
+// threads with histograms of their own; any more share the last ones
+#ifndef METRICS_MAX_THREADS
+# define METRICS_MAX_THREADS 8
+#endif
+
+// each power of two of nanoseconds is split into 2^METRICS_SUB_BITS buckets,
+// i.e. a bucket is at most 12.5% wide, up to 2^METRICS_MAX_EXP ns (18 min)
+#define METRICS_SUB_BITS 3
+#define METRICS_MAX_EXP 40
+#define METRICS_BUCKETS ((METRICS_MAX_EXP - METRICS_SUB_BITS + 1)	\
+			 << METRICS_SUB_BITS)
+
+/**
+ * @brief Always-on latency histograms and counters of the pipeline stages
+ *
+ * Every thread records into histograms of its own, so recording is a few
+ * relaxed atomic adds to cache lines no other thread writes, with no lock
+ * and no allocation. The histograms are log-linear: exact below 8 ns, then
+ * eight buckets per power of two. A snapshot sums the threads' histograms
+ * while they keep recording, and is served as YAML to every client of a
+ * Unix socket, e.g. `marvision-stat`.
+ *
+ * Nothing here depends on OpenCV.
+ */
+class Metrics {
+public:
+	enum Stage {
+		STAGE_CAPTURE, ///< reading a frame from the source
+		STAGE_DETECT, ///< finding the markers in a frame
+		STAGE_MARKERS, ///< making the markers of a frame, `set_marker`
+		STAGE_POSE, ///< locating the markers of a frame in metres
+		STAGE_PAIR, ///< pairing the gate markers
+		STAGE_DECIDE, ///< the whole decision of a frame
+		STAGE_UART_SEND, ///< writing one message to the UART
+		STAGE_FRAME_AGE, ///< from capture to decision
+		/// from the last idle scan without markers to the decision
+		/// of the first frame with some
+		STAGE_REACQUIRE,
+		N_STAGES
+	};
+
+	enum Counter {
+		FRAMES, ///< frames decided
+		SKIPPED, ///< frames too old to detect
+		DOWNGRADED, ///< frames detected at lower cost
+		UNKNOWN, ///< '?' outputs
+		PAIR_FALLBACK, ///< the pairing algorithm fell back
+		BRIDGED, ///< outputs predicted by the gate tracker
+		UART_SUPERSEDED, ///< messages replaced before they were sent
+		IDLE_FRAMES, ///< frames scanned while no markers were seen
+		N_COUNTERS
+	};
+
+	struct alignas(CACHE_LINE_SIZE) Histogram {
+		std::atomic<uint64_t> buckets[METRICS_BUCKETS];
+		std::atomic<uint64_t> sum_ns;
+		std::atomic<uint64_t> max_ns;
+	};
+
+	/**
+	 * The bucket of a duration.
+	 */
+	static unsigned bucket(uint64_t ns) {
+		if (ns < (1u << METRICS_SUB_BITS))
+			return ns;
+		if (ns >> METRICS_MAX_EXP)
+			return METRICS_BUCKETS - 1;
+		unsigned exp = 63 - __builtin_clzll(ns);
+		return ((exp - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+			| ((ns >> (exp - METRICS_SUB_BITS))
+			   & ((1u << METRICS_SUB_BITS) - 1));
+	}
+
+	/**
+	 * The smallest duration in a bucket.
+	 */
+	static uint64_t bucket_floor(unsigned b) {
+		if (b < (1u << METRICS_SUB_BITS))
+			return b;
+		unsigned exp = (b >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+		uint64_t sub = b & ((1u << METRICS_SUB_BITS) - 1);
+		return ((1ull << METRICS_SUB_BITS) | sub)
+			<< (exp - METRICS_SUB_BITS);
+	}
+
+	/**
+	 * Record a duration of a stage on the calling thread.
+	 */
+	static void record(Stage stage, uint64_t ns) {
+		thread_local Histogram* mine = claim();
+		Histogram& h = mine[stage];
+		h.buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		h.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+		uint64_t max = h.max_ns.load(std::memory_order_relaxed);
+		while (ns > max && !h.max_ns.compare_exchange_weak(
+			       max, ns, std::memory_order_relaxed))
+			;
+	}
+
+	static void record(Stage stage,
+			   std::chrono::steady_clock::duration d) {
+		record(stage, d.count() > 0 ? std::chrono::duration_cast<
+			       std::chrono::nanoseconds>(d).count() : 0);
+	}
+
+	static void count(Counter counter, uint64_t n = 1) {
+		counters[counter].fetch_add(n, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Record the time from construction to destruction.
+	 */
+	class Timer {
+	private:
+		Stage stage;
+		std::chrono::steady_clock::time_point start;
+	public:
+		Timer(Stage stage)
+			: stage(stage), start(std::chrono::steady_clock::now())
+			{}
+		~Timer() {
+			record(stage, std::chrono::steady_clock::now() - start);
+		}
+	};
+
+	/**
+	 * The CPU time of the whole process so far, user and system, in
+	 * seconds.
+	 */
+	static double cpu_seconds(void);
+
+	/**
+	 * The counters, the CPU seconds per minute since the start, and the
+	 * count, mean, p50, p90, p99 and max of every stage, in
+	 * microseconds, as a YAML mapping.
+	 */
+	static std::string snapshot(void);
+
+	/**
+	 * Serve a snapshot to every client of a Unix stream socket at `path`,
+	 * from a thread of its own. A stale socket is replaced.
+	 * @returns false if the socket cannot be made; metrics are still
+	 *          recorded
+	 */
+	static bool serve(const std::string& path);
+
+	static const char* stage_name(Stage stage);
+	static const char* counter_name(Counter counter);
+private:
+	static Histogram histograms[METRICS_MAX_THREADS][N_STAGES];
+	static std::atomic<uint64_t> counters[N_COUNTERS];
+	static std::atomic<unsigned> threads;
+	static std::chrono::steady_clock::time_point start;
+
+	/**
+	 * Give the calling thread its histograms.
+	 */
+	static Histogram* claim(void);
+
+	static void serve_loop(int listener);
+};
+
+#endif // METRICS_HH
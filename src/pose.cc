@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+
+#include "pose.hh"
+
+float Pose::fx = 0, Pose::fy = 0, Pose::cx = 0, Pose::cy = 0;
+float Pose::k1 = 0, Pose::k2 = 0, Pose::p1 = 0, Pose::p2 = 0, Pose::k3 = 0;
+bool Pose::distorted = false;
+float Pose::marker_size = 0;
+
+bool
+Pose::calibrate(const std::vector<double>& intrinsics,
+		const std::vector<double>& distortion, double size) {
+	marker_size = 0;
+	if (intrinsics.size() != 4 || intrinsics[0] <= 0 || intrinsics[1] <= 0
+	    || (distortion.size() && distortion.size() != 4
+		&& distortion.size() != 5)
+	    || size <= 0)
+		return false;
+	fx = intrinsics[0];
+	fy = intrinsics[1];
+	cx = intrinsics[2];
+	cy = intrinsics[3];
+	k1 = k2 = p1 = p2 = k3 = 0;
+	if (distortion.size()) {
+		k1 = distortion[0];
+		k2 = distortion[1];
+		p1 = distortion[2];
+		p2 = distortion[3];
+		if (distortion.size() == 5)
+			k3 = distortion[4];
+	}
+	distorted = k1 || k2 || p1 || p2 || k3;
+	marker_size = size;
+	return true;
+}
+
+void
+Pose::locate(const float* corners, int n, float* centres) {
+	for (int m = 0; m < n; m++, corners += 8, centres += 3) {
+		float x[4], y[4];
+		for (int i = 0; i < 4; i++) {
+			x[i] = (corners[2 * i] - cx) / fx;
+			y[i] = (corners[2 * i + 1] - cy) / fy;
+		}
+		if (distorted) {
+			for (int i = 0; i < 4; i++) {
+				float x0 = x[i], y0 = y[i];
+				for (int it = 0; it < POSE_UNDISTORT_ITERATIONS;
+				     it++) {
+					float r2 = x[i] * x[i] + y[i] * y[i];
+					float radial = 1 / (1 + r2 * (k1
+						+ r2 * (k2 + r2 * k3)));
+					float dx = 2 * p1 * x[i] * y[i]
+						+ p2 * (r2 + 2 * x[i] * x[i]);
+					float dy = p1 * (r2 + 2 * y[i] * y[i])
+						+ 2 * p2 * x[i] * y[i];
+					x[i] = (x0 - dx) * radial;
+					y[i] = (y0 - dy) * radial;
+				}
+			}
+		}
+
+		// The homography H from the unit square, (0, 0), (1, 0),
+		// (1, 1) and (0, 1), to the corners (Heckbert's
+		// square-to-quad). It is s [r1 r2 t] of the marker plane,
+		// with the unit square scaled to the marker.
+		float sx = x[0] - x[1] + x[2] - x[3];
+		float sy = y[0] - y[1] + y[2] - y[3];
+		float dx1 = x[1] - x[2], dx2 = x[3] - x[2];
+		float dy1 = y[1] - y[2], dy2 = y[3] - y[2];
+		float den = dx1 * dy2 - dx2 * dy1;
+		float g = (sx * dy2 - dx2 * sy) / den;
+		float h = (dx1 * sy - sx * dy1) / den;
+		float h1[3] = {x[1] - x[0] + g * x[1], y[1] - y[0] + g * y[1],
+			       g};
+		float h2[3] = {x[3] - x[0] + h * x[3], y[3] - y[0] + h * y[3],
+			       h};
+		float n1 = std::sqrt(h1[0] * h1[0] + h1[1] * h1[1]
+				     + h1[2] * h1[2]);
+		float n2 = std::sqrt(h2[0] * h2[0] + h2[1] * h2[1]
+				     + h2[2] * h2[2]);
+		// the axes are unit vectors times the side, over the depth
+		float depth = marker_size / std::sqrt(n1 * n2);
+		// the centre is (0.5, 0.5) on the square
+		centres[0] = depth * (x[0] + (h1[0] + h2[0]) / 2);
+		centres[1] = depth * (y[0] + (h1[1] + h2[1]) / 2);
+		centres[2] = depth * (1 + (h1[2] + h2[2]) / 2);
+	}
+}
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef POSE_HH
+#define POSE_HH
+
+#include <vector>
+
+// the side of the black square of the gate markers, metres
+#ifndef MARKER_SIZE_M
+# define MARKER_SIZE_M 0.15
+#endif
+// fixed-point iterations to invert the lens distortion, as OpenCV
+#ifndef POSE_UNDISTORT_ITERATIONS
+# define POSE_UNDISTORT_ITERATIONS 5
+#endif
+
+/**
+ * @brief Metric positions of square markers seen by a calibrated camera
+ *
+ * The four corners of a marker are undistorted and normalised with the
+ * camera intrinsics, and the homography from the marker square to them is
+ * found in closed form. Its first two columns are the marker axes scaled
+ * by one over the depth, so the scale and the translation fall out without
+ * a solver or an iteration. This is the planar pose IPPE starts from; the
+ * rotation it then refines, and the two-fold ambiguity it resolves, do not
+ * move the marker centre, which is all a gate needs.
+ *
+ * Every marker of a frame is located in one call, with straight-line float
+ * code and no allocation, so it is cheap enough to run on every frame.
+ *
+ * Nothing here depends on OpenCV.
+ */
+class Pose {
+private:
+	static float fx, fy, cx, cy;
+	static float k1, k2, p1, p2, k3;
+	static bool distorted;
+	static float marker_size; ///< metres, 0 if not calibrated
+public:
+	/**
+	 * Set the camera model, as calibrated by OpenCV at the capture
+	 * resolution.
+	 *
+	 * @param intrinsics  fx, fy, cx, cy, in pixels
+	 * @param distortion  k1, k2, p1, p2 and optionally k3, or empty
+	 * @param size  the marker side, metres
+	 * @returns false, and stays uncalibrated, if the model is malformed
+	 */
+	static bool calibrate(const std::vector<double>& intrinsics,
+			      const std::vector<double>& distortion,
+			      double size);
+
+	static bool calibrated(void) { return marker_size > 0; }
+
+	/**
+	 * Locate the centres of `n` markers in the camera frame: x right,
+	 * y down and z forward, in metres. The corners are in the order of
+	 * the ArUco detector, clockwise from the top left of the marker.
+	 *
+	 * @param corners  8 floats per marker, x0, y0 ... x3, y3, in pixels
+	 * @param centres  3 floats per marker
+	 */
+	static void locate(const float* corners, int n, float* centres);
+};
+
+#endif // POSE_HH
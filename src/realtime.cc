@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <vector>
+
+#include "config.hh"
+#include "logger.hh"
+#include "realtime.hh"
+
+void
+Realtime::init(void) {
+	if (!Config::get_instance().rt_mode)
+		return;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		log_warn << "Could not lock memory: "
+			+ std::string(strerror(errno));
+	else
+		log_info << "memory locked";
+}
+
+void
+Realtime::apply(const char* name, int cpu, int priority) {
+	if (cpu >= 0) {
+		int n_cpus = std::max(1u, std::thread::hardware_concurrency());
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu % n_cpus, &set);
+		int err = pthread_setaffinity_np(pthread_self(), sizeof set,
+						 &set);
+		if (err)
+			log_warn << std::string("Could not pin the ") + name
+				+ " thread to cpu " + std::to_string(cpu)
+				+ ": " + strerror(err);
+	}
+	if (priority > 0) {
+		sched_param param;
+		memset(&param, 0, sizeof param);
+		param.sched_priority = std::min(
+			priority, sched_get_priority_max(SCHED_FIFO));
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO,
+						&param);
+		if (err)
+			log_warn << std::string("Could not make the ") + name
+				+ " thread SCHED_FIFO: " + strerror(err);
+	}
+	prefault_stack();
+	log_info << std::string("real-time ") + name + " thread on cpu "
+		+ std::to_string(cpu) + ", priority "
+		+ std::to_string(priority);
+}
+
+void
+Realtime::prefault_stack(void) {
+	// touched through a volatile pointer, so the stores are not elided
+	volatile char stack[REALTIME_STACK_PREFAULT];
+	for (size_t i = 0; i < sizeof stack; i += 4096)
+		stack[i] = 0;
+}
+
+void
+Realtime::enter(Role role, int index) {
+	const Config& config = Config::get_instance();
+	if (!config.rt_mode)
+		return;
+	switch (role) {
+	case ROLE_CAPTURE:
+		apply("capture", config.rt_capture_cpu,
+		      config.rt_capture_priority);
+		break;
+	case ROLE_DETECT:
+		apply("detect", config.rt_detect_cpu < 0
+		      ? -1 : config.rt_detect_cpu + index,
+		      config.rt_detect_priority);
+		break;
+	case ROLE_DECIDE:
+		apply("decide", config.rt_decide_cpu,
+		      config.rt_decide_priority);
+		break;
+	case ROLE_OUTPUT:
+		apply("output", config.rt_output_cpu,
+		      config.rt_output_priority);
+		break;
+	}
+}
+
+/**
+ * Wake up every period for `seconds`, and print how late each wake-up was
+ * and how far each period was from the nominal one.
+ */
+static void
+measure_jitter(const char* label, double seconds, std::ostream& out) {
+	const long period_ns = REALTIME_JITTER_PERIOD_US * 1000L;
+	size_t n = seconds * 1e9 / period_ns;
+	std::vector<double> late_us, period_us;
+	late_us.reserve(n);
+	period_us.reserve(n);
+	timespec next, now, last;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	last = next;
+	for (size_t i = 0; i < n; i++) {
+		next.tv_nsec += period_ns;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+				       nullptr) == EINTR)
+			;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		late_us.push_back((now.tv_sec - next.tv_sec) * 1e6
+				  + (now.tv_nsec - next.tv_nsec) / 1e3);
+		period_us.push_back((now.tv_sec - last.tv_sec) * 1e6
+				    + (now.tv_nsec - last.tv_nsec) / 1e3);
+		last = now;
+	}
+	if (late_us.empty())
+		return;
+
+	double mean = 0, var = 0;
+	for (double p : period_us)
+		mean += p;
+	mean /= period_us.size();
+	for (double p : period_us)
+		var += (p - mean) * (p - mean);
+	var /= period_us.size();
+	std::sort(late_us.begin(), late_us.end());
+	std::sort(period_us.begin(), period_us.end());
+	out << label << "_period_mean_us: " << mean << std::endl
+	    << label << "_period_stddev_us: " << std::sqrt(var) << std::endl
+	    << label << "_period_min_us: " << period_us.front() << std::endl
+	    << label << "_period_max_us: " << period_us.back() << std::endl;
+	for (double q : {0.5, 0.99, 0.999}) {
+		size_t i = std::min(late_us.size() - 1,
+				    (size_t)(q * late_us.size()));
+		out << label << "_latency_p" << q * 100 << "_us: "
+		    << late_us[i] << std::endl;
+	}
+	out << label << "_latency_max_us: " << late_us.back() << std::endl;
+}
+
+void
+Realtime::jitter_test(double seconds, std::ostream& out) {
+	// as the detection workers load every core of the rover
+	std::atomic<bool> stop{false};
+	std::vector<std::thread> load;
+	for (unsigned i = 0; i < std::thread::hardware_concurrency(); i++)
+		load.emplace_back([&stop] {
+			std::vector<char> buf(4 << 20);
+			while (!stop.load(std::memory_order_relaxed))
+				for (size_t j = 0; j < buf.size(); j += 64)
+					buf[j]++;
+		});
+
+	const Config& config = Config::get_instance();
+	out << "jitter_period_us: " << REALTIME_JITTER_PERIOD_US << std::endl
+	    << "load_threads: " << load.size() << std::endl;
+	std::thread([&] { measure_jitter("rt_off", seconds, out); }).join();
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		log_warn << "Could not lock memory: "
+			+ std::string(strerror(errno));
+	std::thread([&] {
+		apply("jitter", config.rt_decide_cpu,
+		      config.rt_decide_priority);
+		measure_jitter("rt_on", seconds, out);
+	}).join();
+
+	stop = true;
+	for (auto& t : load)
+		t.join();
+}
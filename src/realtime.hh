@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef REALTIME_HH
+#define REALTIME_HH
+
+#include <ostream>
+
+// stack touched by every real-time thread as it starts, so a deep call never
+// takes a page fault
+#ifndef REALTIME_STACK_PREFAULT
+# define REALTIME_STACK_PREFAULT (256 * 1024)
+#endif
+// period of the thread woken by the jitter test
+#ifndef REALTIME_JITTER_PERIOD_US
+# define REALTIME_JITTER_PERIOD_US 1000
+#endif
+
+/**
+ * @brief The opt-in real-time mode of the pipeline threads
+ *
+ * With `rt_mode` set in the configuration file, the memory of the process
+ * is locked, and each pipeline thread pins itself to its configured core,
+ * runs `SCHED_FIFO` at its configured priority and pre-faults its stack as
+ * it starts, so no other task on the Pi can preempt it and it never waits
+ * for a page. Without the privilege to do so (root or `CAP_SYS_NICE` and
+ * `CAP_IPC_LOCK`), a warning is logged and the thread runs as usual.
+ */
+class Realtime {
+public:
+	enum Role { ROLE_CAPTURE, ROLE_DETECT, ROLE_DECIDE, ROLE_OUTPUT };
+
+	/**
+	 * Lock all present and future memory of the process, if `rt_mode`
+	 * is set. Call once, before the pipeline threads start.
+	 */
+	static void init(void);
+
+	/**
+	 * Make the calling thread real-time in its role, if `rt_mode` is
+	 * set.
+	 *
+	 * @param index  the detection worker number, which picks its core
+	 */
+	static void enter(Role role, int index = 0);
+
+	/**
+	 * Wake a thread every `REALTIME_JITTER_PERIOD_US` for `seconds` with
+	 * the real-time mode off, then again in the decision thread's
+	 * real-time settings, both under a busy load on every core, and print
+	 * the spread of the wake-up periods and latencies of each run.
+	 */
+	static void jitter_test(double seconds, std::ostream& out);
+private:
+	/**
+	 * Pin the calling thread to `cpu` (if not negative) and run it at
+	 * `SCHED_FIFO` `priority` (if positive).
+	 */
+	static void apply(const char* name, int cpu, int priority);
+
+	static void prefault_stack(void);
+};
+
+#endif // REALTIME_HH
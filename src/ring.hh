@@ -0,0 +1,254 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RING_HH
+#define RING_HH
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+
+#ifndef CACHE_LINE_SIZE
+# define CACHE_LINE_SIZE 64
+#endif
+
+/**
+ * @brief A bounded lock-free single-producer/single-consumer ring
+ *
+ * The slots are constructed once and never destroyed while the ring lives,
+ * so a slot can own a buffer (e.g. a `cv::Mat`) that is reused by every
+ * element passing through it. The producer fills the slot returned by
+ * `back()` in place and publishes it with `push()`; the consumer reads the
+ * slot returned by `front()` in place and recycles it with `pop()`.
+ *
+ * @tparam T  the slot type
+ * @tparam N  the number of slots, must be a power of two
+ */
+template <typename T, size_t N>
+class SpscRing {
+	static_assert(N >= 2 && (N & (N - 1)) == 0,
+		      "SpscRing size must be a power of two");
+private:
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> head{0}; ///< next to pop
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0}; ///< next to push
+	alignas(CACHE_LINE_SIZE) T slots[N];
+public:
+	/**
+	 * Get the slot to be filled by the producer.
+	 * @returns the free slot, or `nullptr` if the ring is full
+	 */
+	T* back(void) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == N)
+			return nullptr;
+		return &slots[t & (N - 1)];
+	}
+
+	/**
+	 * Publish the slot returned by `back()` to the consumer.
+	 */
+	void push(void) {
+		tail.store(tail.load(std::memory_order_relaxed) + 1,
+			   std::memory_order_release);
+	}
+
+	/**
+	 * Get the oldest published slot.
+	 * @returns the slot, or `nullptr` if the ring is empty
+	 */
+	T* front(void) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return nullptr;
+		return &slots[h & (N - 1)];
+	}
+
+	/**
+	 * Give the slot returned by `front()` back to the producer.
+	 */
+	void pop(void) {
+		head.store(head.load(std::memory_order_relaxed) + 1,
+			   std::memory_order_release);
+	}
+
+	/**
+	 * The number of published slots. Only a snapshot when called from a
+	 * thread other than the producer or the consumer.
+	 */
+	size_t size(void) const {
+		return tail.load(std::memory_order_acquire)
+			- head.load(std::memory_order_acquire);
+	}
+
+	static constexpr size_t capacity(void) { return N; }
+};
+
+/**
+ * @brief A bounded lock-free multi-producer/single-consumer ring
+ *
+ * Each slot carries a sequence number telling whether it is free for the
+ * producer of a given position or published for the consumer, so producers
+ * only contend on one compare-and-swap and never wait for each other. A
+ * producer that finds the ring full gives up instead of blocking.
+ *
+ * @tparam T  the slot type
+ * @tparam N  the number of slots, must be a power of two
+ */
+template <typename T, size_t N>
+class MpscRing {
+	static_assert(N >= 2 && (N & (N - 1)) == 0,
+		      "MpscRing size must be a power of two");
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0}; ///< producers
+	alignas(CACHE_LINE_SIZE) size_t head = 0; ///< consumer only
+	alignas(CACHE_LINE_SIZE) Cell cells[N];
+public:
+	MpscRing() {
+		for (size_t i = 0; i < N; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Claim a slot, fill it in place and publish it.
+	 *
+	 * @param fill  called with the slot, `void(T&)`
+	 * @returns false if the ring is full, without calling `fill`
+	 */
+	template <typename Fill>
+	bool push(Fill fill) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells[pos & (N - 1)];
+			size_t seq = cell.sequence.load(
+				std::memory_order_acquire);
+			if (seq == pos) {
+				if (tail.compare_exchange_weak(
+					    pos, pos + 1,
+					    std::memory_order_relaxed)) {
+					fill(cell.data);
+					cell.sequence.store(
+						pos + 1,
+						std::memory_order_release);
+					return true;
+				}
+			} else if ((ptrdiff_t)(seq - pos) < 0) {
+				return false;
+			} else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/**
+	 * Get the oldest published slot.
+	 * @returns the slot, or `nullptr` if the ring is empty
+	 */
+	T* front(void) {
+		Cell& cell = cells[head & (N - 1)];
+		if (cell.sequence.load(std::memory_order_acquire) != head + 1)
+			return nullptr;
+		return &cell.data;
+	}
+
+	/**
+	 * Give the slot returned by `front()` back to the producers.
+	 */
+	void pop(void) {
+		cells[head & (N - 1)].sequence.store(
+			head + N, std::memory_order_release);
+		head++;
+	}
+};
+
+/**
+ * @brief A lock-free latest-value channel between one producer and one
+ * consumer
+ *
+ * The producer always has a slot of its own to write, and publishing swaps it
+ * with the middle slot. The consumer swaps the middle slot with its own only
+ * if something new was published. Values published while the consumer is
+ * busy overwrite each other, so the consumer only ever sees the newest one
+ * and neither side waits.
+ */
+template <typename T>
+class TripleBuffer {
+private:
+	static constexpr unsigned FRESH = 4; ///< set in `middle` when new
+	T slots[3];
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned> middle{1};
+	alignas(CACHE_LINE_SIZE) unsigned back = 0; ///< producer only
+	alignas(CACHE_LINE_SIZE) unsigned front = 2; ///< consumer only
+public:
+	/**
+	 * The slot to be filled by the producer.
+	 */
+	T& write_slot(void) { return slots[back]; }
+
+	/**
+	 * Publish the slot returned by `write_slot()`, replacing any value
+	 * the consumer has not taken yet.
+	 * @returns true if a value was replaced unread
+	 */
+	bool publish(void) {
+		unsigned old = middle.exchange(back | FRESH,
+					       std::memory_order_acq_rel);
+		back = old & 3;
+		return old & FRESH;
+	}
+
+	/**
+	 * Take the newest value.
+	 * @returns the value, or `nullptr` if nothing was published since the
+	 *          last call
+	 */
+	T* read_latest(void) {
+		if (!(middle.load(std::memory_order_relaxed) & FRESH))
+			return nullptr;
+		front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+		return &slots[front];
+	}
+};
+
+/**
+ * Back off while waiting on a ring: spin briefly, then yield, then sleep, so
+ * an idle stage does not burn a whole core of the Pi.
+ *
+ * @param spins  the number of times the caller has waited so far; reset it
+ *               to 0 once the ring is ready
+ */
+inline void
+ring_wait(unsigned& spins) {
+	if (spins < 64) {
+		spins++;
+	} else if (spins < 128) {
+		spins++;
+		std::this_thread::yield();
+	} else {
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+}
+
+#endif // RING_HH
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "shm.hh"
+
+static const char SHM_MAGIC[8] = "MARSHM";
+
+Shm::Header* Shm::writer = nullptr;
+
+static long
+futex(const std::atomic<uint32_t>* word, int op, uint32_t value,
+      const timespec* timeout) {
+	return syscall(SYS_futex, reinterpret_cast<const uint32_t*>(word), op,
+		       value, timeout, nullptr, 0);
+}
+
+bool
+Shm::create(const std::string& name) {
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1)
+		return false;
+	if (ftruncate(fd, sizeof(Header)) == -1) {
+		::close(fd);
+		shm_unlink(name.c_str());
+		return false;
+	}
+	void* map = mmap(nullptr, sizeof(Header), PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		return false;
+	}
+	// the segment is zeroed: no frame yet, sequence 0
+	writer = static_cast<Header*>(map);
+	writer->version = VERSION;
+	writer->frame_size = sizeof(Frame);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(writer->magic, SHM_MAGIC, sizeof SHM_MAGIC);
+	return true;
+}
+
+void
+Shm::publish(const Frame& frame) {
+	if (!writer)
+		return;
+	uint64_t seq = writer->sequence.load(std::memory_order_relaxed);
+	writer->sequence.store(seq + 1, std::memory_order_relaxed);
+	// the odd sequence is seen before any of the frame
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(&writer->frame, &frame, sizeof frame);
+	writer->sequence.store(seq + 2, std::memory_order_release);
+	writer->published.fetch_add(1, std::memory_order_release);
+	futex(&writer->published, FUTEX_WAKE, INT_MAX, nullptr);
+}
+
+bool
+Shm::Reader::open(const std::string& name) {
+	close();
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Header)) {
+		::close(fd);
+		errno = EPROTO;
+		return false;
+	}
+	void* map = mmap(nullptr, sizeof(Header), PROT_READ, MAP_SHARED, fd,
+			 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	header = static_cast<const Header*>(map);
+	if (memcmp(header->magic, SHM_MAGIC, sizeof SHM_MAGIC)
+	    || header->version != VERSION
+	    || header->frame_size != sizeof(Frame)) {
+		close();
+		errno = EPROTO;
+		return false;
+	}
+	return true;
+}
+
+void
+Shm::Reader::close(void) {
+	if (header)
+		munmap(const_cast<Header*>(header), sizeof(Header));
+	header = nullptr;
+}
+
+bool
+Shm::Reader::read(Frame& frame) const {
+	if (!header)
+		return false;
+	for (int i = 0; i < SHM_READ_TRIES; i++) {
+		uint64_t before = header->sequence.load(
+			std::memory_order_acquire);
+		if (!before)
+			return false;
+		if (before & 1)
+			continue;
+		memcpy(&frame, &header->frame, sizeof frame);
+		// the copy is done before the sequence is read again
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (header->sequence.load(std::memory_order_relaxed) == before)
+			return true;
+	}
+	return false;
+}
+
+bool
+Shm::Reader::wait(uint32_t& seen, int timeout_ms) const {
+	if (!header)
+		return false;
+	timespec timeout = {timeout_ms / 1000, timeout_ms % 1000 * 1000000L};
+	uint32_t now = header->published.load(std::memory_order_acquire);
+	if (now == seen)
+		futex(&header->published, FUTEX_WAIT, seen,
+		      timeout_ms < 0 ? nullptr : &timeout);
+	now = header->published.load(std::memory_order_acquire);
+	if (now == seen)
+		return false;
+	seen = now;
+	return true;
+}
@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHM_HH
+#define SHM_HH
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// the POSIX shared memory object the detections are published in
+#ifndef SHM_PATH
+# define SHM_PATH "/marvision"
+#endif
+#ifndef SHM_MAX_MARKERS
+# define SHM_MAX_MARKERS 32
+#endif
+// times a reader tries for an untorn copy before it gives up
+#ifndef SHM_READ_TRIES
+# define SHM_READ_TRIES 1000
+#endif
+
+/**
+ * @brief The detections of the latest frame, in POSIX shared memory for any
+ * number of local readers
+ *
+ * marvision writes every decided frame, its markers, the gate chosen and
+ * the output, into one slot guarded by a seqlock: the sequence number is odd
+ * while the frame is written, and a reader copies the frame and takes it
+ * only if the sequence was even and unchanged across the copy. Readers
+ * never write to the segment, so they can neither block nor disturb the
+ * pipeline, and a read costs a copy of a few kilobytes. A reader that
+ * wants every frame waits on a futex the writer wakes after each one.
+ *
+ * The layout is plain data and the version is checked on open, so readers
+ * only need this header and libmarvision-shm; nothing here depends on
+ * OpenCV. The clocks are `CLOCK_MONOTONIC`, i.e. `std::chrono::steady_clock`.
+ */
+class Shm {
+public:
+	static constexpr uint32_t VERSION = 1;
+
+	enum Flag {
+		FLAG_GATE = 1, ///< a gate pair was chosen
+		FLAG_FALLBACK = 2, ///< the pairing algorithm fell back
+		FLAG_BRIDGED = 4, ///< no gate this frame, the target is tracked
+	};
+
+	struct Marker {
+		int32_t id;
+		float corners[8]; ///< x0, y0 ... x3, y3, pixels
+		float centre[2];
+		float area; ///< pixels
+		float position[3]; ///< metres, 0 if not calibrated
+	};
+
+	struct Frame {
+		uint64_t seq; ///< the frame number
+		int64_t captured_ns; ///< steady clock at capture
+		int64_t decided_ns; ///< steady clock at decision
+		uint32_t gate_passed;
+		char output; ///< the char sent
+		uint8_t flags; ///< `Flag`s
+		uint8_t n_markers;
+		uint8_t n_gates; ///< gates found, the chosen one nearest
+		int8_t left; ///< index of the left gate marker, or -1
+		int8_t right; ///< index of the right gate marker, or -1
+		char reserved[6];
+		float gate_x, gate_width; ///< the chosen gate, -1 if none
+		float target_x, target_width; ///< steered to, -1 if none
+		float gate_distance; ///< metres, -1 if not calibrated
+		float gate_bearing; ///< radians right of straight ahead
+		Marker markers[SHM_MAX_MARKERS]; ///< largest first
+	};
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t frame_size;
+		std::atomic<uint64_t> sequence; ///< odd while being written
+		std::atomic<uint32_t> published; ///< frames, a futex
+		uint32_t reserved;
+		Frame frame;
+	};
+
+	/**
+	 * Create, size and map the segment for writing, replacing an old
+	 * one.
+	 * @returns false on error; publishing is then a no-op
+	 */
+	static bool create(const std::string& name);
+
+	static bool enabled(void) { return writer; }
+
+	/**
+	 * Publish a frame, replacing the last one, and wake the waiting
+	 * readers.
+	 */
+	static void publish(const Frame& frame);
+
+	/**
+	 * @brief A read only mapping of the segment
+	 */
+	class Reader {
+	private:
+		const Header* header;
+	public:
+		Reader() : header(nullptr) {}
+		~Reader() { close(); }
+		Reader(const Reader&) = delete;
+		Reader& operator=(const Reader&) = delete;
+
+		/**
+		 * @returns false, with errno set, if the segment does not
+		 *          exist or is not of this version
+		 */
+		bool open(const std::string& name = SHM_PATH);
+
+		void close(void);
+
+		/**
+		 * Copy the latest frame.
+		 * @returns false if none is published yet, or the writer
+		 *          kept overwriting it
+		 */
+		bool read(Frame& frame) const;
+
+		/**
+		 * Wait up to `timeout_ms`, or forever if negative, until a
+		 * frame after the `seen`th is published, and update `seen`.
+		 * Start with `seen` 0.
+		 * @returns false on time out, or if a signal interrupted
+		 *          the wait
+		 */
+		bool wait(uint32_t& seen, int timeout_ms = -1) const;
+	};
+private:
+	static Header* writer;
+};
+
+#endif // SHM_HH
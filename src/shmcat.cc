@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * marvision-shm -- print the detections a running marvision publishes in
+ * shared memory
+ *
+ * The latest frame is printed as a YAML document. With -f, every frame is
+ * printed as it is published, until interrupted or -c COUNT frames.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+
+#include "shm.hh"
+
+static void
+print_frame(const Shm::Frame& frame) {
+	int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	printf("---\n"
+	       "seq: %llu\n"
+	       "read_after_us: %.1f\n"
+	       "frame_age_ms: %.3f\n"
+	       "output: \"%c\"\n"
+	       "gate_passed: %u\n"
+	       "gate: %d\n"
+	       "pair_fallback: %d\n"
+	       "bridged: %d\n"
+	       "gate_x: %.2f\n"
+	       "gate_width: %.2f\n"
+	       "target_x: %.2f\n"
+	       "target_width: %.2f\n"
+	       "gate_distance: %.3f\n"
+	       "gate_bearing: %.4f\n"
+	       "n_gates: %u\n"
+	       "left: %d\n"
+	       "right: %d\n"
+	       "markers:\n",
+	       (unsigned long long)frame.seq,
+	       (now_ns - frame.decided_ns) / 1e3,
+	       (frame.decided_ns - frame.captured_ns) / 1e6, frame.output,
+	       frame.gate_passed, !!(frame.flags & Shm::FLAG_GATE),
+	       !!(frame.flags & Shm::FLAG_FALLBACK),
+	       !!(frame.flags & Shm::FLAG_BRIDGED), frame.gate_x,
+	       frame.gate_width, frame.target_x, frame.target_width,
+	       frame.gate_distance, frame.gate_bearing, frame.n_gates,
+	       frame.left, frame.right);
+	for (int i = 0; i < frame.n_markers && i < SHM_MAX_MARKERS; i++) {
+		const Shm::Marker& m = frame.markers[i];
+		printf("  - {id: %d, centre: [%.2f, %.2f], area: %.1f, "
+		       "corners: [", m.id, m.centre[0], m.centre[1], m.area);
+		for (int k = 0; k < 8; k++)
+			printf(k ? ", %.2f" : "%.2f", m.corners[k]);
+		printf("], position: [%.3f, %.3f, %.3f]}\n", m.position[0],
+		       m.position[1], m.position[2]);
+	}
+	fflush(stdout);
+}
+
+int
+main(int argc, char* argv[]) {
+	std::string name = SHM_PATH;
+	bool follow = false;
+	long count = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:fc:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'f':
+			follow = true;
+			break;
+		case 'c':
+			count = std::atol(optarg);
+			break;
+		default:
+			std::cerr << "Usage: " << argv[0]
+				  << " [-n NAME] [-f [-c COUNT]]" << std::endl;
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	Shm::Reader reader;
+	if (!reader.open(name)) {
+		std::cerr << name << ": " << strerror(errno) << std::endl;
+		return EXIT_FAILURE;
+	}
+	Shm::Frame frame;
+	if (!follow) {
+		if (!reader.read(frame)) {
+			std::cerr << name << ": no frame published yet"
+				  << std::endl;
+			return EXIT_FAILURE;
+		}
+		print_frame(frame);
+		return EXIT_SUCCESS;
+	}
+	uint32_t seen = 0;
+	for (long i = 0; count < 0 || i < count;) {
+		if (!reader.wait(seen, 1000) || !reader.read(frame))
+			continue;
+		print_frame(frame);
+		i++;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/videoio.hpp>
+#include <string>
+#include <thread>
+
+#include "logger.hh"
+#include "source.hh"
+
+/**
+ * `seconds` on the steady clock.
+ */
+static std::chrono::steady_clock::duration
+duration(double seconds) {
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>(seconds));
+}
+
+void
+FrameSource::pace(void) {
+	if (frames_read++ == 0)
+		start = std::chrono::steady_clock::now();
+	if (fps <= 0)
+		return;
+	std::this_thread::sleep_until(start
+				      + duration((frames_read - 1) / fps));
+}
+
+CaptureSource::CaptureSource(const std::string& gst_pipeline)
+	: cap(gst_pipeline, cv::CAP_GSTREAMER), live(true), recorded_fps(0),
+	  recorded(std::chrono::steady_clock::duration::zero()) {
+	if (!cap.isOpened())
+		log_crit << "Could not open GStreamer pipeline " + gst_pipeline;
+}
+
+CaptureSource::CaptureSource(const std::string& video_path, bool realtime)
+	: cap(video_path), live(false), recorded_fps(REPLAY_IMAGE_FPS),
+	  recorded(std::chrono::steady_clock::duration::zero()) {
+	if (!cap.isOpened()) {
+		log_crit << "Could not open video " + video_path;
+		return;
+	}
+	double file_fps = cap.get(cv::CAP_PROP_FPS);
+	if (file_fps > 0)
+		recorded_fps = file_fps;
+	if (realtime) {
+		fps = file_fps;
+		if (fps <= 0)
+			log_warn << "Video has no frame rate, replaying as "
+				"fast as possible";
+	}
+}
+
+bool
+CaptureSource::read(cv::Mat& image) {
+	if (!live)
+		pace();
+	cap.read(image);
+	if (live || image.empty())
+		return live;
+	// the position is the timestamp of the frame just read, if the file
+	// and the backend have them; otherwise count frames, so the time
+	// never stands still or goes back
+	auto position = duration(cap.get(cv::CAP_PROP_POS_MSEC) / 1000);
+	if (frames_read == 1 || position > recorded)
+		recorded = position;
+	else
+		recorded += duration(1 / recorded_fps);
+	return true;
+}
+
+ImageDirSource::ImageDirSource(const std::string& dir, double fps,
+			       double recorded_fps)
+	: FrameSource(fps), next(0),
+	  recorded_fps(recorded_fps > 0 ? recorded_fps : REPLAY_IMAGE_FPS),
+	  recorded(std::chrono::steady_clock::duration::zero()) {
+	cv::glob(dir, paths, false);
+	std::sort(paths.begin(), paths.end());
+	log_info << "replaying " + std::to_string(paths.size())
+		+ " images from " + dir;
+}
+
+bool
+ImageDirSource::read(cv::Mat& image) {
+	for (; next < paths.size(); next++) {
+		pace();
+		image = cv::imread(paths[next]);
+		if (!image.empty()) {
+			recorded = duration(next / recorded_fps);
+			next++;
+			return true;
+		}
+		log_warn << "Skipping unreadable image " + paths[next];
+	}
+	return false;
+}
@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SOURCE_HH
+#define SOURCE_HH
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+// frame rate of a replay that does not record one, e.g. an image directory
+#ifndef REPLAY_IMAGE_FPS
+# define REPLAY_IMAGE_FPS 50
+#endif
+
+/**
+ * @brief Where the vision pipeline gets its frames from
+ *
+ * The live camera and recorded runs are read through the same interface, so
+ * a replay goes through exactly the same pipeline as the rover does.
+ */
+class FrameSource {
+protected:
+	double fps; ///< replay rate, 0 for as fast as possible
+	unsigned long frames_read;
+	std::chrono::steady_clock::time_point start;
+
+	/**
+	 * Sleep until the next frame is due at `fps`.
+	 */
+	void pace(void);
+public:
+	FrameSource(double fps = 0) : fps(fps), frames_read(0) {}
+	virtual ~FrameSource() {}
+
+	/**
+	 * Read the next frame into `image`, reusing its buffer if possible.
+	 *
+	 * @returns false at the end of the stream. An empty `image` with true
+	 *          means the frame was lost and the caller should read again.
+	 */
+	virtual bool read(cv::Mat& image) = 0;
+
+	/**
+	 * Read the next frame without copying it, if the source can. `image`
+	 * then points into memory owned by the source until it is given back
+	 * with `release(lease)`. Sources that cannot lend their frames read
+	 * into `image` as `read()` does and set `lease` to `nullptr`.
+	 *
+	 * @returns as `read()`
+	 */
+	virtual bool acquire(cv::Mat& image, void*& lease) {
+		lease = nullptr;
+		return read(image);
+	}
+
+	/**
+	 * Give a frame from `acquire()` back to the source. Safe to call from
+	 * any thread.
+	 */
+	virtual void release(void* lease) {}
+
+	/**
+	 * How long before the last `read()` or `acquire()` returned the
+	 * camera captured its frame, if the source can tell, e.g. from the
+	 * buffer timestamps. Sources that cannot tell return 0, the frame is
+	 * then taken to be captured when it was read.
+	 */
+	virtual std::chrono::steady_clock::duration frame_age(void) const {
+		return std::chrono::steady_clock::duration::zero();
+	}
+
+	/**
+	 * When the last frame read was recorded, from the start of the
+	 * recording, for a source that replays one. What depends on the
+	 * time between frames, e.g. the gate tracker, then sees the time of
+	 * the recording rather than how fast this machine reads it.
+	 *
+	 * @returns false for a live source
+	 */
+	virtual bool
+	recorded_time(std::chrono::steady_clock::duration& time) const {
+		return false;
+	}
+};
+
+/**
+ * @brief Frames from `cv::VideoCapture`: a GStreamer pipeline or a video file
+ */
+class CaptureSource : public FrameSource {
+private:
+	cv::VideoCapture cap;
+	bool live; ///< a camera never ends, a file does
+	double recorded_fps; ///< of the file, for frames without a position
+	std::chrono::steady_clock::duration recorded;
+public:
+	/**
+	 * Open the live GStreamer pipeline.
+	 */
+	CaptureSource(const std::string& gst_pipeline);
+
+	/**
+	 * Open a recorded video file.
+	 *
+	 * @param realtime  replay at the frame rate recorded in the file
+	 *                  rather than as fast as possible
+	 */
+	CaptureSource(const std::string& video_path, bool realtime);
+
+	bool read(cv::Mat& image) override;
+
+	/**
+	 * The position of the frame in the file, or the frame number over
+	 * the frame rate if the file has no timestamps.
+	 */
+	bool
+	recorded_time(std::chrono::steady_clock::duration& time)
+		const override {
+		time = recorded;
+		return !live;
+	}
+};
+
+/**
+ * @brief Frames from the image files in a directory, in name order
+ */
+class ImageDirSource : public FrameSource {
+private:
+	std::vector<cv::String> paths;
+	size_t next;
+	double recorded_fps;
+	std::chrono::steady_clock::duration recorded;
+public:
+	/**
+	 * @param fps  replay rate, 0 for as fast as possible
+	 * @param recorded_fps  the rate the images were taken at
+	 */
+	ImageDirSource(const std::string& dir, double fps,
+		       double recorded_fps = REPLAY_IMAGE_FPS);
+
+	bool read(cv::Mat& image) override;
+
+	/**
+	 * The image number over `recorded_fps`; an unreadable image keeps
+	 * its place.
+	 */
+	bool
+	recorded_time(std::chrono::steady_clock::duration& time)
+		const override {
+		time = recorded;
+		return true;
+	}
+};
+
+#endif // SOURCE_HH
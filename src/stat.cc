@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * marvision-stat -- print the stage latencies and counters of a running
+ * marvision
+ *
+ * The snapshot served on the metrics socket is printed as is, one YAML
+ * document per query. With -w, the query is repeated every SECONDS until
+ * interrupted, or -n COUNT times.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "metrics.hh"
+
+/**
+ * Read one snapshot from the socket and print it.
+ * @returns false if marvision cannot be reached
+ */
+static bool
+query(const std::string& path) {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, (sockaddr*)&addr, sizeof addr) == -1) {
+		std::cerr << path << ": " << strerror(errno) << std::endl;
+		if (fd != -1)
+			close(fd);
+		return false;
+	}
+	char buf[4096];
+	ssize_t n;
+	printf("---\n");
+	while ((n = read(fd, buf, sizeof buf)) > 0
+	       || (n == -1 && errno == EINTR))
+		if (n > 0)
+			fwrite(buf, 1, n, stdout);
+	fflush(stdout);
+	close(fd);
+	return true;
+}
+
+int
+main(int argc, char* argv[]) {
+	std::string path = METRICS_SOCKET_PATH;
+	double interval = 0;
+	long count = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:w:n:h")) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'w':
+			interval = std::atof(optarg);
+			break;
+		case 'n':
+			count = std::atol(optarg);
+			break;
+		default:
+			std::cerr << "Usage: " << argv[0]
+				  << " [-s SOCKET] [-w SECONDS [-n COUNT]]"
+				  << std::endl;
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (interval <= 0)
+		count = 1;
+	for (long i = 0; count < 0 || i < count; i++) {
+		if (i)
+			usleep(interval * 1e6);
+		if (!query(path))
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * marvision-teledump -- convert a marvision telemetry ring file to CSV
+ *
+ * By default one line is printed per frame. With -m, one line is printed per
+ * marker instead, with `gate` set to L or R for the chosen gate pair.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <iostream>
+
+#include "telemetry.hh"
+
+static void
+dump_frames(void) {
+	printf("seq,captured_ns,decided_ns,latency_ms,output,gate_passed,"
+	       "gate_x,gate_width,pair_fallback,left,right,n_markers,"
+	       "n_gates\n");
+	for (uint64_t i = 0; i < Telemetry::size(); i++) {
+		const Telemetry::Record& r = Telemetry::get_record(i);
+		printf("%llu,%lld,%lld,%.3f,%c,%u,%.3f,%.3f,%u,%d,%d,%u,%u\n",
+		       (unsigned long long)r.seq, (long long)r.captured_ns,
+		       (long long)r.decided_ns,
+		       (r.decided_ns - r.captured_ns) / 1e6, r.output,
+		       r.gate_passed, r.gate_x, r.gate_width,
+		       r.pair_fallback, r.left, r.right, r.n_markers,
+		       r.n_gates);
+	}
+}
+
+static void
+dump_markers(void) {
+	printf("seq,index,id,x0,y0,x1,y1,x2,y2,x3,y3,area,gate\n");
+	for (uint64_t i = 0; i < Telemetry::size(); i++) {
+		const Telemetry::Record& r = Telemetry::get_record(i);
+		for (int m = 0; m < r.n_markers; m++) {
+			const Telemetry::Marker& marker = r.markers[m];
+			printf("%llu,%d,%d", (unsigned long long)r.seq, m,
+			       marker.id);
+			for (float c : marker.corners)
+				printf(",%.2f", c);
+			printf(",%.1f,%c\n", marker.area,
+			       m == r.left ? 'L' : m == r.right ? 'R' : '-');
+		}
+	}
+}
+
+int
+main(int argc, char* argv[]) {
+	bool markers = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "mh")) != -1) {
+		switch (opt) {
+		case 'm':
+			markers = true;
+			break;
+		default:
+			std::cerr << "Usage: " << argv[0] << " [-m] FILE"
+				  << std::endl;
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		std::cerr << "Usage: " << argv[0] << " [-m] FILE" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (!Telemetry::open_read(argv[optind])) {
+		std::cerr << argv[optind] << ": not a marvision telemetry file"
+			  << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (markers)
+		dump_markers();
+	else
+		dump_frames();
+	return EXIT_SUCCESS;
+}
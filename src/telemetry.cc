@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.hh"
+#include "telemetry.hh"
+
+Telemetry::Header* Telemetry::header = nullptr;
+Telemetry::Record* Telemetry::records = nullptr;
+
+/**
+ * The records start on the first page boundary after the header.
+ */
+static size_t
+records_offset(void) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (sizeof(Telemetry::Header) + page - 1) / page * page;
+}
+
+bool
+Telemetry::open(const std::string& path, uint64_t capacity) {
+	if (capacity == 0)
+		return false;
+	size_t size = records_offset() + capacity * sizeof(Record);
+	size_t slash = path.rfind('/');
+	if (slash != std::string::npos && slash > 0)
+		mkdir(path.substr(0, slash).c_str(), 0755);
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		log_error << "Could not open telemetry " + path + ": "
+			+ strerror(errno);
+		return false;
+	}
+	// allocate the blocks now rather than on the first write back
+	int err = posix_fallocate(fd, 0, size);
+	if (err) {
+		log_error << "Could not allocate telemetry " + path + ": "
+			+ strerror(err);
+		::close(fd);
+		return false;
+	}
+	void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		log_error << "Could not map telemetry " + path + ": "
+			+ strerror(errno);
+		return false;
+	}
+	Header* h = (Header*)map;
+	memcpy(h->magic, TELEMETRY_MAGIC, sizeof h->magic);
+	h->version = TELEMETRY_VERSION;
+	h->record_size = sizeof(Record);
+	h->capacity = capacity;
+	h->start_wall_ns = std::chrono::duration_cast<
+		std::chrono::nanoseconds>(std::chrono::system_clock::now()
+					  .time_since_epoch()).count();
+	h->start_steady_ns = std::chrono::duration_cast<
+		std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+					  .time_since_epoch()).count();
+	h->written.store(0, std::memory_order_release);
+	records = (Record*)((char*)map + records_offset());
+	header = h;
+	log_info << "recording telemetry to " + path + ", "
+		+ std::to_string(capacity) + " frames";
+	return true;
+}
+
+bool
+Telemetry::open_read(const std::string& path) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == -1
+	    || (size_t)st.st_size < records_offset()) {
+		::close(fd);
+		return false;
+	}
+	void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	Header* h = (Header*)map;
+	if (memcmp(h->magic, TELEMETRY_MAGIC, sizeof h->magic)
+	    || h->version != TELEMETRY_VERSION
+	    || h->record_size != sizeof(Record)
+	    || records_offset() + h->capacity * sizeof(Record)
+	    > (size_t)st.st_size) {
+		munmap(map, st.st_size);
+		return false;
+	}
+	records = (Record*)((char*)map + records_offset());
+	header = h;
+	return true;
+}
+
+uint64_t
+Telemetry::size(void) {
+	if (!header)
+		return 0;
+	uint64_t n = header->written.load(std::memory_order_acquire);
+	return n < header->capacity ? n : header->capacity;
+}
+
+const Telemetry::Record&
+Telemetry::get_record(uint64_t i) {
+	uint64_t n = header->written.load(std::memory_order_acquire);
+	return records[(n - size() + i) % header->capacity];
+}
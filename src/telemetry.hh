@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TELEMETRY_HH
+#define TELEMETRY_HH
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// markers kept per frame, the largest ones
+#ifndef TELEMETRY_MAX_MARKERS
+# define TELEMETRY_MAX_MARKERS 8
+#endif
+
+#define TELEMETRY_MAGIC "MARTELE"
+#define TELEMETRY_VERSION 1
+
+/**
+ * @brief A binary per-frame telemetry recorder
+ *
+ * Every decision is stored as one fixed-size record in a ring file mapped
+ * into memory. The file is created and sized when the recorder is opened,
+ * so recording a frame is a copy into the mapping, with no system call and
+ * no formatting; the kernel writes the pages back in the background. The
+ * file keeps the last `capacity` frames and can be read with
+ * `marvision-teledump`, even after a crash.
+ *
+ * Nothing here depends on OpenCV, so the decoder builds on its own.
+ */
+class Telemetry {
+public:
+	struct Marker {
+		int32_t id;
+		float corners[8]; ///< x0, y0, ... x3, y3
+		float area;
+	};
+
+	struct Record {
+		uint64_t seq; ///< the frame number
+		int64_t captured_ns; ///< steady clock at capture
+		int64_t decided_ns; ///< steady clock at decision
+		float gate_x; ///< -1 if no gate was chosen
+		float gate_width; ///< -1 if no gate was chosen
+		uint32_t gate_passed;
+		int8_t left; ///< index of the left gate marker, or -1
+		int8_t right; ///< index of the right gate marker, or -1
+		uint8_t n_markers;
+		uint8_t pair_fallback; ///< the pairing algorithm fell back
+		char output; ///< the char sent
+		uint8_t n_gates; ///< gates found, the chosen one nearest
+		char reserved[6];
+		Marker markers[TELEMETRY_MAX_MARKERS]; ///< largest first
+	};
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t record_size;
+		uint64_t capacity; ///< records in the ring
+		int64_t start_wall_ns; ///< wall clock when recording started
+		int64_t start_steady_ns; ///< steady clock at the same time
+		std::atomic<uint64_t> written; ///< records written so far
+		char reserved[16];
+	};
+
+	/**
+	 * Create, size and map the ring file, replacing an old one.
+	 * @returns false on error; recording is then a no-op
+	 */
+	static bool open(const std::string& path, uint64_t capacity);
+
+	/**
+	 * Map an existing ring file read only, for decoding.
+	 * @returns false if it is not a telemetry file of this version
+	 */
+	static bool open_read(const std::string& path);
+
+	/**
+	 * Append a record, overwriting the oldest once the ring is full.
+	 */
+	static void record(const Record& frame) {
+		if (!header)
+			return;
+		uint64_t n = header->written.load(std::memory_order_relaxed);
+		records[n % header->capacity] = frame;
+		header->written.store(n + 1, std::memory_order_release);
+	}
+
+	static const Header* get_header(void) { return header; }
+
+	/**
+	 * The `i`th oldest record still in the ring.
+	 */
+	static const Record& get_record(uint64_t i);
+
+	/**
+	 * The number of records still in the ring.
+	 */
+	static uint64_t size(void);
+private:
+	static Header* header;
+	static Record* records;
+};
+
+#endif // TELEMETRY_HH
@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ * marvision -- the vision program for the minimal autonomous rover
+ *
+ * Copyright (C) 2024  Qiyang Sun and the MAR Project Maintainers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * marvision-tune -- search cv::aruco::DetectorParameters for the fastest
+ * profile that still finds the markers in a labelled set of recorded frames
+ *
+ * The label file has one frame per line: the image path, relative to the
+ * label file, followed by the ids of the markers visible in it. A frame with
+ * no ids checks that nothing is detected in it. Lines starting with # are
+ * ignored:
+ *
+ *   # image ids...
+ *   run1/000120.png 0 1
+ *   run1/000121.png 0 1 2
+ *   run1/000400.png
+ *
+ * OpenCV's defaults are tried first, then random profiles. One CSV line is
+ * printed per trial:
+ *
+ *   trial,win_min,win_max,win_step,thresh_c,min_perimeter,max_perimeter,
+ *   approx,refine,px_per_cell,aruco3,min_length_ratio,mean_us,p99_us,
+ *   recall,false_ids
+ *
+ * The fastest profile with at least the target recall, and no more false ids
+ * than the defaults, is written in the format read by `detector_profile`.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <iterator>
+#include <opencv2/aruco.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "logger.hh"
+#include "vision.hh"
+
+struct LabelledFrame {
+	cv::Mat image;
+	std::vector<int> ids; ///< sorted
+};
+
+struct Score {
+	double mean_us, p99_us;
+	double recall; ///< labelled markers found over labelled markers
+	unsigned long false_ids; ///< ids found that are not labelled
+};
+
+/**
+ * Read the label file and load its frames in greyscale, as the pipeline
+ * sees them.
+ *
+ * @returns false if the file or any of its images cannot be read
+ */
+static bool
+load_labels(const std::string& path, std::vector<LabelledFrame>& frames) {
+	std::ifstream file(path);
+	if (!file) {
+		std::cerr << "Could not open " << path << std::endl;
+		return false;
+	}
+	size_t slash = path.rfind('/');
+	std::string dir = slash == std::string::npos
+		? "" : path.substr(0, slash + 1);
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream fields(line);
+		std::string image_path;
+		if (!(fields >> image_path) || image_path[0] == '#')
+			continue;
+		if (image_path[0] != '/')
+			image_path = dir + image_path;
+		LabelledFrame frame;
+		frame.image = cv::imread(image_path, cv::IMREAD_GRAYSCALE);
+		if (frame.image.empty()) {
+			std::cerr << "Could not read " << image_path
+				  << std::endl;
+			return false;
+		}
+		int id;
+		while (fields >> id)
+			frame.ids.push_back(id);
+		std::sort(frame.ids.begin(), frame.ids.end());
+		frames.push_back(frame);
+	}
+	return true;
+}
+
+template <typename T, size_t N>
+static T
+pick(cv::RNG& rng, const T (&choices)[N]) {
+	return choices[rng.uniform(0, (int)N)];
+}
+
+/**
+ * Draw a profile from the parameters that dominate the cost of
+ * `detectMarkers`: the adaptive threshold window sweep, the marker perimeter
+ * bounds, the polygon approximation, the bit sampling resolution and the
+ * corner refinement.
+ */
+static cv::aruco::DetectorParameters
+random_params(cv::RNG& rng) {
+	static const int win_mins[] = {3, 5, 7, 9};
+	static const int win_steps[] = {4, 6, 10, 20};
+	static const int win_counts[] = {1, 2, 3, 4};
+	static const double thresh_cs[] = {5, 7, 9};
+	static const double min_perimeters[] = {0.01, 0.02, 0.03, 0.05, 0.08};
+	static const double max_perimeters[] = {1.0, 2.0, 4.0};
+	static const double approxes[] = {0.02, 0.03, 0.05, 0.08};
+	static const int refines[] = {
+		cv::aruco::CORNER_REFINE_NONE, cv::aruco::CORNER_REFINE_SUBPIX,
+		cv::aruco::CORNER_REFINE_CONTOUR
+	};
+	static const int px_per_cells[] = {2, 4, 6, 8};
+	static const float min_length_ratios[] = {0.0f, 0.02f, 0.05f};
+
+	cv::aruco::DetectorParameters params;
+	params.adaptiveThreshWinSizeMin = pick(rng, win_mins);
+	params.adaptiveThreshWinSizeStep = pick(rng, win_steps);
+	params.adaptiveThreshWinSizeMax = params.adaptiveThreshWinSizeMin
+		+ params.adaptiveThreshWinSizeStep
+		* (pick(rng, win_counts) - 1);
+	params.adaptiveThreshConstant = pick(rng, thresh_cs);
+	params.minMarkerPerimeterRate = pick(rng, min_perimeters);
+	params.maxMarkerPerimeterRate = pick(rng, max_perimeters);
+	params.polygonalApproxAccuracyRate = pick(rng, approxes);
+	params.cornerRefinementMethod = pick(rng, refines);
+	params.perspectiveRemovePixelPerCell = pick(rng, px_per_cells);
+	params.useAruco3Detection = rng.uniform(0, 2) == 1;
+	if (params.useAruco3Detection)
+		params.minMarkerLengthRatioOriginalImg =
+			pick(rng, min_length_ratios);
+	return params;
+}
+
+/**
+ * Run a profile over every frame `iterations` times, timing each call and
+ * checking the ids found on the first pass against the labels.
+ */
+static Score
+score(const cv::aruco::DetectorParameters& params,
+      const std::vector<LabelledFrame>& frames, int iterations) {
+	cv::aruco::ArucoDetector aruco(*Vision::dictionary, params);
+	std::vector<std::vector<cv::Point2f> > corners;
+	std::vector<int> ids, found;
+	std::vector<double> us;
+	us.reserve(frames.size() * iterations);
+	unsigned long labelled = 0, matched = 0, false_ids = 0;
+	for (int i = 0; i < iterations; i++)
+	for (const LabelledFrame& frame : frames) {
+		auto start = std::chrono::steady_clock::now();
+		aruco.detectMarkers(frame.image, corners, ids);
+		auto end = std::chrono::steady_clock::now();
+		us.push_back(std::chrono::duration<double, std::micro>(
+				     end - start).count());
+		if (i > 0)
+			continue;
+		std::sort(ids.begin(), ids.end());
+		found.clear();
+		std::set_intersection(ids.begin(), ids.end(),
+				      frame.ids.begin(), frame.ids.end(),
+				      std::back_inserter(found));
+		labelled += frame.ids.size();
+		matched += found.size();
+		false_ids += ids.size() - found.size();
+	}
+	Score result;
+	double sum = 0;
+	for (double u : us)
+		sum += u;
+	result.mean_us = us.empty() ? 0 : sum / us.size();
+	std::sort(us.begin(), us.end());
+	result.p99_us = us.empty() ? 0
+		: us[std::min(us.size() - 1, us.size() * 99 / 100)];
+	result.recall = labelled ? (double)matched / labelled : 1;
+	result.false_ids = false_ids;
+	return result;
+}
+
+static void
+print_row(int trial, const cv::aruco::DetectorParameters& p,
+	  const Score& s) {
+	std::cout << trial << ',' << p.adaptiveThreshWinSizeMin << ','
+		  << p.adaptiveThreshWinSizeMax << ','
+		  << p.adaptiveThreshWinSizeStep << ','
+		  << p.adaptiveThreshConstant << ','
+		  << p.minMarkerPerimeterRate << ','
+		  << p.maxMarkerPerimeterRate << ','
+		  << p.polygonalApproxAccuracyRate << ','
+		  << p.cornerRefinementMethod << ','
+		  << p.perspectiveRemovePixelPerCell << ','
+		  << p.useAruco3Detection << ','
+		  << p.minMarkerLengthRatioOriginalImg << ',' << s.mean_us
+		  << ',' << s.p99_us << ',' << s.recall << ',' << s.false_ids
+		  << std::endl;
+}
+
+static bool
+write_profile(const std::string& path,
+	      cv::aruco::DetectorParameters& params) {
+	cv::FileStorage fs(path, cv::FileStorage::WRITE);
+	if (!fs.isOpened() || !params.writeDetectorParameters(fs)) {
+		std::cerr << "Could not write " << path << std::endl;
+		return false;
+	}
+	fs.release();
+	return true;
+}
+
+static void
+usage(const char* argv0) {
+	std::cerr << "Usage: " << argv0
+		  << " [-n TRIALS] [-i ITERATIONS] [-r RECALL] [-s SEED]"
+		     " [-o PROFILE] LABELS" << std::endl;
+}
+
+int
+main(int argc, char* argv[]) {
+	int trials = 200;
+	int iterations = 3;
+	double target_recall = 0.99;
+	unsigned long seed = 24;
+	std::string profile_path = "detector.yaml";
+	int opt;
+	while ((opt = getopt(argc, argv, "n:i:r:s:o:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			trials = std::max(0, std::atoi(optarg));
+			break;
+		case 'i':
+			iterations = std::max(1, std::atoi(optarg));
+			break;
+		case 'r':
+			target_recall = std::atof(optarg);
+			break;
+		case 's':
+			seed = std::strtoul(optarg, nullptr, 10);
+			break;
+		case 'o':
+			profile_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	Logger::get_instance("/dev/null", Logger::LogLevel::WARN);
+	Vision::init_dictionary();
+	std::vector<LabelledFrame> frames;
+	if (!load_labels(argv[optind], frames))
+		return EXIT_FAILURE;
+	if (frames.empty()) {
+		std::cerr << "No frames in " << argv[optind] << std::endl;
+		return EXIT_FAILURE;
+	}
+	cv::RNG rng(seed);
+
+	std::cout << "trial,win_min,win_max,win_step,thresh_c,min_perimeter,"
+		"max_perimeter,approx,refine,px_per_cell,aruco3,"
+		"min_length_ratio,mean_us,p99_us,recall,false_ids"
+		  << std::endl;
+	cv::aruco::DetectorParameters params;
+	Score baseline = score(params, frames, iterations);
+	print_row(0, params, baseline);
+	cv::aruco::DetectorParameters best;
+	Score best_score = baseline;
+	bool have_best = baseline.recall >= target_recall;
+	for (int trial = 1; trial <= trials; trial++) {
+		params = random_params(rng);
+		Score s = score(params, frames, iterations);
+		print_row(trial, params, s);
+		if (s.recall < target_recall
+		    || s.false_ids > baseline.false_ids)
+			continue;
+		if (!have_best || s.mean_us < best_score.mean_us) {
+			best = params;
+			best_score = s;
+			have_best = true;
+		}
+	}
+
+	if (!have_best) {
+		std::cerr << "No profile reached a recall of " << target_recall
+			  << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (!write_profile(profile_path, best))
+		return EXIT_FAILURE;
+	std::cerr << "profile written to " << profile_path << ": "
+		  << best_score.mean_us << " us per frame (defaults "
+		  << baseline.mean_us << " us), recall " << best_score.recall
+		  << ", " << best_score.false_ids << " false ids" << std::endl;
+	return EXIT_SUCCESS;
+}
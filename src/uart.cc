@@ -19,26 +19,142 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
+#include <poll.h>
 #include <string>
 #include <termios.h>
 #include <unistd.h>
-#include <cstring>
-#include <iostream>
-#include <cstring>
+#include <vector>
 
+#include "config.hh"
 #include "logger.hh"
+#include "metrics.hh"
+#include "realtime.hh"
 #include "uart.hh"
 
 bool Uart::initialised = false;
 int Uart::file = -1;
+bool Uart::framed = false;
+TripleBuffer<Uart::Message> Uart::latest;
+std::thread Uart::writer;
+std::atomic<bool> Uart::stopping{false};
+unsigned long Uart::posted = 0;
+std::atomic<unsigned long> Uart::written{0};
 
-int
-Uart::init_uart(void) {
-	int fd = -1;
-#ifdef ENABLE_OUTPUT
-	fd = open(UART_PORT, O_RDWR | O_NOCTTY | O_NDELAY); // FIXME RdWr or Wonly
+static speed_t
+baud_to_speed(int baud) {
+	switch (baud) {
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	case 460800: return B460800;
+	case 921600: return B921600;
+	}
+	log_warn << "Unsupported UART baud rate " + std::to_string(baud)
+		+ ", using 9600";
+	return B9600;
+}
+
+static void
+put_u16(uint8_t* p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void
+put_u32(uint8_t* p, uint32_t v) {
+	for (int i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void
+put_f32(uint8_t* p, float v) {
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof bits);
+	put_u32(p, bits);
+}
+
+static uint32_t
+get_u32(const uint8_t* p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static float
+get_f32(const uint8_t* p) {
+	uint32_t bits = get_u32(p);
+	float v;
+	memcpy(&v, &bits, sizeof v);
+	return v;
+}
+
+static bool
+read_protocol(void) {
+	const std::string& protocol = Config::get_instance().uart_protocol;
+	if (protocol != "char" && protocol != "frame")
+		log_warn << "Unknown UART protocol " + protocol
+			+ ", using char";
+	return protocol == "frame";
+}
+
+uint16_t
+Uart::crc16(const uint8_t* data, size_t len) {
+	uint16_t crc = 0xffff;
+	while (len--) {
+		crc ^= (uint16_t)*data++ << 8;
+		for (int i = 0; i < 8; i++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+size_t
+Uart::encode(const Message& msg, uint8_t* buf) {
+	if (!framed) {
+		buf[0] = msg.output;
+		return 1;
+	}
+	uint32_t captured_us = msg.captured_ns / 1000;
+	buf[0] = UART_FRAME_SYNC0;
+	buf[1] = UART_FRAME_SYNC1;
+	buf[2] = UART_FRAME_PAYLOAD;
+	put_u32(buf + 3, msg.seq);
+	put_u32(buf + 7, captured_us);
+	put_f32(buf + 11, msg.gate_x);
+	put_f32(buf + 15, msg.gate_width);
+	buf[19] = msg.output;
+	buf[20] = msg.flags;
+	put_u16(buf + 21, crc16(buf + 2, 1 + UART_FRAME_PAYLOAD));
+	return UART_FRAME_SIZE;
+}
+
+bool
+Uart::decode(const uint8_t* buf, Message& msg) {
+	if (buf[0] != UART_FRAME_SYNC0 || buf[1] != UART_FRAME_SYNC1
+	    || buf[2] != UART_FRAME_PAYLOAD)
+		return false;
+	uint16_t crc = buf[21] | buf[22] << 8;
+	if (crc != crc16(buf + 2, 1 + UART_FRAME_PAYLOAD))
+		return false;
+	msg.seq = get_u32(buf + 3);
+	msg.captured_ns = (int64_t)get_u32(buf + 7) * 1000;
+	msg.gate_x = get_f32(buf + 11);
+	msg.gate_width = get_f32(buf + 15);
+	msg.output = buf[19];
+	msg.flags = buf[20];
+	return true;
+}
+
+static int
+open_port(const std::string& path) {
+	int fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_NDELAY); // FIXME RdWr or Wonly
 	if (fd < 0) {
 		log_crit << "Could not open UART, see below for errno";
 		log_crit << std::to_string(errno);
@@ -48,43 +164,238 @@ Uart::init_uart(void) {
 	struct termios options;
 	tcgetattr(fd, &options);
 	termios_setup(options); //macro
-	cfsetspeed(&options, B9600);
-	tcflush(uart_fd, TCIFLUSH);
+	cfsetspeed(&options, baud_to_speed(Config::get_instance().uart_baud));
+	tcflush(fd, TCIFLUSH);
 	if (tcsetattr(fd, TCSANOW, &options) != 0) {
 		log_crit << "Could not setup serial, see below for errno";
 		log_crit << std::to_string(errno);
 		log_warn << "Errno printed, Quitting now";
 		exit(EXIT_FAILURE);
 	}
+	return fd;
+}
+
+int
+Uart::init_uart(void) {
+	int fd = -1;
+	framed = read_protocol();
+#ifdef ENABLE_OUTPUT
+	fd = open_port(Config::get_instance().uart_port);
 #endif
 #ifdef OUTPUT_TO_STDOUT
 	fd = open("/dev/stdout", O_WRONLY);
 #endif
 	file = fd;
 	initialised = true;
+	if (fd >= 0)
+		start_writer();
 	log_info << "output init done";
 	return fd;
 }
 
+int
+Uart::init_port(const std::string& path) {
+	framed = read_protocol();
+	file = open_port(path);
+	initialised = true;
+	start_writer();
+	log_info << "output to " + path;
+	return file;
+}
+
+int
+Uart::init_file(const std::string& path) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_crit << "Could not open output file " + path
+			+ ", see below for errno";
+		log_crit << std::to_string(errno);
+		log_warn << "Errno printed, Quitting now";
+		exit(EXIT_FAILURE);
+	}
+	framed = read_protocol();
+	file = fd;
+	initialised = true;
+	log_info << "output to " + path;
+	return fd;
+}
+
+bool
+Uart::write_all(const uint8_t* buf, size_t len) {
+	auto deadline = std::chrono::steady_clock::now()
+		+ std::chrono::milliseconds(UART_WRITE_TIMEOUT_MS);
+	while (len) {
+		ssize_t n = write(file, buf, len);
+		if (n > 0) {
+			buf += n;
+			len -= n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno != EAGAIN)
+			return false;
+		// the port is full, wait until it drains
+		auto left = std::chrono::duration_cast<
+			std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now());
+		if (left.count() <= 0) {
+			errno = ETIMEDOUT;
+			return false;
+		}
+		struct pollfd pfd = {file, POLLOUT, 0};
+		poll(&pfd, 1, left.count());
+	}
+	return true;
+}
+
 void
-Uart::send(char msg) {
-	// TODO
-#ifdef ENABLE_OUTPUT
+Uart::start_writer(void) {
+	if (writer.joinable())
+		return;
+	stopping = false;
+	writer = std::thread(writer_loop);
+	static bool registered = false;
+	if (!registered)
+		std::atexit(stop_writer);
+	registered = true;
+}
+
+void
+Uart::stop_writer(void) {
+	if (!writer.joinable())
+		return;
+	stopping.store(true, std::memory_order_release);
+	writer.join();
+	log_info << "UART: " + std::to_string(posted) + " messages posted, "
+		+ std::to_string(written) + " written, "
+		+ std::to_string(posted - written) + " superseded";
+}
+
+void
+Uart::writer_loop(void) {
+	uint8_t buf[UART_FRAME_SIZE];
+	unsigned spins = 0;
+	Realtime::enter(Realtime::ROLE_OUTPUT);
+	for (;;) {
+		// read before checking `stopping`, so the last message
+		// posted before the stop is still written
+		bool stop = stopping.load(std::memory_order_acquire);
+		Message* msg = latest.read_latest();
+		if (!msg) {
+			if (stop)
+				return;
+			ring_wait(spins);
+			continue;
+		}
+		spins = 0;
+		Metrics::Timer timer(Metrics::STAGE_UART_SEND);
+		if (write_all(buf, encode(*msg, buf)))
+			written.fetch_add(1, std::memory_order_relaxed);
+		else
+			log_error << "Output write error: "
+				+ std::string(strerror(errno));
+	}
+}
+
+void
+Uart::post(const Message& msg) {
 	if (!initialised) {
 		log_crit << "Output before initialised, quitting";
 		exit(EXIT_FAILURE);
 	}
-#endif
-#if defined(ENABLE_OUTPUT) || defined(OUTPUT_TO_STDOUT)
-	if (file == -1) {
-		log_crit << "Output file is -1";
+	if (file == -1)
+		return;
+	posted++;
+	if (!writer.joinable()) {
+		uint8_t buf[UART_FRAME_SIZE];
+		Metrics::Timer timer(Metrics::STAGE_UART_SEND);
+		if (write_all(buf, encode(msg, buf)))
+			written++;
+		else
+			log_error << "Output write error: "
+				+ std::string(strerror(errno));
+		return;
 	}
-	char to_write[1] = {msg};
-	if (write(file, to_write, sizeof(to_write)) == -1) {
-		log_crit << "Output written size is -1, write error:";
-		log_crit << std::to_string(errno);
-		log_warn << "Errno printed";
+	latest.write_slot() = msg;
+	if (latest.publish())
+		Metrics::count(Metrics::UART_SUPERSEDED);
+}
+
+void
+Uart::send(char msg) {
+	post({0, 0, -1, -1, msg, 0});
+}
+
+bool
+Uart::loopback_test(unsigned long count) {
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+		log_error << "Could not open a pseudo terminal: "
+			+ std::string(strerror(errno));
+		return false;
 	}
-#endif
-	return;
+	init_port(ptsname(master));
+	framed = true;
+
+	std::vector<uint8_t> stream;
+	unsigned long received = 0, corrupt = 0, reordered = 0;
+	uint32_t last_seq = 0;
+	bool fields_ok = true;
+	std::thread reader([&] {
+		auto deadline = std::chrono::steady_clock::now()
+			+ std::chrono::seconds(5);
+		uint8_t chunk[256];
+		size_t pos = 0;
+		while (last_seq != count
+		       && std::chrono::steady_clock::now() < deadline) {
+			struct pollfd pfd = {master, POLLIN, 0};
+			if (poll(&pfd, 1, 100) <= 0)
+				continue;
+			ssize_t n = read(master, chunk, sizeof chunk);
+			if (n <= 0)
+				continue;
+			stream.insert(stream.end(), chunk, chunk + n);
+			while (stream.size() - pos >= UART_FRAME_SIZE) {
+				Message msg;
+				if (!decode(&stream[pos], msg)) {
+					corrupt++;
+					pos++;
+					continue;
+				}
+				pos += UART_FRAME_SIZE;
+				received++;
+				if (msg.seq <= last_seq)
+					reordered++;
+				last_seq = msg.seq;
+				if (msg.gate_x != msg.seq * 0.25f
+				    || msg.gate_width != msg.seq * 0.5f
+				    || msg.output != (char)('A' + msg.seq % 26))
+					fields_ok = false;
+			}
+		}
+	});
+
+	for (uint32_t seq = 1; seq <= count; seq++) {
+		auto now = std::chrono::steady_clock::now();
+		post({seq, std::chrono::duration_cast<
+				std::chrono::nanoseconds>(
+					now.time_since_epoch()).count(),
+		      seq * 0.25f, seq * 0.5f, (char)('A' + seq % 26),
+		      UART_FLAG_GATE});
+	}
+	reader.join();
+	stop_writer();
+	close(file);
+	close(master);
+	file = -1;
+
+	bool ok = received && !corrupt && !reordered && fields_ok
+		&& last_seq == count;
+	log_info << "UART loopback: " + std::to_string(count) + " posted, "
+		+ std::to_string(received) + " received, "
+		+ std::to_string(corrupt) + " corrupt bytes, "
+		+ std::to_string(reordered) + " out of order, "
+		+ (ok ? "OK" : "FAILED");
+	return ok;
 }
@@ -22,11 +22,54 @@
 #ifndef UART_HH
 #define UART_HH
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <thread>
+
+#include "ring.hh"
 
 #ifndef UART_PORT
 # define UART_PORT "/dev/serial0"
 #endif
+// one of the standard termios rates, 9600 to 921600
+#ifndef UART_BAUD
+# define UART_BAUD 9600
+#endif
+// "char" sends the output char alone, "frame" the framed message below
+#ifndef UART_PROTOCOL
+# define UART_PROTOCOL "char"
+#endif
+// give up on a message the port has not taken for this long
+#ifndef UART_WRITE_TIMEOUT_MS
+# define UART_WRITE_TIMEOUT_MS 100
+#endif
+
+/*
+ * The framed protocol. Every message is
+ *
+ *   0xa5 0x5a                sync
+ *   len       u8             payload length, UART_FRAME_PAYLOAD
+ *   seq       u32            frame sequence number
+ *   captured  u32            capture time, microseconds, steady clock
+ *   gate_x    f32            gate centre, pixels
+ *   gate_w    f32            gate width, pixels
+ *   output    u8             the char of the "char" protocol
+ *   flags     u8             UART_FLAG_*
+ *   crc       u16            CRC-16/CCITT-FALSE of len and payload
+ *
+ * all little endian. gate_x and gate_w are -1 without a gate, and predicted to
+ * the send time when the gate tracker is on. A receiver that loses sync skips
+ * to the next 0xa5 0x5a whose CRC matches.
+ */
+#define UART_FRAME_SYNC0 0xa5
+#define UART_FRAME_SYNC1 0x5a
+#define UART_FRAME_PAYLOAD 18
+#define UART_FRAME_SIZE (3 + UART_FRAME_PAYLOAD + 2)
+#define UART_FLAG_GATE 0x01 ///< a gate pair was found
+#define UART_FLAG_FALLBACK 0x02 ///< the pairing algorithm fell back
+#define UART_FLAG_BRIDGED 0x04 ///< no gate seen, gate_x is predicted
 
 //#define ENABLE_OUTPUT
 #define OUTPUT_TO_STDOUT
@@ -67,21 +110,102 @@
 #endif
 
 class Uart {
+public:
+	/**
+	 * One decision, as sent over the wire.
+	 */
+	struct Message {
+		uint32_t seq;
+		int64_t captured_ns; ///< steady clock
+		float gate_x, gate_width; ///< -1 without a gate
+		char output;
+		uint8_t flags; ///< UART_FLAG_*
+	};
 private:
 	static bool initialised;
 	static int file;
+	static bool framed;
+
+	/*
+	 * The output engine: the decider publishes into `latest` and the
+	 * writer thread sends whatever is newest when the port is ready, so
+	 * a slow port drops stale decisions instead of delaying new ones.
+	 */
+	static TripleBuffer<Message> latest;
+	static std::thread writer;
+	static std::atomic<bool> stopping;
+	static unsigned long posted; ///< decider only
+	static std::atomic<unsigned long> written;
+
+	static void start_writer(void);
+	static void stop_writer(void);
+	static void writer_loop(void);
+	static bool write_all(const uint8_t* buf, size_t len);
 public:
 	/**
-	 * Initialise UART.
+	 * Initialise UART, or stdout with `OUTPUT_TO_STDOUT`, and start the
+	 * output engine.
 	 * @returns file descriptor
 	 */
 	static int init_uart(void);
 
 	/**
-	 * Send a char.
+	 * Open and set up a serial port at the configured baud rate, and
+	 * start the output engine on it.
+	 * @param path  the port, e.g. `UART_PORT` or a pty
+	 * @returns file descriptor
+	 */
+	static int init_port(const std::string& path);
+
+	/**
+	 * Send the output to a file instead, e.g. to record a replay. Files
+	 * are written synchronously, so every decision is kept.
+	 * @param path  the file, truncated if it exists
+	 * @returns file descriptor
+	 */
+	static int init_file(const std::string& path);
+
+	/**
+	 * Send a decision. Never blocks on the port: a message not yet
+	 * written when the next one is posted is dropped. Call from one
+	 * thread only.
+	 * @param msg  the decision
+	 */
+	static void post(const Message& msg);
+
+	/**
+	 * Send a char, without the rest of a decision.
 	 * @param msg  char to be sent
 	 */
 	static void send(char msg);
+
+	/**
+	 * Encode a message in the configured protocol.
+	 * @param buf  at least `UART_FRAME_SIZE` bytes
+	 * @returns the number of bytes used
+	 */
+	static size_t encode(const Message& msg, uint8_t* buf);
+
+	/**
+	 * Decode a framed message.
+	 * @param buf  `UART_FRAME_SIZE` bytes starting at the sync bytes
+	 * @returns false if the sync bytes, length or CRC are wrong
+	 */
+	static bool decode(const uint8_t* buf, Message& msg);
+
+	/**
+	 * Check the output engine end to end: post `count` messages as fast
+	 * as possible into one end of a pseudo terminal at the configured
+	 * baud rate, and decode what comes out of the other end.
+	 * @returns true if every frame received was intact and in order and
+	 *          the last message posted was received
+	 */
+	static bool loopback_test(unsigned long count);
+
+	/**
+	 * CRC-16/CCITT-FALSE, polynomial 0x1021, initial value 0xffff.
+	 */
+	static uint16_t crc16(const uint8_t* data, size_t len);
 };
 
 typedef Uart uart;
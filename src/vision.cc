@@ -19,22 +19,36 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cctype>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <opencv2/opencv.hpp>
 #include <opencv2/aruco.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/objdetect/aruco_dictionary.hpp>
-#include <sched.h>
 #include <string>
 #include <vector>
 #include <chrono>
 #include <thread>
+#include <functional>
 
 #include "opencv2/videoio.hpp"
 #include "vision.hh"
+#include "config.hh"
+#include "dictcache.hh"
+#include "alloccheck.hh"
+#include "blackbox.hh"
+#include "fastdecode.hh"
+#ifdef HAVE_GSTAPP
+# include "gstsource.hh"
+#endif
 #include "logger.hh"
+#include "metrics.hh"
+#include "realtime.hh"
+#include "telemetry.hh"
 #include "uart.hh"
 
 std::string Vision::gst_pipeline = GSTREAMER_PIPELINE;
@@ -43,23 +57,35 @@ unsigned long Vision::gate_passed = 0;
 double Vision::last_left_marker_area = -1.0;
 double Vision::last_right_marker_area = -1.0;
 double Vision::last_gate_width = -1.0;
+double Vision::last_gate_distance = -1.0;
+unsigned long Vision::tracked_gate_passed = 0;
+std::atomic<int64_t> Vision::marker_seen_ns(0);
 
 cv::Ptr<cv::aruco::Dictionary> Vision::dictionary;
+cv::aruco::DetectorParameters Vision::detector_params;
+Vision::Detector Vision::detector = Vision::Detector::OPENCV;
+Vision::Stats Vision::stats;
+Vision::DecideFn Vision::decide_fn = nullptr;
+const char* Vision::pairing_name = "";
+const char* Vision::pass_name = "";
+bool Vision::collect_frame_age = false;
+bool Vision::govern_idle = false;
+bool Vision::keep_deadline = false;
 
 void
 Vision::Marker::set_marker(void) {
 	centre.x = (corner0.x + corner1.x + corner2.x + corner3.x) / 4.0;
 	centre.y = (corner0.y + corner1.y + corner2.y + corner3.y) / 4.0;
-	std::vector<cv::Point2f> contour;
-	contour.push_back(corner0);
-	contour.push_back(corner1);
-	contour.push_back(corner2);
-	contour.push_back(corner3);
-	area = cv::contourArea(contour);
+	// the shoelace formula, what cv::contourArea computes for a quad
+	area = std::abs((corner0.x * corner1.y - corner1.x * corner0.y)
+			+ (corner1.x * corner2.y - corner2.x * corner1.y)
+			+ (corner2.x * corner3.y - corner3.x * corner2.y)
+			+ (corner3.x * corner0.y - corner0.x * corner3.y))
+		/ 2.0;
 }
 
 void
-Vision::init_dictionary(void) {
+Vision::init_builtin_dictionary(void) {
 	int markerSize = 4;
 	int nMarkers = 2;
 	cv::Mat bytesList(nMarkers, markerSize * markerSize, CV_8UC1);
@@ -79,13 +105,158 @@ Vision::init_dictionary(void) {
 			   1, 0, 0, 0,
 			   1, 1, 1, 1
 		);
+	cv::Mat marker2 = (cv::Mat_<uchar>(4, 4) <<
+			   0, 0, 1, 0,
+			   0, 0, 0, 0,
+			   0, 0, 1, 1,
+			   1, 1, 1, 1
+		);
+	cv::Mat marker3 = (cv::Mat_<uchar>(4, 4) <<
+			   0, 0, 0, 1,
+			   0, 0, 1, 0,
+			   1, 0, 0, 1,
+			   0, 1, 1, 0
+		);
 	dictionary->bytesList.push_back(
 		cv::aruco::Dictionary::getByteListFromBits(marker0));
 	dictionary->bytesList.push_back(
 		cv::aruco::Dictionary::getByteListFromBits(marker1));
+	dictionary->bytesList.push_back(
+		cv::aruco::Dictionary::getByteListFromBits(marker2));
+	dictionary->bytesList.push_back(
+		cv::aruco::Dictionary::getByteListFromBits(marker3));
 
 }
 
+bool
+Vision::validate_dictionary(const cv::aruco::Dictionary& dict) {
+	int n_markers = dict.bytesList.rows;
+	int needed = std::max({GATE_MARKER_LEFT, GATE_MARKER_RIGHT,
+			       START_MARKER_ID, GOAL_MARKER_ID}) + 1;
+	if (dict.markerSize <= 0 || dict.maxCorrectionBits < 0) {
+		log_error << "Dictionary has no valid markersize or "
+			"maxCorrectionBits";
+		return false;
+	}
+	if (n_markers < needed) {
+		log_error << "Dictionary has " + std::to_string(n_markers)
+			+ " markers, marvision uses ids up to "
+			+ std::to_string(needed - 1);
+		return false;
+	}
+
+	std::vector<cv::Mat> bits(n_markers);
+	for (int i = 0; i < n_markers; i++)
+		bits[i] = cv::aruco::Dictionary::getBitsFromByteList(
+			dict.bytesList.rowRange(i, i + 1), dict.markerSize);
+	int min_distance = dict.markerSize * dict.markerSize;
+	cv::Mat rotated;
+	for (int i = 0; i < n_markers; i++) {
+		// a marker that looks the same turned has no orientation
+		for (int turn : {cv::ROTATE_90_CLOCKWISE, cv::ROTATE_180,
+				 cv::ROTATE_90_COUNTERCLOCKWISE}) {
+			cv::rotate(bits[i], rotated, turn);
+			if (dict.getDistanceToId(rotated, i, false) == 0) {
+				log_error << "Dictionary marker "
+					+ std::to_string(i)
+					+ " is rotationally symmetric";
+				return false;
+			}
+		}
+		for (int j = i + 1; j < n_markers; j++)
+			min_distance = std::min(
+				min_distance, dict.getDistanceToId(bits[i], j));
+	}
+	if (min_distance == 0) {
+		log_error << "Dictionary has duplicate markers";
+		return false;
+	}
+	if (2 * dict.maxCorrectionBits >= min_distance)
+		log_warn << "Dictionary minimum distance "
+			+ std::to_string(min_distance)
+			+ " is too small for maxCorrectionBits="
+			+ std::to_string(dict.maxCorrectionBits);
+	return true;
+}
+
+bool
+Vision::load_dictionary(const std::string& path) {
+	cv::FileStorage fs;
+	try {
+		fs.open(path, cv::FileStorage::READ);
+	} catch (const cv::Exception& e) {
+		log_error << "Could not parse dictionary " + path + ": "
+			+ e.what();
+		return false;
+	}
+	if (!fs.isOpened()) {
+		log_error << "Could not open dictionary " + path;
+		return false;
+	}
+	cv::Ptr<cv::aruco::Dictionary> loaded =
+		cv::makePtr<cv::aruco::Dictionary>();
+	if (!loaded->readDictionary(fs.root())
+	    || !validate_dictionary(*loaded)) {
+		log_error << "Invalid dictionary " + path;
+		return false;
+	}
+	dictionary = loaded;
+	log_info << "dictionary loaded from " + path;
+	return true;
+}
+
+void
+Vision::init_dictionary(void) {
+	const uint8_t* table = nullptr;
+	if (DictionaryCache::load(DICTIONARY_CACHE_PATH, DICTIONARY_PATH,
+				  dictionary, table)) {
+		if (table)
+			FastDecoder::use_table(table);
+		log_info << "dictionary mapped from " DICTIONARY_CACHE_PATH;
+		return;
+	}
+	if (!load_dictionary(DICTIONARY_PATH)) {
+		log_warn << "Using the built-in dictionary";
+		init_builtin_dictionary();
+		return;
+	}
+	// the table is cheap enough to always build, so the cache is
+	// complete whichever detector is configured later
+	bool have_table = FastDecoder::init(*dictionary);
+	DictionaryCache::store(DICTIONARY_CACHE_PATH, DICTIONARY_PATH,
+			       *dictionary, have_table
+			       ? FastDecoder::get_table() : nullptr);
+}
+
+bool
+Vision::load_detector_profile(const std::string& path) {
+	cv::FileStorage fs;
+	try {
+		fs.open(path, cv::FileStorage::READ);
+	} catch (const cv::Exception& e) {
+		log_error << "Could not parse detector profile " + path + ": "
+			+ e.what();
+		return false;
+	}
+	if (!fs.isOpened())
+		return false;
+	cv::aruco::DetectorParameters params;
+	if (!params.readDetectorParameters(fs.root())) {
+		log_error << "Invalid detector profile " + path;
+		return false;
+	}
+	detector_params = params;
+	log_info << "detector profile loaded from " + path;
+	return true;
+}
+
+const cv::aruco::ArucoDetector&
+Vision::aruco_detector(void) {
+	thread_local cv::aruco::ArucoDetector aruco(*dictionary,
+						    detector_params);
+	return aruco;
+}
+
 void
 Vision::draw_marker(int marker_id) {
 	cv::Mat markerImage;
@@ -96,189 +267,1204 @@ Vision::draw_marker(int marker_id) {
 	cv::imwrite(MARKER_IMG_PATH, markerImage);
 }
 
-void
-Vision::vision_main_loop(void) {
-	cv::VideoCapture cap(gst_pipeline, cv::CAP_GSTREAMER);
-	cv::Mat frame;
+/**
+ * Nanoseconds of the steady clock at `t`.
+ */
+static int64_t
+steady_ns(std::chrono::steady_clock::time_point t) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		t.time_since_epoch()).count();
+}
 
+void
+Vision::capture_stage(FrameSource& source, FrameRing* to_detect) {
+	const Config& config = Config::get_instance();
+	// the worker's frame stays in its ring until it is detected
+	size_t max_queued = config.fresh_frames ? 0 : PIPELINE_RING_SIZE;
+	auto idle_after = std::chrono::duration_cast<
+		std::chrono::steady_clock::duration>(
+			std::chrono::duration<double, std::milli>(
+				config.idle_after_ms));
+	auto idle_period = std::chrono::duration_cast<
+		std::chrono::steady_clock::duration>(
+			std::chrono::duration<double, std::milli>(
+				config.idle_sample_ms));
+	auto last_read = std::chrono::steady_clock::now();
+	marker_seen_ns.store(steady_ns(last_read));
+	bool idle = false;
+	Realtime::enter(Realtime::ROLE_CAPTURE);
+	unsigned long seq = 0;
 	for (;;) {
-		cap.read(frame);
-		if (frame.empty()) {
+		unsigned long allocs = AllocCheck::count();
+		FrameRing& ring = to_detect[seq % DETECT_WORKERS];
+		Frame* slot;
+		unsigned spins = 0;
+		while (ring.size() > max_queued || !(slot = ring.back()))
+			ring_wait(spins);
+		if (govern_idle) {
+			if (idle) {
+				// the camera keeps only its newest frame
+				// meanwhile
+				std::this_thread::sleep_until(last_read
+							      + idle_period);
+				// the last scan may have found a marker
+				FrameRing& last = to_detect[
+					(seq + DETECT_WORKERS - 1)
+					% DETECT_WORKERS];
+				while (last.size())
+					ring_wait(spins);
+			}
+			auto seen = std::chrono::steady_clock::time_point(
+				std::chrono::nanoseconds(marker_seen_ns.load(
+					std::memory_order_relaxed)));
+			bool was_idle = idle;
+			idle = std::chrono::steady_clock::now() - seen
+				> idle_after;
+			if (idle != was_idle) {
+				AllocCheck::Pause pause;
+				if (idle)
+					log_info << "No markers for "
+						+ std::to_string(
+							config.idle_after_ms)
+						+ " ms, scanning every "
+						+ std::to_string(
+							config.idle_sample_ms)
+						+ " ms";
+				else
+					log_info << "Markers seen, back to the "
+						"full frame rate";
+			}
+		}
+		last_read = std::chrono::steady_clock::now();
+		{
+			AllocCheck::Pause pause;
+			Metrics::Timer timer(Metrics::STAGE_CAPTURE);
+			if (!source.acquire(slot->image, slot->lease))
+				break;
+		}
+		if (slot->image.empty()) {
 			log_error << "Empty frame captured!";
 			continue;
 		}
-		std::vector<std::vector<cv::Point2f> > corners;
-		std::vector<int> ids;
-		cv::aruco::detectMarkers(frame, dictionary, corners, ids);
-		std::vector<Marker> markers;
-		if (corners.size()) {
-
-			for (size_t i = 0; i < corners.size(); i++) {
-				/*std::cout << "i=" << i << " id=" << ids[i]
-					  << " corners0=" << corners[i][0]
-					  << " corners1=" << corners[i][1]
-					  << " corners2=" << corners[i][2]
-					  << " corners3=" << corners[i][3]
-					  << std::endl;*/
-				Marker this_marker;
-				this_marker.id = ids[i];
-				this_marker.corner0 = corners[i][0];
-				this_marker.corner1 = corners[i][1];
-				this_marker.corner2 = corners[i][2];
-				this_marker.corner3 = corners[i][3];
-				this_marker.set_marker();
-				markers.push_back(this_marker); // FIXME abi change
+		slot->eos = false;
+		slot->idle = idle;
+		slot->seq = seq++;
+		slot->captured = std::chrono::steady_clock::now()
+			- source.frame_age();
+		std::chrono::steady_clock::duration recorded;
+		slot->recorded = source.recorded_time(recorded);
+		slot->stamp = slot->recorded
+			? std::chrono::steady_clock::time_point(recorded)
+			: slot->captured;
+		ring.push();
+		AllocCheck::check("capture", seq, allocs);
+	}
+	log_info << "End of frame source after " + std::to_string(seq)
+		+ " frames";
+	for (int w = 0; w < DETECT_WORKERS; w++, seq++) {
+		FrameRing& ring = to_detect[seq % DETECT_WORKERS];
+		Frame* slot;
+		unsigned spins = 0;
+		while (!(slot = ring.back()))
+			ring_wait(spins);
+		slot->eos = true;
+		slot->seq = seq;
+		slot->lease = nullptr;
+		ring.push();
+	}
+}
+
+void
+Vision::detect_markers(const cv::Mat& image,
+		       std::vector<std::vector<cv::Point2f> >& corners,
+		       std::vector<int>& ids) {
+	// OpenCV's detector is not ours to make allocation free; the fast
+	// detector is checked, but for the scratch of the OpenCV calls in it
+	if (detector == Detector::OPENCV) {
+		AllocCheck::Pause pause;
+		aruco_detector().detectMarkers(image, corners, ids);
+		return;
+	}
+	if (detector == Detector::FAST) {
+		FastDecoder::detect_markers(image, corners, ids);
+		return;
+	}
+
+	/* Compare both detectors on the same image, per worker */
+
+	thread_local std::vector<std::vector<cv::Point2f> > fast_corners;
+	thread_local std::vector<int> fast_ids, sorted_ids;
+	thread_local double opencv_secs = 0, fast_secs = 0;
+	thread_local unsigned long frames = 0, mismatches = 0;
+	auto start = std::chrono::steady_clock::now();
+	{
+		AllocCheck::Pause pause;
+		aruco_detector().detectMarkers(image, corners, ids);
+	}
+	auto mid = std::chrono::steady_clock::now();
+	FastDecoder::detect_markers(image, fast_corners, fast_ids);
+	auto end = std::chrono::steady_clock::now();
+	opencv_secs += std::chrono::duration<double>(mid - start).count();
+	fast_secs += std::chrono::duration<double>(end - mid).count();
+	sorted_ids = ids;
+	std::sort(sorted_ids.begin(), sorted_ids.end());
+	std::sort(fast_ids.begin(), fast_ids.end());
+	if (sorted_ids != fast_ids) {
+		mismatches++;
+		log_debug << "Detectors disagree: opencv found "
+			+ std::to_string(ids.size()) + ", fast found "
+			+ std::to_string(fast_ids.size());
+	}
+	if (++frames % QUEUE_REPORT_FRAMES)
+		return;
+	log_info << "Detector comparison over "
+		+ std::to_string(frames) + " frames: opencv "
+		+ std::to_string(opencv_secs * 1000 / frames) + " ms, fast "
+		+ std::to_string(fast_secs * 1000 / frames) + " ms, "
+		+ std::to_string(mismatches) + " frames differ";
+}
+
+/**
+ * Append what the detector found in `track`'s scratch buffers to a detection,
+ * scaled by `scale` and moved by `offset`, without allocating.
+ */
+static void
+append_markers(const Vision::Track& track, cv::Point2f scale,
+	       cv::Point2f offset, Vision::Detection& detection) {
+	for (size_t i = 0; i < track.roi_ids.size(); i++) {
+		const std::vector<cv::Point2f>& found = track.roi_corners[i];
+		Vision::Quad quad;
+		// pixel centres: pixel i of a 1/n image covers n*i..n*i+n-1
+		for (int k = 0; k < 4; k++)
+			quad[k] = cv::Point2f(
+				(found[k].x + 0.5f) * scale.x - 0.5f,
+				(found[k].y + 0.5f) * scale.y - 0.5f)
+				+ offset;
+		detection.corners.push_back(quad);
+		detection.ids.push_back(track.roi_ids[i]);
+	}
+}
+
+void
+Vision::detect_scaled(const cv::Mat& image, int level, Track& track,
+		      cv::Point2f offset, Detection& detection) {
+	int width = image.cols >> level, height = image.rows >> level;
+	if (!level || width < ADAPTIVE_MIN_IMAGE_PX
+	    || height < ADAPTIVE_MIN_IMAGE_PX) {
+		detect_markers(image, track.roi_corners, track.roi_ids);
+		append_markers(track, cv::Point2f(1, 1), offset, detection);
+		return;
+	}
+	// a view into the buffer sized for the whole frame, so resizing
+	// into it never reallocates
+	cv::Mat scaled = track.scaled(cv::Rect(0, 0, width, height));
+	{
+		// the scratch of the resize, not its output
+		AllocCheck::Pause pause;
+		cv::resize(image, scaled, scaled.size(), 0, 0, cv::INTER_AREA);
+	}
+	detect_markers(scaled, track.roi_corners, track.roi_ids);
+	append_markers(track, cv::Point2f((float)image.cols / width,
+					  (float)image.rows / height),
+		       offset, detection);
+}
+
+/**
+ * The pyramid level to detect the next frame at: the coarsest one at which
+ * the smallest marker found this time would still cover
+ * `adaptive_min_marker_area`.
+ */
+static int
+next_level(const Config& config, const Vision::Detection& detection,
+	   MarkerBatch& batch) {
+	if (!config.adaptive_resolution || detection.corners.empty())
+		return 0;
+	batch.assign(&detection.corners[0][0].x, nullptr,
+		     detection.corners.size());
+	double min_area = batch.min_area();
+	int level = 0;
+	// each level has a quarter of the pixels of the one above
+	while (level < config.adaptive_max_level
+	       && min_area / (1 << 2 * (level + 1))
+	       >= config.adaptive_min_marker_area)
+		level++;
+	return level;
+}
+
+void
+Vision::detect(const cv::Mat& image, Track& track, Detection& detection,
+	       bool downgrade) {
+	const Config& config = Config::get_instance();
+	std::vector<Quad>& corners = detection.corners;
+	std::vector<int>& ids = detection.ids;
+	corners.clear();
+	ids.clear();
+
+	// still step up to full resolution now and then, for markers too
+	// far away to be seen at a lower level
+	int level = track.level;
+	if (track.level_frames >= config.adaptive_full_res_frames)
+		level = 0;
+	bool full_scan = !config.tracking || track.rois.empty()
+		|| (!downgrade
+		    && track.roi_frames >= config.tracking_full_scan_frames);
+	if (downgrade && full_scan)
+		level = std::max(level, 1);
+	if (level && (track.scaled.cols < (image.cols + 1) / 2
+		      || track.scaled.rows < (image.rows + 1) / 2
+		      || track.scaled.type() != image.type()))
+		track.scaled.create((image.rows + 1) / 2,
+				    (image.cols + 1) / 2, image.type());
+
+	if (!full_scan) {
+		for (const cv::Rect& roi : track.rois)
+			detect_scaled(image(roi), level, track,
+				      cv::Point2f(roi.x, roi.y), detection);
+		// a tracked marker is lost, look for it in the whole frame
+		if (ids.size() < track.n_tracked && !downgrade) {
+			full_scan = true;
+			level = 0;
+		}
+	}
+	if (full_scan) {
+		corners.clear();
+		ids.clear();
+		detect_scaled(image, level, track, cv::Point2f(0, 0),
+			      detection);
+		// a marker may be too small for the level now, look again
+		// at full resolution
+		if (level && ids.size() < track.n_tracked && !downgrade) {
+			corners.clear();
+			ids.clear();
+			detect_scaled(image, 0, track, cv::Point2f(0, 0),
+				      detection);
+			level = 0;
+		}
+		track.roi_frames = 0;
+	} else {
+		track.roi_frames++;
+	}
+	track.level_frames = level ? track.level_frames + 1 : 0;
+	track.level = next_level(config, detection, track.batch);
+	// a marker lost while downgraded is searched for next time
+	if (!downgrade || ids.size() > track.n_tracked)
+		track.n_tracked = ids.size();
+	if (!config.tracking)
+		return;
+
+	/* Pad the markers into ROIs and merge those that overlap, so no
+	 * marker is detected twice */
+
+	cv::Rect bounds(0, 0, image.cols, image.rows);
+	track.rois.clear();
+	for (const Quad& quad : corners) {
+		float x0 = quad[0].x, x1 = quad[0].x;
+		float y0 = quad[0].y, y1 = quad[0].y;
+		for (int k = 1; k < 4; k++) {
+			x0 = std::min(x0, quad[k].x);
+			x1 = std::max(x1, quad[k].x);
+			y0 = std::min(y0, quad[k].y);
+			y1 = std::max(y1, quad[k].y);
+		}
+		// as cv::boundingRect rounds a float contour
+		cv::Rect box(cvFloor(x0), cvFloor(y0),
+			     cvFloor(x1) - cvFloor(x0) + 1,
+			     cvFloor(y1) - cvFloor(y0) + 1);
+		int pad = std::max(box.width, box.height)
+			* config.tracking_roi_padding + TRACKING_ROI_MIN_PAD;
+		box.x -= pad;
+		box.y -= pad;
+		box.width += 2 * pad;
+		box.height += 2 * pad;
+		box &= bounds;
+		for (size_t i = 0; i < track.rois.size();) {
+			if ((box & track.rois[i]).area() > 0) {
+				box |= track.rois[i];
+				track.rois.erase(track.rois.begin() + i);
+				i = 0;
+			} else {
+				i++;
+			}
+		}
+		track.rois.push_back(box);
+	}
+}
+
+void
+Vision::detect_stage(int worker, FrameSource& source, FrameRing& from_capture,
+		     DetectionRing& to_decide) {
+	const Config& config = Config::get_instance();
+	Realtime::enter(Realtime::ROLE_DETECT, worker);
+	Track track;
+	for (;;) {
+		unsigned long allocs = AllocCheck::count();
+		Frame* frame;
+		Detection* detection;
+		unsigned spins = 0;
+		while (!(frame = from_capture.front()))
+			ring_wait(spins);
+		spins = 0;
+		while (!(detection = to_decide.back()))
+			ring_wait(spins);
+		detection->eos = frame->eos;
+		detection->seq = frame->seq;
+		detection->captured = frame->captured;
+		detection->stamp = frame->stamp;
+		detection->recorded = frame->recorded;
+		detection->skipped = false;
+		detection->downgraded = false;
+		detection->idle = !frame->eos && frame->idle;
+		// corners and ids keep their capacity from the last frame
+		// that went through this slot
+		if (!frame->eos) {
+			auto start = std::chrono::steady_clock::now();
+			double age_ms = std::chrono::duration<
+				double, std::milli>(
+					start - frame->captured).count();
+			double deadline_ms = keep_deadline
+				? config.frame_deadline_ms : 0;
+			// a downgraded frame does not measure the full cost,
+			// so now and then measure it again
+			bool remeasure = track.downgraded_frames
+				>= config.tracking_full_scan_frames;
+			if (deadline_ms > 0 && age_ms >= deadline_ms) {
+				// whatever is found, the decision would be late
+				detection->skipped = true;
+				detection->corners.clear();
+				detection->ids.clear();
+			} else {
+				detection->downgraded = deadline_ms > 0
+					&& !remeasure
+					&& age_ms + track.detect_ms
+					> deadline_ms;
+				track.downgraded_frames =
+					detection->downgraded
+					? track.downgraded_frames + 1 : 0;
+				Metrics::Timer timer(Metrics::STAGE_DETECT);
+				// an idle scan is a single half resolution
+				// scan, as a downgraded one
+				detect(frame->image, track, *detection,
+				       detection->downgraded
+				       || detection->idle);
+			}
+			BlackBox::record(frame->seq, frame->captured,
+					 frame->image, detection->corners,
+					 detection->ids);
+			if (!detection->ids.empty())
+				marker_seen_ns.store(
+					steady_ns(start),
+					std::memory_order_relaxed);
+			if (!detection->skipped && !detection->downgraded
+			    && !detection->idle) {
+				double ms = std::chrono::duration<
+					double, std::milli>(
+						std::chrono::steady_clock::now()
+						- start).count();
+				track.detect_ms = track.detect_ms > 0
+					&& !remeasure
+					? track.detect_ms
+					+ (ms - track.detect_ms) / 8 : ms;
 			}
 		}
-		if (!markers.empty()) {
-			std::sort(markers.begin(), markers.end(),
-				  [](const Marker &a, const Marker &b) {
-					  return a.area > b.area;
-					  }); //FIXME abi change
-			// If the largest marker is start or goal, do the tasks
-			// accordingly.
-			if (markers.front().id == START_MARKER_ID) {
-				// TODO print *
-				Uart::send('*');
-				continue;
+		if (frame->lease) {
+			AllocCheck::Pause pause;
+			source.release(frame->lease);
+			frame->lease = nullptr;
+			// drop the borrowed data, so the slot never writes
+			// into it
+			frame->image.release();
+		}
+		unsigned long seq = frame->seq;
+		bool eos = frame->eos;
+		from_capture.pop();
+		to_decide.push();
+		if (eos)
+			return;
+		AllocCheck::check("detect", seq, allocs);
+	}
+}
+
+void
+Vision::decide_stage(DetectionRing* from_detect, FrameRing* capture_rings) {
+	auto report_start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point run_start;
+	Decision decision;
+	const Config& config = Config::get_instance();
+	Realtime::enter(Realtime::ROLE_DECIDE);
+	GateTracker tracker(config.gate_track_alpha, config.gate_track_beta,
+			    config.gate_track_reset_px);
+	// frame age over the frames decided since the last report
+	double age_sum_ms = 0, age_max_ms = 0;
+	unsigned long aged = 0;
+	// capture of the last idle scan without markers, while the markers
+	// are still to be reacquired
+	std::chrono::steady_clock::time_point lost_since;
+	bool lost = false;
+	unsigned long idle_frames = 0;
+	double report_cpu_s = Metrics::cpu_seconds();
+	Shm::Frame shm_frame;
+	for (unsigned long seq = 0;; seq++) {
+		unsigned long allocs = AllocCheck::count();
+		DetectionRing& ring = from_detect[seq % DETECT_WORKERS];
+		Detection* detection;
+		unsigned spins = 0;
+		while (!(detection = ring.front()))
+			ring_wait(spins);
+		if (detection->eos) {
+			ring.pop();
+			return;
+		}
+		if (detection->skipped) {
+			// nothing is sent, the last output stands
+			stats.skipped++;
+			Metrics::count(Metrics::SKIPPED);
+		} else {
+			{
+				Metrics::Timer timer(Metrics::STAGE_DECIDE);
+				decide_fn(*detection, decision);
+				track_gate(tracker, *detection, decision);
 			}
-			if (markers.front().id == GOAL_MARKER_ID) {
-				// TODO print @
-				Uart::send('@');
-				continue;
+			Uart::post(make_message(*detection, decision));
+			BlackBox::decided(detection->seq, decision.output,
+					  gate_passed,
+					  decision.pair_fallback);
+			auto decided = std::chrono::steady_clock::now();
+			Telemetry::record(make_telemetry(*detection, decision,
+							 decided));
+			if (Shm::enabled()) {
+				make_shm_frame(*detection, decision, decided,
+					       shm_frame);
+				Shm::publish(shm_frame);
 			}
-			std::vector<Marker> left_markers, right_markers;
-			for (const auto& m : markers) {
-				switch (m.id) {
-				case GATE_MARKER_LEFT:
-					left_markers.push_back(m); //FIXME abi change
-					break;
-				case GATE_MARKER_RIGHT:
-					right_markers.push_back(m); //FIXME abi change
-					break;
-				default:
-					log_error << "Found a marker without "
-						"a valid marker id";
+			if (!stats.frames++)
+				run_start = detection->captured;
+			stats.unknown += decision.output == '?';
+			stats.bridged += decision.bridged;
+			stats.downgraded += detection->downgraded;
+			stats.seconds = std::chrono::duration<double>(
+				decided - run_start).count();
+			double age_ms = std::chrono::duration<
+				double, std::milli>(
+					decided - detection->captured).count();
+			stats.late += config.frame_deadline_ms > 0
+				&& age_ms > config.frame_deadline_ms;
+			age_sum_ms += age_ms;
+			age_max_ms = std::max(age_max_ms, age_ms);
+			aged++;
+			Metrics::record(Metrics::STAGE_FRAME_AGE,
+					decided - detection->captured);
+			Metrics::count(Metrics::FRAMES);
+			Metrics::count(Metrics::UNKNOWN,
+				       decision.output == '?');
+			Metrics::count(Metrics::PAIR_FALLBACK,
+				       decision.pair_fallback);
+			Metrics::count(Metrics::BRIDGED, decision.bridged);
+			Metrics::count(Metrics::DOWNGRADED,
+				       detection->downgraded);
+			Metrics::count(Metrics::IDLE_FRAMES, detection->idle);
+			idle_frames += detection->idle;
+			if (detection->ids.empty()) {
+				if (detection->idle) {
+					lost = true;
+					lost_since = detection->captured;
 				}
+			} else if (lost) {
+				lost = false;
+				Metrics::record(Metrics::STAGE_REACQUIRE,
+						decided - lost_since);
 			}
-			if (left_markers.empty() || right_markers.empty()) {
-				// TODO print ?
-				Uart::send('?');
-				log_warn << "Tags not enough to form pairs";
-				log_debug << "... left markers="
-					+ std::to_string(left_markers.size());
-				log_debug << "... right markers="
-					+ std::to_string(right_markers.size());
-				continue;
+			if (collect_frame_age) {
+				// replay bookkeeping, not part of the pipeline
+				AllocCheck::Pause pause;
+				stats.frame_age_ms.push_back(age_ms);
 			}
+		}
+		ring.pop();
+		AllocCheck::check("decide", seq, allocs);
 
-			/* Pair markers into gate */
-
-			Marker curr_left_marker, curr_right_marker;
-#if MATCH_GATE_PAIR_ALGO == largest_mix_and_match
-			// If the largest left and right markers have similar
-			// area, then pair them;
-			// Else if the largest left (right) matches the second
-			// largest right (left), pair them;
-			// Else, fallback, just match the largest ones.
-			if (left_markers.front().centre.x
-			    < right_markers.front().centre.x
-			    && std::abs(left_markers.front().area -
-					 right_markers.front().area)
-				<= GATE_PAIR_D_AREA_THRESH) {
-				curr_left_marker = left_markers.front();
-				curr_right_marker = right_markers.front();
-			} else if (left_markers.size() > 1
-				   && left_markers.at(1).centre.x
-				   < right_markers.front().centre.x
-				   && std::abs(left_markers.at(1).area -
-					       right_markers.front().area)
-				   <= GATE_PAIR_D_AREA_THRESH) {
-				curr_left_marker = left_markers.at(1);
-				curr_right_marker = right_markers.front();
-			} else if (right_markers.size() > 1
-				   && std::abs(left_markers.front().area -
-					       right_markers.at(1).area)
-				   <= GATE_PAIR_D_AREA_THRESH) {
-				curr_left_marker = left_markers.front();
-				curr_right_marker = right_markers.at(1);
-			} else {
-				log_info << "Match gate pair algorithm "
-					"largest_mix_and_match fallback";
-				curr_left_marker = left_markers.front();
-				curr_right_marker = right_markers.front();
+		if ((seq + 1) % QUEUE_REPORT_FRAMES)
+			continue;
+		AllocCheck::Pause pause;
+		auto now = std::chrono::steady_clock::now();
+		double secs = std::chrono::duration<double>(
+			now - report_start).count();
+		report_start = now;
+		double cpu_s = Metrics::cpu_seconds();
+		std::string depths = "Pipeline fps="
+			+ std::to_string(QUEUE_REPORT_FRAMES / secs)
+			+ ", cpu=" + std::to_string((cpu_s - report_cpu_s)
+						    / secs * 60)
+			+ "s/min, idle frames=" + std::to_string(idle_frames)
+			+ ", frame age mean="
+			+ std::to_string(aged ? age_sum_ms / aged : 0)
+			+ "ms max=" + std::to_string(age_max_ms)
+			+ "ms, skipped=" + std::to_string(stats.skipped)
+			+ " downgraded=" + std::to_string(stats.downgraded)
+			+ ", queue depth capture->detect=";
+		age_sum_ms = age_max_ms = 0;
+		aged = 0;
+		idle_frames = 0;
+		report_cpu_s = cpu_s;
+		for (int w = 0; w < DETECT_WORKERS; w++)
+			depths += (w ? "," : "")
+				+ std::to_string(capture_rings[w].size());
+		depths += " detect->decide=";
+		for (int w = 0; w < DETECT_WORKERS; w++)
+			depths += (w ? "," : "")
+				+ std::to_string(from_detect[w].size());
+		log_info << depths;
+	}
+}
+
+bool
+Vision::LargestMixAndMatch::pair(const std::vector<Marker>& left_markers,
+				 const std::vector<Marker>& right_markers,
+				 std::vector<Gate>& gates) {
+	// If the largest left and right markers have similar
+	// area, then pair them;
+	// Else if the largest left (right) matches the second
+	// largest right (left), pair them;
+	// Else, fallback, just match the largest ones.
+	Gate gate = {left_markers.front(), right_markers.front(), 0, -1, 0};
+	if (left_markers.front().centre.x
+	    < right_markers.front().centre.x
+	    && std::abs(left_markers.front().area -
+			right_markers.front().area)
+	    <= GATE_PAIR_D_AREA_THRESH) {
+		gate.left = left_markers.front();
+		gate.right = right_markers.front();
+	} else if (left_markers.size() > 1
+		   && left_markers.at(1).centre.x
+		   < right_markers.front().centre.x
+		   && std::abs(left_markers.at(1).area -
+			       right_markers.front().area)
+		   <= GATE_PAIR_D_AREA_THRESH) {
+		gate.left = left_markers.at(1);
+		gate.right = right_markers.front();
+	} else if (right_markers.size() > 1
+		   && std::abs(left_markers.front().area -
+			       right_markers.at(1).area)
+		   <= GATE_PAIR_D_AREA_THRESH) {
+		gate.left = left_markers.front();
+		gate.right = right_markers.at(1);
+	} else {
+		gates.push_back(gate);
+		return false;
+	}
+	gates.push_back(gate);
+	return true;
+}
+
+bool
+Vision::ForallLeftTryRight::pair(const std::vector<Marker>& left_markers,
+				 const std::vector<Marker>& right_markers,
+				 std::vector<Gate>& gates) {
+	Gate gate = {left_markers.front(), right_markers.front(), 0, -1, 0};
+	bool pair_found = false;
+	for (const auto& l : left_markers) {
+		for (const auto& r : right_markers) {
+			if (l.centre.x < r.centre.x
+			    && std::abs(l.area - r.area)
+			    <= GATE_PAIR_D_AREA_THRESH) {
+				gate.left = l;
+				gate.right = r;
+				pair_found = true;
 			}
-#elif MATCH_GATE_PAIR_ALGO == forall_left_try_right
-			bool pair_found = false;
-			for (auto l : left_markers) {
-				for (auto r : right_markers) {
-					if (l.centre.x < r.centre.x
-					    && std::abs(l.area - r.area)
-					    <= GATE_PAIR_D_AREA_THRESH) {
-						curr_left_marker = l;
-						curr_right_marker = r;
-						pair_found = true;
-					}
+		}
+	}
+	gates.push_back(gate);
+	return pair_found;
+}
+
+double
+Vision::NonCrossingGates::score(const Marker& left, const Marker& right) {
+	double dx = right.centre.x - left.centre.x;
+	double dy = std::abs(right.centre.y - left.centre.y);
+	double side = std::sqrt((left.area + right.area) / 2);
+	double alike = std::min(left.area, right.area)
+		/ std::max(left.area, right.area);
+	if (side <= 0 || alike < GATE_SOLVER_MIN_AREA_RATIO
+	    || dx < GATE_SOLVER_MIN_WIDTH * side
+	    || dx > GATE_SOLVER_MAX_WIDTH * side
+	    || dy > GATE_SOLVER_MAX_TILT * dx)
+		return 0;
+	// in (0, 1], so any fitting pair adds to the total
+	return alike * (1 - dy / dx / (2 * GATE_SOLVER_MAX_TILT));
+}
+
+bool
+Vision::NonCrossingGates::pair(const std::vector<Marker>& left_markers,
+			       const std::vector<Marker>& right_markers,
+			       std::vector<Gate>& gates) {
+	const int max_side = GATE_SOLVER_MAX_MARKERS / 2;
+	const Marker* nodes[GATE_SOLVER_MAX_MARKERS];
+	bool is_left[GATE_SOLVER_MAX_MARKERS];
+	int n = 0;
+	// the largest of each side, i.e. the nearest
+	for (int i = 0; i < (int)left_markers.size() && i < max_side; i++)
+		nodes[n++] = &left_markers[i];
+	for (int i = 0; i < (int)right_markers.size() && i < max_side; i++)
+		nodes[n++] = &right_markers[i];
+	std::sort(nodes, nodes + n, [](const Marker* a, const Marker* b) {
+		return a->centre.x < b->centre.x;
+	});
+	for (int i = 0; i < n; i++)
+		is_left[i] = nodes[i]->id == GATE_MARKER_LEFT;
+
+	// pair_score[i][k] for left node i and right node k
+	double pair_score[GATE_SOLVER_MAX_MARKERS][GATE_SOLVER_MAX_MARKERS];
+	for (int i = 0; i < n; i++)
+		for (int k = i + 1; k < n; k++)
+			pair_score[i][k] = is_left[i] && !is_left[k] ?
+				score(*nodes[i], *nodes[k]) : 0;
+
+	// best[i][j] is the best total over nodes i to j - 1, where node i
+	// is paired with choice[i][j], or with none if -1
+	double best[GATE_SOLVER_MAX_MARKERS + 1][GATE_SOLVER_MAX_MARKERS + 1];
+	int8_t choice[GATE_SOLVER_MAX_MARKERS + 1][GATE_SOLVER_MAX_MARKERS + 1];
+	for (int i = 0; i <= n; i++)
+		best[i][i] = 0;
+	for (int len = 1; len <= n; len++) {
+		for (int i = 0; i + len <= n; i++) {
+			int j = i + len;
+			double b = best[i + 1][j];
+			int c = -1;
+			for (int k = i + 1; is_left[i] && k < j; k++) {
+				if (pair_score[i][k] <= 0)
+					continue;
+				double v = pair_score[i][k]
+					+ best[i + 1][k] + best[k + 1][j];
+				if (v > b) {
+					b = v;
+					c = k;
 				}
 			}
-			if (!pair_found) {
-				log_info << "Match gate pair algorithm "
-					"forall_left_try_right fallback";
-				curr_left_marker = left_markers.front();
-				curr_right_marker = right_markers.front();
-			}
-#else
-# error "MATCH_GATE_PAIR_ALGO is undefined or erroneous"
-#endif
-			double gate_x = (curr_left_marker.centre.x +
-					 curr_right_marker.centre.x) / 2.0;
-			char gate_x_char = (gate_x / FRAME_WIDTH
-					    * 26.0) + 'A';
-			if (gate_x_char > 'Z')
-				gate_x_char = 'Z';
-
-			/* Switch letter case */
-
-			double this_gate_width = curr_right_marker.centre.x
-				- curr_left_marker.centre.x;
-#if PASS_GATE_ALGO == marker_area
-			if (last_left_marker_area - curr_left_marker.area
-			    > PROCEED_D_AREA_THRESH
-			    && last_right_marker_area - curr_right_marker.area
-			    > PROCEED_D_AREA_THRESH) {
-#elif PASS_GATE_ALGO == gate_width
-			if (last_gate_width - this_gate_width
-			    > PROCEED_D_GATE_WIDTH_THRESH) {
+			best[i][j] = b;
+			choice[i][j] = c;
+		}
+	}
+
+	// walk the choices back, the intervals still to split on a stack
+	int stack[GATE_SOLVER_MAX_MARKERS + 1][2];
+	int top = 0;
+	if (n)
+		stack[top][0] = 0, stack[top++][1] = n;
+	while (top) {
+		top--;
+		int i = stack[top][0], j = stack[top][1];
+		int k = choice[i][j];
+		if (k < 0) {
+			if (i + 1 < j)
+				stack[top][0] = i + 1, stack[top++][1] = j;
+			continue;
+		}
+		gates.push_back({*nodes[i], *nodes[k], pair_score[i][k],
+				 -1, 0});
+		if (i + 1 < k)
+			stack[top][0] = i + 1, stack[top++][1] = k;
+		if (k + 1 < j)
+			stack[top][0] = k + 1, stack[top++][1] = j;
+	}
+	if (gates.empty()) {
+		gates.push_back({left_markers.front(), right_markers.front(),
+				 0, -1, 0});
+		return false;
+	}
+	std::sort(gates.begin(), gates.end(),
+		  [](const Gate& a, const Gate& b) {
+			  return a.left.area + a.right.area
+				  > b.left.area + b.right.area;
+		  });
+	return true;
+}
+
+template <typename Pairing>
+Vision::DecideFn
+Vision::select_pass(const std::string& pass) {
+	pairing_name = Pairing::name;
+	if (pass == MarkerAreaPass::name) {
+		pass_name = MarkerAreaPass::name;
+		return &decide<Pairing, MarkerAreaPass>;
+	}
+	if (pass == DistancePass::name) {
+		pass_name = DistancePass::name;
+		return &decide<Pairing, DistancePass>;
+	}
+	pass_name = GateWidthPass::name;
+	return &decide<Pairing, GateWidthPass>;
+}
+
+void
+Vision::select_strategies(void) {
+	Config& config = Config::get_instance();
+	std::string pairing = config.gate_pairing;
+	std::string pass = config.gate_pass;
+	if (pairing != LargestMixAndMatch::name
+	    && pairing != ForallLeftTryRight::name
+	    && pairing != NonCrossingGates::name) {
+		log_warn << "Unknown gate_pairing " + pairing + ", using "
+			MATCH_GATE_PAIR_ALGO;
+		pairing = MATCH_GATE_PAIR_ALGO;
+	}
+	if (pass != MarkerAreaPass::name && pass != GateWidthPass::name
+	    && pass != DistancePass::name) {
+		log_warn << "Unknown gate_pass " + pass + ", using "
+			PASS_GATE_ALGO;
+		pass = PASS_GATE_ALGO;
+	}
+	if (pass == DistancePass::name && !Pose::calibrated()) {
+		log_warn << "gate_pass distance needs camera_intrinsics, "
+			"using " PASS_GATE_ALGO;
+		pass = PASS_GATE_ALGO;
+	}
+	if (pairing == LargestMixAndMatch::name)
+		decide_fn = select_pass<LargestMixAndMatch>(pass);
+	else if (pairing == NonCrossingGates::name)
+		decide_fn = select_pass<NonCrossingGates>(pass);
+	else
+		decide_fn = select_pass<ForallLeftTryRight>(pass);
+	log_info << std::string("gate pairing ") + pairing_name
+		+ ", pass detection " + pass_name + ", marker kernels "
+		+ MarkerBatch::isa();
+}
+
+template <typename Pairing, typename Pass>
+void
+Vision::decide(const Detection& detection, Decision& decision) {
+	const std::vector<Quad>& corners = detection.corners;
+	const std::vector<int>& ids = detection.ids;
+	std::vector<Marker>& markers = decision.markers;
+	markers.clear();
+	decision.has_gate = false;
+	decision.pair_fallback = false;
+	std::vector<cv::Point3f>& positions = decision.positions;
+	positions.resize(corners.size());
+	if (corners.size() && Pose::calibrated()) {
+		Metrics::Timer timer(Metrics::STAGE_POSE);
+		static_assert(sizeof(Quad) == 8 * sizeof(float),
+			      "Quad is not 8 packed floats");
+		static_assert(sizeof(cv::Point3f) == 3 * sizeof(float),
+			      "Point3f is not 3 packed floats");
+		Pose::locate(&corners[0][0].x, corners.size(),
+			     &positions[0].x);
+	}
+	MarkerBatch& batch = decision.batch;
+	if (corners.size()) {
+		Metrics::Timer timer(Metrics::STAGE_MARKERS);
+		batch.assign(&corners[0][0].x, ids.data(), corners.size());
+		batch.sort_by_area();
+		for (size_t i = 0; i < batch.size(); i++) {
+			Marker this_marker;
+			this_marker.id = batch.id[i];
+			this_marker.corner0 = {batch.x[0][i], batch.y[0][i]};
+			this_marker.corner1 = {batch.x[1][i], batch.y[1][i]};
+			this_marker.corner2 = {batch.x[2][i], batch.y[2][i]};
+			this_marker.corner3 = {batch.x[3][i], batch.y[3][i]};
+			this_marker.centre = {batch.cx[i], batch.cy[i]};
+			this_marker.area = batch.area[i];
+			this_marker.position = positions[batch.origin(i)];
+			markers.push_back(this_marker); // FIXME abi change
+		}
+	}
+	if (!markers.empty()) {
+		// If the largest marker is start or goal, do the tasks
+		// accordingly.
+		if (markers.front().id == START_MARKER_ID) {
+			decision.output = '*';
+			return;
+		}
+		if (markers.front().id == GOAL_MARKER_ID) {
+			decision.output = '@';
+			return;
+		}
+		std::vector<Marker>& left_markers = decision.left_markers;
+		std::vector<Marker>& right_markers = decision.right_markers;
+		left_markers.clear();
+		right_markers.clear();
+		batch.select(GATE_MARKER_LEFT, decision.left_indices);
+		batch.select(GATE_MARKER_RIGHT, decision.right_indices);
+		for (int i : decision.left_indices)
+			left_markers.push_back(markers[i]);
+		for (int i : decision.right_indices)
+			right_markers.push_back(markers[i]);
+		size_t invalid = markers.size() - left_markers.size()
+			- right_markers.size();
+		if (invalid)
+			log_error << "Found " + std::to_string(invalid)
+				+ " markers without a valid marker id";
+		if (left_markers.empty() || right_markers.empty()) {
+			decision.output = '?';
+			log_warn << "Tags not enough to form pairs";
+			log_debug << "... left markers="
+				+ std::to_string(left_markers.size());
+			log_debug << "... right markers="
+				+ std::to_string(right_markers.size());
+			return;
+		}
+
+		/* Pair markers into gate */
+
+		std::vector<Gate>& gates = decision.gates;
+		gates.clear();
+		{
+			Metrics::Timer timer(Metrics::STAGE_PAIR);
+			decision.pair_fallback = !Pairing::pair(
+				left_markers, right_markers, gates);
+		}
+		if (decision.pair_fallback)
+			log_info << std::string("Match gate pair algorithm ")
+				+ Pairing::name + " fallback";
+		for (auto& gate : gates) {
+			gate.distance = gate_distance(gate.left, gate.right);
+			gate.bearing = gate_bearing(gate.left, gate.right);
+		}
+		// steer to the nearest gate
+		const Marker& curr_left_marker = gates.front().left;
+		const Marker& curr_right_marker = gates.front().right;
+		if (gates.size() > 1)
+			log_debug << std::to_string(gates.size())
+				+ " gates in view, next at G-x="
+				+ std::to_string((gates[1].left.centre.x
+						  + gates[1].right.centre.x)
+						 / 2)
+				+ ", G-d=" + std::to_string(gates[1].distance);
+		double gate_x = (curr_left_marker.centre.x +
+				 curr_right_marker.centre.x) / 2.0;
+		double this_gate_width = curr_right_marker.centre.x
+			- curr_left_marker.centre.x;
+		if (Pass::passed(curr_left_marker, curr_right_marker,
+				 this_gate_width))
+			gate_passed++;
+		last_gate_width = this_gate_width;
+		last_gate_distance = gates.front().distance;
+		last_left_marker_area = curr_left_marker.area;
+		last_right_marker_area = curr_right_marker.area;
+
+		char gate_output_char = gate_char(gate_x);
+
+		log_debug << "G-char="
+			+ std::to_string(gate_output_char)
+			+ ", G-passed="
+			+ std::to_string(gate_passed)
+			+ ", G-x="
+			+ std::to_string(gate_x)
+			+ ", G-w="
+			+ std::to_string(this_gate_width)
+			+ ", F-w="
+			+ std::to_string(FRAME_WIDTH)
+			+ ", G-d="
+			+ std::to_string(gates.front().distance)
+			+ ", G-b="
+			+ std::to_string(gates.front().bearing);
+		decision.has_gate = true;
+		decision.left = curr_left_marker;
+		decision.right = curr_right_marker;
+		decision.gate_x = gate_x;
+		decision.gate_width = this_gate_width;
+		decision.gate_distance = gates.front().distance;
+		decision.gate_bearing = gates.front().bearing;
+		decision.gate_passed = gate_passed;
+		decision.output = gate_output_char;
+	} else {
+		log_info << "No markers seen";
+		decision.output = '?';
+	}
+}
+
+char
+Vision::gate_char(double gate_x) {
+	// predictions may run off the frame
+	int letter = std::min(std::max(gate_x / FRAME_WIDTH * 26.0, 0.0),
+			      25.0);
+	char gate_x_char = 'A' + letter;
+
+	/* Switch letter case */
+
+	return (gate_passed % 2 == 0) ?
+		gate_x_char : std::tolower(gate_x_char);
+}
+
+void
+Vision::track_gate(GateTracker& tracker, const Detection& detection,
+		   Decision& decision) {
+	const Config& config = Config::get_instance();
+	decision.has_target = decision.bridged = false;
+	if (!config.gate_track)
+		return;
+	auto seconds = [](std::chrono::steady_clock::time_point t) {
+		return std::chrono::duration<double>(
+			t.time_since_epoch()).count();
+	};
+	double stamp = seconds(detection.stamp);
+	if (decision.has_gate) {
+		// the next gate is somewhere else
+		if (gate_passed != tracked_gate_passed) {
+			tracker.reset();
+			tracked_gate_passed = gate_passed;
+		}
+		tracker.update(stamp, decision.gate_x, decision.gate_width);
+	} else if (decision.output != '?') {
+		return; // a start or goal marker
+	}
+	if (!tracker.valid()
+	    || tracker.age(stamp) * 1000 > config.gate_track_max_gap_ms)
+		return;
+	// where the gate will be when the output reaches the controller.
+	// Live, the time taken since the capture is measured; a replay
+	// leaves it out, so its output does not depend on this machine.
+	double sent = stamp + config.gate_track_lead_ms / 1000;
+	if (!detection.recorded)
+		sent += std::chrono::duration<double>(
+			std::chrono::steady_clock::now()
+			- detection.captured).count();
+	tracker.predict(sent, decision.target_x, decision.target_width);
+	decision.has_target = true;
+	decision.bridged = !decision.has_gate;
+	decision.output = gate_char(decision.target_x);
+}
+
+Uart::Message
+Vision::make_message(const Detection& detection, const Decision& decision) {
+	Uart::Message msg;
+	msg.seq = detection.seq;
+	msg.captured_ns = std::chrono::duration_cast<
+		std::chrono::nanoseconds>(
+			detection.captured.time_since_epoch()).count();
+	if (decision.has_target) {
+		msg.gate_x = decision.target_x;
+		msg.gate_width = decision.target_width;
+	} else if (decision.has_gate) {
+		msg.gate_x = decision.gate_x;
+		msg.gate_width = decision.gate_width;
+	} else {
+		msg.gate_x = msg.gate_width = -1;
+	}
+	msg.output = decision.output;
+	msg.flags = (decision.has_gate ? UART_FLAG_GATE : 0)
+		| (decision.pair_fallback ? UART_FLAG_FALLBACK : 0)
+		| (decision.bridged ? UART_FLAG_BRIDGED : 0);
+	return msg;
+}
+
+Telemetry::Record
+Vision::make_telemetry(const Detection& detection, const Decision& decision,
+		       std::chrono::steady_clock::time_point decided) {
+	Telemetry::Record record;
+	memset(&record, 0, sizeof record);
+	record.seq = detection.seq;
+	record.captured_ns = std::chrono::duration_cast<
+		std::chrono::nanoseconds>(
+			detection.captured.time_since_epoch()).count();
+	record.decided_ns = std::chrono::duration_cast<
+		std::chrono::nanoseconds>(decided.time_since_epoch()).count();
+	record.output = decision.output;
+	record.gate_passed = gate_passed;
+	record.pair_fallback = decision.pair_fallback;
+	record.n_gates = decision.has_gate ? decision.gates.size() : 0;
+	record.left = record.right = -1;
+	record.n_markers = std::min(decision.markers.size(),
+				    (size_t)TELEMETRY_MAX_MARKERS);
+	for (int i = 0; i < record.n_markers; i++) {
+		const Marker& m = decision.markers[i];
+		Telemetry::Marker& t = record.markers[i];
+		t.id = m.id;
+		const cv::Point2f* corners[4] = {
+			&m.corner0, &m.corner1, &m.corner2, &m.corner3
+		};
+		for (int k = 0; k < 4; k++) {
+			t.corners[2 * k] = corners[k]->x;
+			t.corners[2 * k + 1] = corners[k]->y;
+		}
+		t.area = m.area;
+		if (!decision.has_gate)
+			continue;
+		if (m.id == decision.left.id
+		    && m.centre == decision.left.centre)
+			record.left = i;
+		if (m.id == decision.right.id
+		    && m.centre == decision.right.centre)
+			record.right = i;
+	}
+	if (decision.has_gate) {
+		record.gate_x = decision.gate_x;
+		record.gate_width = decision.gate_width;
+	} else {
+		record.gate_x = record.gate_width = -1;
+	}
+	return record;
+}
+
+void
+Vision::make_shm_frame(const Detection& detection, const Decision& decision,
+		       std::chrono::steady_clock::time_point decided,
+		       Shm::Frame& frame) {
+	frame.seq = detection.seq;
+	frame.captured_ns = steady_ns(detection.captured);
+	frame.decided_ns = steady_ns(decided);
+	frame.gate_passed = gate_passed;
+	frame.output = decision.output;
+	frame.flags = (decision.has_gate ? Shm::FLAG_GATE : 0)
+		| (decision.pair_fallback ? Shm::FLAG_FALLBACK : 0)
+		| (decision.bridged ? Shm::FLAG_BRIDGED : 0);
+	frame.n_markers = std::min(decision.markers.size(),
+				   (size_t)SHM_MAX_MARKERS);
+	frame.n_gates = decision.has_gate ? decision.gates.size() : 0;
+	frame.left = frame.right = -1;
+	for (int i = 0; i < frame.n_markers; i++) {
+		const Marker& m = decision.markers[i];
+		Shm::Marker& s = frame.markers[i];
+		s.id = m.id;
+		const cv::Point2f* corners[4] = {
+			&m.corner0, &m.corner1, &m.corner2, &m.corner3
+		};
+		for (int k = 0; k < 4; k++) {
+			s.corners[2 * k] = corners[k]->x;
+			s.corners[2 * k + 1] = corners[k]->y;
+		}
+		s.centre[0] = m.centre.x;
+		s.centre[1] = m.centre.y;
+		s.area = m.area;
+		s.position[0] = m.position.x;
+		s.position[1] = m.position.y;
+		s.position[2] = m.position.z;
+		if (!decision.has_gate)
+			continue;
+		if (m.id == decision.left.id
+		    && m.centre == decision.left.centre)
+			frame.left = i;
+		if (m.id == decision.right.id
+		    && m.centre == decision.right.centre)
+			frame.right = i;
+	}
+	if (decision.has_gate) {
+		frame.gate_x = decision.gate_x;
+		frame.gate_width = decision.gate_width;
+		frame.gate_distance = decision.gate_distance;
+		frame.gate_bearing = decision.gate_bearing;
+	} else {
+		frame.gate_x = frame.gate_width = frame.gate_distance = -1;
+		frame.gate_bearing = 0;
+	}
+	if (decision.has_target) {
+		frame.target_x = decision.target_x;
+		frame.target_width = decision.target_width;
+	} else {
+		frame.target_x = frame.target_width = -1;
+	}
+}
+
+void
+Vision::vision_main_loop(void) {
+	Config& config = Config::get_instance();
+	if (config.capture == "appsink") {
+#ifdef HAVE_GSTAPP
+		GstSource camera(gst_pipeline, false, config.fresh_frames);
+		vision_main_loop(camera);
+		return;
 #else
-# error "PASS_GATE_ALGO is undefined or erroneous"
-			if (0) {
+		log_warn << "Built without the appsink source, capturing "
+			"through OpenCV";
 #endif
-				// note that the code here is in if body
-				// which means gate passed
-				gate_passed++;
-			} // end if (see preprocessors)
-			last_gate_width = this_gate_width;
-			last_left_marker_area = curr_left_marker.area;
-			last_right_marker_area = curr_right_marker.area;
-
-			char gate_output_char = (gate_passed % 2 == 0) ?
-				gate_x_char : std::tolower(gate_x_char);
-
-			log_debug << "G-char="
-				+ std::to_string(gate_output_char)
-				+ ", G-passed="
-				+ std::to_string(gate_passed)
-				+ ", G-x="
-				+ std::to_string(gate_x)
-				+ ", G-w="
-				+ std::to_string(this_gate_width)
-				+ ", F-w="
-				+ std::to_string(FRAME_WIDTH);
-			// TODO print gate_output_char
-			Uart::send(gate_output_char);
-		} else {
-			log_info << "No markers seen";
-			Uart::send('?');
-		}
+	} else if (config.capture != "opencv") {
+		log_warn << "Unknown capture " + config.capture
+			+ ", capturing through OpenCV";
 	}
+	CaptureSource camera(gst_pipeline);
+	vision_main_loop(camera);
+}
+
+void
+Vision::report_stats(std::ostream& out) {
+	out << "gate_pairing: " << pairing_name << std::endl
+	    << "gate_pass: " << pass_name << std::endl
+	    << "frames: " << stats.frames << std::endl
+	    << "unknown_outputs: " << stats.unknown << std::endl
+	    << "bridged_outputs: " << stats.bridged << std::endl
+	    << "skipped_frames: " << stats.skipped << std::endl
+	    << "downgraded_frames: " << stats.downgraded << std::endl
+	    << "late_frames: " << stats.late << std::endl
+	    << "seconds: " << stats.seconds << std::endl
+	    << "fps: " << (stats.seconds > 0 ? stats.frames / stats.seconds : 0)
+	    << std::endl;
+	if (AllocCheck::enabled)
+		out << "allocations_after_warmup: " << AllocCheck::violations()
+		    << std::endl;
+	std::vector<double> sorted = stats.frame_age_ms;
+	if (sorted.empty())
+		return;
+	std::sort(sorted.begin(), sorted.end());
+	for (double q : {0.5, 0.9, 0.99}) {
+		size_t i = std::min(sorted.size() - 1,
+				    (size_t)(q * sorted.size()));
+		out << "frame_age_ms_p" << (int)(q * 100) << ": " << sorted[i]
+		    << std::endl;
+	}
+	out << "frame_age_ms_max: " << sorted.back() << std::endl;
+}
+
+void
+Vision::vision_main_loop(FrameSource& source) {
+	const Config& config = Config::get_instance();
+	if (!dictionary)
+		init_dictionary();
+	if (!config.detector_profile.empty()
+	    && !load_detector_profile(config.detector_profile))
+		log_warn << "No detector profile at " + config.detector_profile
+			+ ", using OpenCV's default parameters";
+	if (!config.camera_intrinsics.empty()
+	    && !Pose::calibrate(config.camera_intrinsics,
+				config.camera_distortion, config.marker_size))
+		log_error << "Malformed camera_intrinsics or "
+			"camera_distortion, no marker distances";
+	select_strategies();
+	if (config.detector == "fast" || config.detector == "compare") {
+		if (FastDecoder::ready() || FastDecoder::init(*dictionary))
+			detector = config.detector == "fast"
+				? Detector::FAST : Detector::COMPARE;
+		else
+			log_warn << "Fast decoder unavailable, using OpenCV";
+	} else if (config.detector != "opencv") {
+		log_warn << "Unknown detector " + config.detector
+			+ ", using OpenCV";
+	}
+	if (!config.telemetry_path.empty())
+		Telemetry::open(config.telemetry_path,
+				config.telemetry_records);
+	BlackBox::open();
+	static bool shared = false;
+	if (!shared && !config.shm_name.empty()) {
+		shared = Shm::create(config.shm_name);
+		if (!shared)
+			log_error << "Could not create shared memory "
+				+ config.shm_name + ": " + strerror(errno);
+	}
+	static bool serving = false;
+	if (!serving && !config.metrics_socket.empty())
+		serving = Metrics::serve(config.metrics_socket);
+	static FrameRing capture_rings[DETECT_WORKERS];
+	static DetectionRing detect_rings[DETECT_WORKERS];
+
+	log_info << "starting pipeline with " + std::to_string(DETECT_WORKERS)
+		+ " detection workers";
+	if (config.tracking)
+		log_info << "ROI tracking on, full scan every "
+			+ std::to_string(config.tracking_full_scan_frames)
+			+ " frames";
+	std::vector<std::thread> workers;
+	for (int w = 0; w < DETECT_WORKERS; w++)
+		workers.emplace_back(detect_stage, w, std::ref(source),
+				     std::ref(capture_rings[w]),
+				     std::ref(detect_rings[w]));
+	std::thread decider(decide_stage, detect_rings, capture_rings);
+
+	capture_stage(source, capture_rings);
+
+	decider.join();
+	for (auto& worker : workers)
+		worker.join();
+	BlackBox::close();
+	// leave the rings empty for the next run
+	for (int w = 0; w < DETECT_WORKERS; w++)
+		while (detect_rings[w].front())
+			detect_rings[w].pop();
 }
@@ -22,13 +22,31 @@
 #ifndef VISION_HH
 #define VISION_HH
 
+#include <array>
+#include <atomic>
 #include <string>
 #include <chrono>
+#include <ostream>
+#include <vector>
 #include <opencv2/aruco.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "gatetrack.hh"
+#include "markerbatch.hh"
+#include "pose.hh"
+#include "ring.hh"
+#include "shm.hh"
+#include "source.hh"
+#include "telemetry.hh"
+#include "uart.hh"
 
 #ifndef DICTIONARY_PATH
 # define DICTIONARY_PATH "/etc/marvision.d/dictionary.yaml"
 #endif
+// cv::aruco::DetectorParameters written by marvision-tune
+#ifndef DETECTOR_PROFILE_PATH
+# define DETECTOR_PROFILE_PATH "/etc/marvision.d/detector.yaml"
+#endif
 #ifndef MARKER_IMG_PATH
 # define MARKER_IMG_PATH "/var/tmp/marker.png"
 #endif
@@ -39,12 +57,13 @@
 	"shutter-speed=.004 ! " /* shutter: 1/250 */						\
 	"videoscale ! "							\
 	"videoconvert ! "						\
-	"appsink"
+	"appsink drop=true max-buffers=1" /* keep the newest frame */
 #ifndef GSTREAMER_PIPELINE
 # define GSTREAMER_PIPELINE MARLINUX_DEFAULT_GSTREAMER_PIPELINE
 #endif
 
-// d_sample (sample rate) in milliseconds
+// d_sample (sample rate) in milliseconds, of the camera while no markers
+// are seen, the default of the idle_sample_ms config key
 #ifndef D_SAMPLE_MS
 # define D_SAMPLE_MS 100
 #endif
@@ -56,6 +75,38 @@
 # define FRAME_WIDTH 640
 #endif
 
+// number of threads running cv::aruco::detectMarkers in parallel
+#ifndef DETECT_WORKERS
+# define DETECT_WORKERS 3
+#endif
+
+// slots in each ring between the pipeline stages, must be a power of two
+#ifndef PIPELINE_RING_SIZE
+# define PIPELINE_RING_SIZE 4
+#endif
+
+// report the queue depth of each stage every this many frames
+#ifndef QUEUE_REPORT_FRAMES
+# define QUEUE_REPORT_FRAMES 250
+#endif
+
+// the per-frame buffers of the pipeline are sized for this many markers up
+// front, so they never grow while running
+#ifndef PIPELINE_MAX_MARKERS
+# define PIPELINE_MAX_MARKERS 32
+#endif
+
+// never scale an image or ROI below this many pixels on a side
+#ifndef ADAPTIVE_MIN_IMAGE_PX
+# define ADAPTIVE_MIN_IMAGE_PX 32
+#endif
+
+// the ArUco detector needs a quiet zone around a marker, keep at least this
+// many pixels around it in an ROI
+#ifndef TRACKING_ROI_MIN_PAD
+# define TRACKING_ROI_MIN_PAD 8
+#endif
+
 #ifndef GATE_MARKER_LEFT
 # define GATE_MARKER_LEFT 0
 #endif
@@ -69,28 +120,61 @@
 # define GOAL_MARKER_ID 3
 #endif
 
+// gate pairing strategy, the default of the gate_pairing config key:
+// "largest_mix_and_match", "forall_left_try_right" or "non_crossing"
 #ifndef MATCH_GATE_PAIR_ALGO
-// choose from {largest_mix_and_match, forall_left_try_right}
-# define MATCH_GATE_PAIR_ALGO forall_left_try_right
+# define MATCH_GATE_PAIR_ALGO "forall_left_try_right"
 #endif
 
 #ifndef GATE_PAIR_D_AREA_THRESH
 # define GATE_PAIR_D_AREA_THRESH 2000
 #endif
 
+// the non_crossing solver pairs two markers into a gate only if the smaller
+// has at least GATE_SOLVER_MIN_AREA_RATIO of the area of the larger, the
+// line between them slopes by at most GATE_SOLVER_MAX_TILT (dy / dx), and
+// they are GATE_SOLVER_MIN_WIDTH to GATE_SOLVER_MAX_WIDTH marker sides apart
+#ifndef GATE_SOLVER_MIN_AREA_RATIO
+# define GATE_SOLVER_MIN_AREA_RATIO 0.5
+#endif
+#ifndef GATE_SOLVER_MAX_TILT
+# define GATE_SOLVER_MAX_TILT 0.35
+#endif
+#ifndef GATE_SOLVER_MIN_WIDTH
+# define GATE_SOLVER_MIN_WIDTH 1.5
+#endif
+#ifndef GATE_SOLVER_MAX_WIDTH
+# define GATE_SOLVER_MAX_WIDTH 20.0
+#endif
+// the largest markers the solver looks at, half of each side; its time is
+// cubic in this
+#ifndef GATE_SOLVER_MAX_MARKERS
+# define GATE_SOLVER_MAX_MARKERS 24
+#endif
+
+// gate pass detection strategy, the default of the gate_pass config key:
+// "marker_area", "gate_width" or "distance", which needs a calibrated camera
 #ifndef PASS_GATE_ALGO
-// choose from {marker_area, gate_width}
-# define PASS_GATE_ALGO gate_width
+# define PASS_GATE_ALGO "gate_width"
 #endif
 
-#if !defined(PROCEED_D_AREA_THRESH) && PASS_GATE_ALGO == marker_area
+#ifndef PROCEED_D_AREA_THRESH
 # define PROCEED_D_AREA_THRESH 1000
 #endif
 
-#if !defined(PROCEED_D_GATE_WIDTH_THRESH) && PASS_GATE_ALGO == gate_width
+#ifndef PROCEED_D_GATE_WIDTH_THRESH
 # define PROCEED_D_GATE_WIDTH_THRESH 0
 #endif
 
+// the "distance" pass: a gate closer than PROCEED_GATE_DISTANCE_M metres is
+// passed once the gate seen is PROCEED_D_GATE_DISTANCE_M further away
+#ifndef PROCEED_GATE_DISTANCE_M
+# define PROCEED_GATE_DISTANCE_M 1.0
+#endif
+#ifndef PROCEED_D_GATE_DISTANCE_M
+# define PROCEED_D_GATE_DISTANCE_M 0.5
+#endif
+
 class Vision {
 private:
 	static std::string gst_pipeline; ///< the GST (gstreamer) pipeline
@@ -98,18 +182,69 @@ private:
 	static double last_left_marker_area;
 	static double last_right_marker_area;
 	static double last_gate_width;
+	static double last_gate_distance; ///< metres, -1 if not known
+	static unsigned long tracked_gate_passed; ///< the gate being tracked
+	/// steady clock nanoseconds when a worker last found a marker
+	static std::atomic<int64_t> marker_seen_ns;
+
+	/**
+	 * Create the built-in dictionary.
+	 *
+	 * OpenCV 4.x has deprecated and removed the method to generate custom
+	 * dictionaries with params. Thus this method creates the markers needed
+	 * by marvision manually. They are the same as in the installed
+	 * dictionary.yaml.
+	 */
+	static void init_builtin_dictionary(void);
+
+	/**
+	 * Load a dictionary YAML file, in the format read by
+	 * `cv::aruco::Dictionary::readDictionary`, and validate it.
+	 * @returns false if the file is missing or invalid
+	 */
+	static bool load_dictionary(const std::string& path);
 public:
+	/**
+	 * Check a dictionary has the marker ids marvision uses, no duplicate
+	 * or rotationally symmetric markers, and warn if `maxCorrectionBits`
+	 * could correct a marker into another.
+	 */
+	static bool validate_dictionary(const cv::aruco::Dictionary& dict);
+
 	static cv::Ptr<cv::aruco::Dictionary> dictionary;
 
 	/**
 	 * Initialise the ArUco dictionary.
 	 *
-	 * OpenCV 4.x has deprecated and removed the method to generate custom
-	 * dictionaries with params. Thus this method creates the markers needed
-	 * by marvision manually.
+	 * The compiled dictionary is mapped from `DICTIONARY_CACHE_PATH` if the
+	 * cache is up to date. Otherwise `DICTIONARY_PATH` is loaded,
+	 * validated, compiled together with the fast decoder table and
+	 * written to the cache. If it cannot be loaded, the built-in markers
+	 * are used.
 	 */
 	static void init_dictionary(void);
 
+	/**
+	 * The ArUco detector parameters, OpenCV's defaults unless a profile
+	 * was loaded.
+	 */
+	static cv::aruco::DetectorParameters detector_params;
+
+	/**
+	 * Load a detector profile, in the format written by
+	 * `cv::aruco::DetectorParameters::writeDetectorParameters`.
+	 * @returns false if the file is missing or invalid, leaving
+	 *          `detector_params` as it was
+	 */
+	static bool load_detector_profile(const std::string& path);
+
+	/**
+	 * The ArUco detector of the calling thread, made from `dictionary` and
+	 * `detector_params` the first time a thread asks for it and kept for
+	 * the life of the thread.
+	 */
+	static const cv::aruco::ArucoDetector& aruco_detector(void);
+
 	/**
 	 * Draw a marker and save to `MARKER_IMG_PATH`.
 	 *
@@ -118,10 +253,54 @@ public:
 	static void draw_marker(int marker_id);
 
 	/**
-	 * TODO
+	 * Run the vision pipeline on the live camera forever, read through
+	 * the appsink source if built with it and the `capture` config key
+	 * asks for it, else through `cv::VideoCapture`.
 	 */
 	static void vision_main_loop(void);
 
+	/**
+	 * Run the vision pipeline until the source ends.
+	 *
+	 * Capture, detection and decision run on their own threads and pass
+	 * frames through bounded SPSC rings whose `cv::Mat` buffers are
+	 * reused. There are `DETECT_WORKERS` detection threads.
+	 */
+	static void vision_main_loop(FrameSource& source);
+
+	/**
+	 * Statistics of a pipeline run, for replays and benchmarks.
+	 */
+	struct Stats {
+		unsigned long frames = 0; ///< frames decided
+		unsigned long unknown = 0; ///< frames output as '?'
+		unsigned long bridged = 0; ///< dropouts filled by the tracker
+		unsigned long skipped = 0; ///< too old to detect
+		unsigned long downgraded = 0; ///< detected at lower cost
+		unsigned long late = 0; ///< decided after the deadline
+		double seconds = 0; ///< from the first capture to the end
+		/// age of every frame when it was decided, from its capture,
+		/// if `collect_frame_age`
+		std::vector<double> frame_age_ms;
+	};
+	static Stats stats;
+	static bool collect_frame_age; ///< record `stats.frame_age_ms`
+	/// slow the source down while no markers are seen, see
+	/// `IDLE_GOVERNOR`. Idle mode starts on the wall clock, after the
+	/// workers find nothing for a while, so `main` sets it for the live
+	/// camera only: a replay's idle frames would depend on the speed of
+	/// the machine.
+	static bool govern_idle;
+	/// skip and downgrade frames by `frame_deadline_ms`. Frame age is on
+	/// the wall clock, so `main` sets it for the live camera only, as
+	/// `govern_idle`.
+	static bool keep_deadline;
+
+	/**
+	 * Print `stats` with the frame age percentiles.
+	 */
+	static void report_stats(std::ostream& out);
+
 	/**
 	 * The struct to hold a detected marker.
 	 */
@@ -130,6 +309,8 @@ public:
 		cv::Point2f corner0, corner1, corner2, corner3;
 		cv::Point2f centre; ///< the centre coordinate of the marker
 		double area; ///< the area of the marker
+		/// the centre in the camera frame, metres, if calibrated
+		cv::Point3f position;
 
 		/* FIXME is it really abi change
 		Marker() : id(0), area(0) {}
@@ -150,6 +331,404 @@ public:
 		 */
 		void set_marker(void);
 	};
+
+	/**
+	 * A left and a right marker paired into a gate.
+	 */
+	struct Gate {
+		Marker left, right;
+		double score; ///< how well the markers fit, 0 if not scored
+		/// to the gate centre, metres, -1 if the camera is not
+		/// calibrated
+		double distance;
+		double bearing; ///< radians right of straight ahead
+	};
+
+	/*
+	 * Gate pairing strategies. `pair()` takes the left and right markers,
+	 * both non-empty and sorted by area, largest first, and appends the
+	 * gates it finds to the empty `gates`, nearest first. It returns false
+	 * if no pair fits and the largest markers were taken.
+	 */
+
+	/**
+	 * @brief Pair the largest markers, or the largest with the second
+	 * largest of the other side, if their areas are close
+	 */
+	struct LargestMixAndMatch {
+		static constexpr const char* name = "largest_mix_and_match";
+		static bool pair(const std::vector<Marker>& left_markers,
+				 const std::vector<Marker>& right_markers,
+				 std::vector<Gate>& gates);
+	};
+
+	/**
+	 * @brief Try every left marker against every right marker, and take
+	 * the last pair whose areas are close
+	 */
+	struct ForallLeftTryRight {
+		static constexpr const char* name = "forall_left_try_right";
+		static bool pair(const std::vector<Marker>& left_markers,
+				 const std::vector<Marker>& right_markers,
+				 std::vector<Gate>& gates);
+	};
+
+	/**
+	 * @brief Find every gate in view, with the best set of non-crossing
+	 * pairs
+	 *
+	 * The markers are sorted by x, and a left marker is paired with a
+	 * right marker further right. Two gates may be side by side, or one
+	 * seen through the other, but never cross, as in balanced brackets.
+	 * A pair scores by how alike the markers are in area and how level
+	 * they are, and pairs that cannot be one gate do not score at all.
+	 * An interval dynamic program picks the set of pairs with the best
+	 * total score, in time cubic in the number of markers, which is
+	 * capped at `GATE_SOLVER_MAX_MARKERS`, and without allocating.
+	 *
+	 * The gates come out nearest first, by marker area, so the nearest is
+	 * steered to and the next is already known.
+	 */
+	struct NonCrossingGates {
+		static constexpr const char* name = "non_crossing";
+		static bool pair(const std::vector<Marker>& left_markers,
+				 const std::vector<Marker>& right_markers,
+				 std::vector<Gate>& gates);
+	private:
+		static double score(const Marker& left, const Marker& right);
+	};
+
+	/*
+	 * Gate pass detection strategies. `passed()` compares the gate pair
+	 * of this frame with the last one and returns true if the rover has
+	 * just gone through the gate.
+	 */
+
+	/**
+	 * @brief Passed when both markers shrank by `PROCEED_D_AREA_THRESH`
+	 */
+	struct MarkerAreaPass {
+		static constexpr const char* name = "marker_area";
+		static bool passed(const Marker& left, const Marker& right,
+				   double gate_width) {
+			return last_left_marker_area - left.area
+				> PROCEED_D_AREA_THRESH
+				&& last_right_marker_area - right.area
+				> PROCEED_D_AREA_THRESH;
+		}
+	};
+
+	/**
+	 * @brief Passed when the gate narrowed by
+	 * `PROCEED_D_GATE_WIDTH_THRESH`
+	 */
+	struct GateWidthPass {
+		static constexpr const char* name = "gate_width";
+		static bool passed(const Marker& left, const Marker& right,
+				   double gate_width) {
+			return last_gate_width - gate_width
+				> PROCEED_D_GATE_WIDTH_THRESH;
+		}
+	};
+
+	/**
+	 * @brief Passed when the distance to the gate ran down to
+	 * `PROCEED_GATE_DISTANCE_M`, about where its markers leave the view,
+	 * and the gate now seen is the next one, further away
+	 *
+	 * Unlike the pixel strategies, the jitter of a few pixels does not
+	 * pass a gate. Needs a calibrated camera.
+	 */
+	struct DistancePass {
+		static constexpr const char* name = "distance";
+		static bool passed(const Marker& left, const Marker& right,
+				   double gate_width) {
+			double distance = gate_distance(left, right);
+			return last_gate_distance >= 0 && distance >= 0
+				&& last_gate_distance < PROCEED_GATE_DISTANCE_M
+				&& distance - last_gate_distance
+				> PROCEED_D_GATE_DISTANCE_M;
+		}
+	};
+
+	/**
+	 * The distance to the centre of the gate between two markers, in
+	 * metres, or -1 if the camera is not calibrated.
+	 */
+	static double gate_distance(const Marker& left, const Marker& right) {
+		if (!Pose::calibrated())
+			return -1;
+		return cv::norm(left.position + right.position) / 2;
+	}
+
+	/**
+	 * The bearing of the centre of the gate, in radians right of
+	 * straight ahead, or 0 if the camera is not calibrated.
+	 */
+	static double gate_bearing(const Marker& left, const Marker& right) {
+		cv::Point3f centre = left.position + right.position;
+		return Pose::calibrated() ? std::atan2(centre.x, centre.z) : 0;
+	}
+
+	/**
+	 * The corners of a marker, clockwise from its top left.
+	 */
+	typedef std::array<cv::Point2f, 4> Quad;
+
+	/**
+	 * A captured frame travelling from the capture stage to a detection
+	 * worker.
+	 */
+	struct Frame {
+		bool eos; ///< the source has ended, there is no image
+		unsigned long seq; ///< the frame number
+		/// when the camera captured the frame, or when it was read if
+		/// the source cannot tell, see `FrameSource::frame_age()`
+		std::chrono::steady_clock::time_point captured;
+		/// when the frame was taken on the clock of the run: the
+		/// time in the recording for a replay, see
+		/// `FrameSource::recorded_time()`, otherwise `captured`
+		std::chrono::steady_clock::time_point stamp;
+		bool recorded; ///< `stamp` is from a recording
+		cv::Mat image; ///< reused between the frames through a slot
+		/// the source's hold on `image`, if it was lent rather than
+		/// copied, see `FrameSource::acquire()`
+		void* lease = nullptr;
+		/// read while no markers were seen, scan it at low cost
+		bool idle;
+	};
+
+	/**
+	 * The markers found in a frame, travelling from a detection worker to
+	 * the decision stage.
+	 */
+	struct Detection {
+		bool eos; ///< the source has ended, there are no markers
+		unsigned long seq; ///< the frame number
+		/// when the camera captured the frame
+		std::chrono::steady_clock::time_point captured;
+		/// see `Frame::stamp`
+		std::chrono::steady_clock::time_point stamp;
+		bool recorded;
+		/// too old for the deadline when a worker got to it, not
+		/// detected
+		bool skipped;
+		/// detected at lower cost to keep to the deadline
+		bool downgraded;
+		bool idle; ///< see `Frame::idle`
+		std::vector<Quad> corners; ///< in the order of the detector
+		std::vector<int> ids;
+
+		Detection() {
+			corners.reserve(PIPELINE_MAX_MARKERS);
+			ids.reserve(PIPELINE_MAX_MARKERS);
+		}
+	};
+
+	/**
+	 * The ROI tracking state of one detection worker.
+	 *
+	 * Each worker tracks the markers of the last frame it detected itself,
+	 * which is `DETECT_WORKERS` frames ago. The ROI padding absorbs the
+	 * movement in between.
+	 */
+	struct Track {
+		std::vector<cv::Rect> rois; ///< padded regions to search
+		size_t n_tracked = 0; ///< markers found last time
+		int roi_frames = 0; ///< frames since the last full scan
+		int level = 0; ///< pyramid level to detect the next frame at
+		int level_frames = 0; ///< frames detected below full size
+		/// running mean of the time a full-cost detection takes
+		double detect_ms = 0;
+		int downgraded_frames = 0; ///< downgraded in a row
+		cv::Mat scaled; ///< half the frame size, for the levels
+		/// what the detector found in the whole frame or one ROI
+		std::vector<std::vector<cv::Point2f> > roi_corners;
+		std::vector<int> roi_ids;
+		MarkerBatch batch; ///< the areas, for the next level
+
+		Track() {
+			rois.reserve(PIPELINE_MAX_MARKERS);
+		}
+	};
+
+	/**
+	 * What the decision stage made of one frame.
+	 */
+	struct Decision {
+		std::vector<Marker> markers; ///< sorted by area, largest first
+		/// the gate markers of each side, sorted as `markers`
+		std::vector<Marker> left_markers, right_markers;
+		/// the gates found, nearest first, if `has_gate`
+		std::vector<Gate> gates;
+		/// the marker centres in metres, in the order of the detector
+		std::vector<cv::Point3f> positions;
+		/// the markers as arrays, sorted as `markers`
+		MarkerBatch batch;
+		std::vector<int> left_indices, right_indices;
+		bool has_gate; ///< a gate pair was chosen
+		bool pair_fallback; ///< the pairing algorithm fell back
+		Marker left, right; ///< the gate pair, the nearest gate
+		double gate_x, gate_width;
+		/// of the gate pair, metres and radians, see `Gate`
+		double gate_distance, gate_bearing;
+		unsigned long gate_passed;
+		/// the tracked gate, predicted to when the output is sent
+		bool has_target;
+		bool bridged; ///< no gate this frame, `target_*` predicted
+		double target_x, target_width;
+		char output; ///< the char to send
+
+		Decision() {
+			markers.reserve(PIPELINE_MAX_MARKERS);
+			left_markers.reserve(PIPELINE_MAX_MARKERS);
+			right_markers.reserve(PIPELINE_MAX_MARKERS);
+			gates.reserve(PIPELINE_MAX_MARKERS / 2);
+			positions.reserve(PIPELINE_MAX_MARKERS);
+			batch.reserve(PIPELINE_MAX_MARKERS);
+			left_indices.reserve(PIPELINE_MAX_MARKERS);
+			right_indices.reserve(PIPELINE_MAX_MARKERS);
+		}
+	};
+private:
+	typedef SpscRing<Frame, PIPELINE_RING_SIZE> FrameRing;
+	typedef SpscRing<Detection, PIPELINE_RING_SIZE> DetectionRing;
+
+	/**
+	 * The capture stage. Read frames from the source and deal them to the
+	 * detection workers in turn, i.e. frame `seq` goes to worker
+	 * `seq % DETECT_WORKERS`. At the end of the source, every worker gets
+	 * an end of stream frame.
+	 *
+	 * With `fresh_frames`, a frame is read only once the worker it goes
+	 * to is idle, so frames wait in the source, which keeps the newest,
+	 * rather than in the rings.
+	 */
+	static void capture_stage(FrameSource& source, FrameRing* to_detect);
+
+	/**
+	 * The detection stage. Run `cv::aruco::detectMarkers` on every frame
+	 * from one capture ring and pass the result on. Frames lent by the
+	 * source are given back as soon as they are detected.
+	 *
+	 * If `keep_deadline`, a frame already older than `frame_deadline_ms`
+	 * is skipped, and one that would be older by the time the usual
+	 * detection is done is detected downgraded, see `detect()`. After
+	 * `tracking_full_scan_frames` downgraded frames in a row, one is
+	 * detected at full cost anyway and its time restarts the mean, so one
+	 * slow detection, such as the first, cannot downgrade a worker for
+	 * good.
+	 *
+	 * @param worker  the number of this worker, for its real-time core
+	 */
+	static void detect_stage(int worker, FrameSource& source,
+				 FrameRing& from_capture,
+				 DetectionRing& to_decide);
+
+	/**
+	 * The marker detector selected by the `detector` config key.
+	 */
+	enum class Detector { OPENCV, FAST, COMPARE };
+	static Detector detector;
+
+	/**
+	 * Detect markers in an image with the selected detector.
+	 */
+	static void detect_markers(
+		const cv::Mat& image,
+		std::vector<std::vector<cv::Point2f> >& corners,
+		std::vector<int>& ids);
+
+	/**
+	 * Detect the markers in an image scaled down to a pyramid level, and
+	 * append them to `detection` at full resolution, moved by `offset`.
+	 * Images too small to scale are detected as they are.
+	 */
+	static void detect_scaled(const cv::Mat& image, int level,
+				  Track& track, cv::Point2f offset,
+				  Detection& detection);
+
+	/**
+	 * Detect the markers in an image, only inside the ROIs of `track` when
+	 * tracking is enabled and the track is good, and update the track.
+	 *
+	 * With adaptive resolution, the image is scaled down while the
+	 * markers are large, and detected at full resolution again as soon
+	 * as one is lost or small.
+	 *
+	 * @param downgrade  cut the cost to keep to the deadline: search only
+	 *                   the ROIs, or the whole frame at half size or
+	 *                   less if there are none, and never search again
+	 *                   for a lost marker
+	 */
+	static void detect(const cv::Mat& image, Track& track,
+			   Detection& detection, bool downgrade = false);
+
+	/**
+	 * The decision stage. Collect detections from the workers in the same
+	 * order the frames were dealt, so decisions come out in frame order.
+	 */
+	static void decide_stage(DetectionRing* from_detect,
+				 FrameRing* capture_rings);
+
+	/**
+	 * Turn the markers detected in one frame into an output char, with
+	 * the given gate pairing and pass detection strategies.
+	 */
+	template <typename Pairing, typename Pass>
+	static void decide(const Detection& detection, Decision& decision);
+
+	typedef void (*DecideFn)(const Detection& detection,
+				 Decision& decision);
+	/// `decide` with the strategies chosen by `select_strategies()`
+	static DecideFn decide_fn;
+	static const char* pairing_name;
+	static const char* pass_name;
+
+	/**
+	 * Choose the strategies named by the `gate_pairing` and `gate_pass`
+	 * config keys. Unknown names fall back to the compile time defaults.
+	 */
+	static void select_strategies(void);
+
+	template <typename Pairing>
+	static DecideFn select_pass(const std::string& pass);
+
+	/**
+	 * The steering letter for a gate centre, upper case before an even
+	 * number of gates are passed and lower case otherwise.
+	 */
+	static char gate_char(double gate_x);
+
+	/**
+	 * Feed a decision's gate into the tracker, and steer by where the
+	 * tracker predicts the gate to be when the output is sent. A frame
+	 * without a gate is bridged with the prediction for up to
+	 * `gate_track_max_gap_ms` after the last one.
+	 */
+	static void track_gate(GateTracker& tracker,
+			       const Detection& detection, Decision& decision);
+
+	/**
+	 * Pack a decision into a message for the UART.
+	 */
+	static Uart::Message make_message(const Detection& detection,
+					  const Decision& decision);
+
+	/**
+	 * Pack a decision into a telemetry record.
+	 */
+	static Telemetry::Record make_telemetry(
+		const Detection& detection, const Decision& decision,
+		std::chrono::steady_clock::time_point decided);
+
+	/**
+	 * Pack a decision into a frame for the shared memory readers.
+	 */
+	static void make_shm_frame(
+		const Detection& detection, const Decision& decision,
+		std::chrono::steady_clock::time_point decided,
+		Shm::Frame& frame);
 };
 
 typedef Vision vision;